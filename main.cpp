@@ -1,13 +1,41 @@
+#if (defined(AIR_BENCH) || defined(AIR_REPLAY) || defined(AIR_CORO)) && !defined(AIR_SIM)
+#define AIR_SIM
+#endif
+
+#ifdef AIR_SIM
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef AIR_CORO
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <vector>
+#endif
+#if defined(AIR_RTOS) || defined(AIR_BENCH)
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+#else
 #include "mbed.h"
+#endif
 #include "math.h"
+#include "stddef.h"
+#include <atomic>
 
 /**
  * All the following code is original, no libraries, other than what Mbed 
  * provides, were used.
  */
 
-I2C i2c(p9, p10);
-
 /*
 Byte reference:
 
@@ -22,25 +50,119 @@ is used to indicate if the transaction is a read or write. This bit
 will be set by the Mbed I2C API.
 */
 
+/**
+ * Air sensor register map.
+ *
+ * Registers and their bit fields are described at compile time so masks and
+ * shifts are derived from one place and checked by static_asserts. Field
+ * accessors compile down to a single shift and mask.
+ */
+
+/**
+ * Air sensor register.
+ * ADDR: Register address (mailbox ID)
+ * LEN: Register size in bytes
+ */
+template <char ADDR, int LEN>
+struct air_reg_t {
+    static_assert(LEN > 0, "register must be at least one byte");
+    
+    static constexpr char addr = ADDR;
+    static constexpr int len = LEN;
+};
+
+template <char ADDR, int LEN>
+constexpr char air_reg_t<ADDR, LEN>::addr;
+
+template <char ADDR, int LEN>
+constexpr int air_reg_t<ADDR, LEN>::len;
+
+/**
+ * Bit field within a single byte air sensor register.
+ * REG: air_reg_t the field belongs to
+ * SHIFT: Index of the field's least significant bit
+ * WIDTH: Number of bits in the field
+ */
+template <typename REG, int SHIFT, int WIDTH>
+struct air_field_t {
+    static_assert(REG::len == 1, "fields are only described for single byte registers");
+    static_assert(WIDTH > 0, "field must be at least one bit wide");
+    static_assert(SHIFT >= 0 && SHIFT + WIDTH <= 8, "field must fit in its register byte");
+    
+    typedef REG reg;
+    
+    static constexpr int shift = SHIFT;
+    static constexpr int width = WIDTH;
+    static constexpr char mask = (char)(((1 << WIDTH) - 1) << SHIFT);
+    
+    /**
+     * Extract the field from a raw register value.
+     */
+    static constexpr char get(char raw) {
+        return (char)(((unsigned char)raw >> SHIFT) & ((1 << WIDTH) - 1));
+    }
+    
+    /**
+     * Returns: raw with the field replaced by value
+     */
+    static constexpr char set(char raw, char value) {
+        return (char)((raw & ~mask) | ((value << SHIFT) & mask));
+    }
+};
+
+template <typename REG, int SHIFT, int WIDTH>
+constexpr char air_field_t<REG, SHIFT, WIDTH>::mask;
+
+typedef air_reg_t<0x00, 1> air_status_reg_t;
+typedef air_field_t<air_status_reg_t, 0, 1> air_status_error_t;
+typedef air_field_t<air_status_reg_t, 3, 1> air_status_data_ready_t;
+typedef air_field_t<air_status_reg_t, 4, 1> air_status_app_valid_t;
+typedef air_field_t<air_status_reg_t, 7, 1> air_status_fw_mode_t;
+
+typedef air_reg_t<0x01, 1> air_mode_reg_t;
+typedef air_field_t<air_mode_reg_t, 2, 1> air_mode_int_thresh_t;
+typedef air_field_t<air_mode_reg_t, 3, 1> air_mode_int_datardy_t;
+typedef air_field_t<air_mode_reg_t, 4, 3> air_mode_drive_mode_t;
+
+typedef air_reg_t<0x02, 8> air_alg_result_data_reg_t;
+typedef air_reg_t<0x11, 2> air_baseline_reg_t;
+typedef air_reg_t<0x20, 1> air_hw_id_reg_t;
+typedef air_reg_t<0x21, 1> air_hw_version_reg_t;
+typedef air_reg_t<0x23, 2> air_fw_boot_version_reg_t;
+typedef air_reg_t<0x24, 2> air_fw_app_version_reg_t;
+typedef air_reg_t<(char)0xE0, 1> air_error_id_reg_t;
+
+// Fields sharing a register must not overlap
+static_assert((air_status_error_t::mask & air_status_data_ready_t::mask) == 0, "status fields overlap");
+static_assert((air_status_data_ready_t::mask & air_status_app_valid_t::mask) == 0, "status fields overlap");
+static_assert((air_status_app_valid_t::mask & air_status_fw_mode_t::mask) == 0, "status fields overlap");
+static_assert((air_mode_int_thresh_t::mask & air_mode_int_datardy_t::mask) == 0, "mode fields overlap");
+static_assert((air_mode_int_datardy_t::mask & air_mode_drive_mode_t::mask) == 0, "mode fields overlap");
+
+// Masks as given in the CCS811 datasheet
+static_assert(air_status_app_valid_t::mask == 0x10, "APP_VALID is STATUS bit 4");
+static_assert(air_mode_drive_mode_t::mask == 0x70, "DRIVE_MODE is MEAS_MODE bits 6:4");
+static_assert(air_mode_drive_mode_t::get(0x7C) == 0x07, "DRIVE_MODE extraction");
+
 /**
  * Air sensor constants
  */
 const int AIR_ADDR = 0x5A << 1;
+const int AIR_ADDR_ALT = 0x5B << 1;
 
-const char AIR_STATUS_REG = 0x00;
-const char AIR_STATUS_ERROR_MASK = 0x01;
-const char AIR_STATUS_DATA_READY_MASK = 0x08;
-const char AIR_STATUS_APP_VALID_MASK = 0x16;
-const char AIR_STATUS_FW_MODE_MASK = 0x80;
+const char AIR_STATUS_REG = air_status_reg_t::addr;
 const char AIR_STATUS_FW_MODE_BOOT = 0;
 const char AIR_STATUS_FW_MODE_APP = 1;
 
-const char AIR_MODE_REG = 0x01;
-const char AIR_MODE_DRIVE_MODE_MASK = 0x70;
+const char AIR_MODE_REG = air_mode_reg_t::addr;
+const char AIR_MODE_RESET_VALUE = 0x00;
 const char AIR_MODE_IDLE = 0x00;
 const char AIR_MODE_1_SECOND = 0x01;
 
-const char AIR_ERROR_ID_REG = 0xE0;
+/**
+ * ERROR_ID is a bit mask, the AIR_ERROR_ID_* constants are bit indexes.
+ */
+const char AIR_ERROR_ID_REG = air_error_id_reg_t::addr;
 const char AIR_ERROR_ID_BAD_WRITE = 0x00;
 const char AIR_ERROR_ID_BAD_READ = 0x01;
 const char AIR_ERROR_ID_BAD_MODE = 0x02;
@@ -48,272 +170,8630 @@ const char AIR_ERROR_ID_MAX_RESISTANCE = 0x03;
 const char AIR_ERROR_ID_HEATER_FAULT = 0x04;
 const char AIR_ERROR_ID_HEATER_SUPPLY = 0x05;
 
-const char AIR_ALG_RESULT_DATA_REG = 0x02;
+const char AIR_HW_ID_EXPECTED = (char)0x81;
 
+/**
+ * BASELINE is the algorithm's clean air resistance, sensor specific and
+ * encoded, only ever read back and written again.
+ */
+const char AIR_BASELINE_REG = air_baseline_reg_t::addr;
+
+const char AIR_ALG_RESULT_DATA_REG = air_alg_result_data_reg_t::addr;
+
+const char AIR_BOOT_APP_ERASE_REG = 0xF1;
+const char AIR_BOOT_APP_ERASE_KEY[4] = { (char)0xE7, (char)0xA7, (char)0xE6, 0x09 };
+const char AIR_BOOT_APP_DATA_REG = 0xF2;
+const int AIR_BOOT_APP_DATA_LEN = 8;
+const char AIR_BOOT_APP_VERIFY_REG = 0xF3;
 const char AIR_BOOT_APP_START_REG = 0xF4;
 
+const char AIR_SW_RESET_REG = 0xFF;
+const char AIR_SW_RESET_KEY[4] = { 0x11, (char)0xE5, 0x72, (char)0x8A };
+
+/**
+ * Minimum delays the bootloader needs after each firmware update command,
+ * from the CCS811 programming guide.
+ */
+const int AIR_BOOT_APP_ERASE_DELAY_MS = 500;
+const int AIR_BOOT_APP_DATA_DELAY_MS = 50;
+const int AIR_BOOT_APP_VERIFY_DELAY_MS = 500;
+const int AIR_SW_RESET_DELAY_MS = 2;
+
 const uint16_t AIR_TVOC_MAX = 1187;
 
-void die(char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    
-    vprintf(fmt, args);
-    printf("\r\n");
+/**
+ * Return codes of the air_try_* functions, which report errors to the caller
+ * instead of exiting.
+ */
+const int AIR_OK = 0;
+const int AIR_ERR_BUS = -1;
+const int AIR_ERR_SENSOR = -2;
+const int AIR_ERR_NOT_READY = -3;
+const int AIR_ERR_FLASH = -4;
+const int AIR_ERR_ABSENT = -5;
+
+#ifdef AIR_SIM
+/**
+ * Host side CCS811 behavioural simulator.
+ *
+ * Building with AIR_SIM defined replaces the Mbed API used by this file with
+ * the shims below, so the driver runs unchanged on a Linux host against a
+ * simulated sensor. The simulator models the sensor's register file, boot and
+ * application firmware modes, drive mode sample timing, DATA_READY, ERROR_ID
+ * and the baseline, all driven by a virtual clock. wait() advances the virtual
+ * clock instead of sleeping, so runs are deterministic and fast.
+ *
+ *     g++ -DAIR_SIM -o air_sim main.cpp && ./air_sim
+ */
+
+/**
+ * Sample period of each drive mode in microseconds, 0 if idle.
+ */
+const uint64_t AIR_SIM_DRIVE_MODE_PERIOD_US[5] = {
+    0,
+    1000000ULL,
+    10000000ULL,
+    60000000ULL,
+    250000ULL,
+};
+
+/**
+ * How long the I2C HAL waits for the bus before giving up on a transaction.
+ */
+const uint64_t AIR_SIM_I2C_SPIN_US = 5000;
+
+const char AIR_SIM_ERROR_WRITE_REG_INVALID = 0x01;
+const char AIR_SIM_ERROR_READ_REG_INVALID = 0x02;
+const char AIR_SIM_ERROR_MEASMODE_INVALID = 0x04;
+const char AIR_SIM_ERROR_HEATER_FAULT = 0x10;
+
+/**
+ * Readings start high and settle over the warm-up time after the application
+ * starts. The baseline drifts up by one count every drift period.
+ */
+const uint64_t AIR_SIM_WARMUP_US = 20ULL * 60 * 1000000;
+const uint16_t AIR_SIM_WARMUP_ECO2 = 400;
+const uint64_t AIR_SIM_BASELINE_DRIFT_US = 3600ULL * 1000000;
+
+#ifndef AIR_SIM_SECONDS
+#define AIR_SIM_SECONDS 0
+#endif
+
+/**
+ * Size of the simulated application flash. Chunks past the end are lost.
+ */
+const int AIR_SIM_APP_SIZE = 16384;
+
+/**
+ * Timers run by the virtual time scheduler, see the Ticker and Timeout shims.
+ */
+const int AIR_SIM_TIMERS = 16;
+
+typedef struct {
+    void (*func)();
+    uint64_t due_us;
     
-    va_end(args);
+    /**
+     * Repeat period, 0 for one shot timers.
+     */
+    uint64_t period_us;
     
-    exit(1);
-}
+    bool active;
+} air_sim_timer_t;
+
+air_sim_timer_t air_sim_timers[AIR_SIM_TIMERS];
+
+const char AIR_SIM_BASELINE_REG = air_baseline_reg_t::addr;
+const char AIR_SIM_ENV_DATA_REG = 0x05;
+const char AIR_SIM_NTC_REG = 0x06;
+const char AIR_SIM_THRESHOLDS_REG = 0x10;
+const char AIR_SIM_RAW_DATA_REG = 0x03;
 
 /**
- * Air sensor status register fields.
+ * Simulated air quality, called with the virtual time of each new sample.
+ * Returns: eCO2 in ppm or TVOC in ppb
+ */
+typedef uint16_t (*air_sim_waveform_t)(uint64_t now_us);
+
+/**
+ * Simulated sensor state.
  */
 typedef struct {
     /**
-     * Firmware mode, see AIR_STATUS_FW_MODE_* constants.
+     * Virtual clock in microseconds since the simulation started.
      */
-    char fw_mode;
+    uint64_t now_us;
     
     /**
-     * Indicates if the application on the sensor is valid.
-     * Boolean.
+     * I2C clock frequency used to charge bus transactions to the virtual
+     * clock, in Hz.
      */
-    char app_valid;
+    int bus_hz;
     
     /**
-     * If an error has occured.
-     * Boolean.
+     * 7 bit address the sensor answers on.
      */
-    char error;
+    int addr;
     
     /**
-     * If a new data measurement is available.
-     * Boolean.
+     * Register file.
      */
+    char fw_mode;
+    char app_valid;
     char data_ready;
+    char meas_mode;
+    char error_id;
+    char mailbox;
+    uint16_t eco2;
+    uint16_t tvoc;
+    uint16_t raw;
+    uint16_t baseline;
     
     /**
-     * Raw bit packed status valid, useful to have here for debugging purposes.
+     * Virtual time the application was started and the baseline was last
+     * written, for warm-up and baseline drift.
      */
-     char raw;
-} air_status_t;
+    uint64_t app_start_us;
+    uint64_t baseline_us;
+    
+    /**
+     * Virtual time the simulation stops at and exits, 0 to run forever.
+     */
+    uint64_t end_us;
+    
+    /**
+     * Number of samples produced, and of times nINT fell when one was.
+     */
+    uint64_t samples;
+    uint64_t nint_falls;
+    
+    /**
+     * Virtual time the next sample is due, valid while a drive mode is set.
+     */
+    uint64_t next_sample_us;
+    
+    /**
+     * Virtual time the last sample was made available.
+     */
+    uint64_t sample_us;
+    
+    /**
+     * Application flash, as programmed through the bootloader. app_corrupt
+     * is set if a chunk was lost, which fails verification.
+     */
+    char app_erased;
+    char app_corrupt;
+    int app_bytes;
+    char app[AIR_SIM_APP_SIZE];
+    
+    /**
+     * The bootloader is busy until boot_busy_us after each erase, data chunk
+     * and verify. Commands written while it is busy are dropped and counted
+     * in boot_busy_writes.
+     */
+    uint64_t boot_busy_us;
+    int boot_busy_writes;
+    
+    /**
+     * Scriptable air quality.
+     */
+    air_sim_waveform_t eco2_waveform;
+    air_sim_waveform_t tvoc_waveform;
+    
+    /**
+     * Fault injection. Transactions are NACKed with probability
+     * fault_nack_rate and while fault_nack_count is non zero. Samples raise a
+     * heater fault instead of being produced while fault_heater is set.
+     */
+    double fault_nack_rate;
+    int fault_nack_count;
+    char fault_heater;
+    
+    /**
+     * Periodic fault patterns. The bus is stuck, NACKing everything, for the
+     * last fault_stuck_len_us of every fault_stuck_period_us. The heater
+     * faults for the last fault_heater_len_us of every
+     * fault_heater_period_us. A period of 0 disables the pattern.
+     */
+    uint64_t fault_stuck_period_us;
+    uint64_t fault_stuck_len_us;
+    uint64_t fault_heater_period_us;
+    uint64_t fault_heater_len_us;
+    
+    /**
+     * Faults only a reset clears. While fault_hang is set the application
+     * firmware has hung and produces no samples, until a software reset. While
+     * fault_i2c_wedged is set the MCU's I2C peripheral has wedged and every
+     * transaction hangs, until the MCU is reset.
+     */
+    char fault_hang;
+    char fault_i2c_wedged;
+    
+    /**
+     * Bus hangs. While fault_sda_held is set a slave holds SDA low, as after
+     * an MCU reset in the middle of a read, until it is clocked out. Every
+     * transaction is clock stretched by fault_stretch_us.
+     */
+    char fault_sda_held;
+    uint64_t fault_stretch_us;
+    
+    /**
+     * Number of simulated MCU resets, see air_sim_mcu_reset.
+     */
+    int mcu_resets;
+    
+    /**
+     * State of the deterministic random number generator used for faults.
+     */
+    uint32_t rand_state;
+    
+    /**
+     * Bus statistics: transactions, data bytes and bit times including
+     * start, address, ACK and stop bits.
+     */
+    uint64_t stat_transactions;
+    uint64_t stat_bytes;
+    uint64_t stat_bits;
+} air_sim_t;
+
+air_sim_t air_sim;
 
 /**
- * Read air sensor status register into the air_status arugment.
+ * Default eCO2 waveform, a slow daily swing with a faster ripple on top.
  */
-void air_read_status(air_status_t *air_status) {
-    if (i2c.write(AIR_ADDR, &AIR_STATUS_REG, 1) != 0) {
-        die("air: read_status: failed to select status register");
-    }
-    
-    char raw_status;
-    if (i2c.read(AIR_ADDR, &raw_status, 1) != 0) {
-        die("air: read_status: failed to read air status register");
-    }
-    
-    air_status->fw_mode = (raw_status & AIR_STATUS_FW_MODE_MASK) >> 7;
-    air_status->app_valid = (raw_status & AIR_STATUS_APP_VALID_MASK) >> 4;
-    air_status->data_ready = (raw_status &AIR_STATUS_DATA_READY_MASK) >> 3;
-    air_status->error = raw_status & AIR_STATUS_ERROR_MASK;
-    air_status->raw = raw_status;
+uint16_t air_sim_default_eco2(uint64_t now_us) {
+    double t = now_us / 1e6;
+    return (uint16_t)(600 + 200 * sin(t * 2 * M_PI / 86400) + 20 * sin(t * 2 * M_PI / 600));
 }
 
 /**
- * Read error ID from the air sensor.
- * Returns: Error ID
+ * Default TVOC waveform, follows the same daily swing as eCO2.
  */
-char air_read_error_id() {
-    if (i2c.write(AIR_ADDR, &AIR_ERROR_ID_REG, 1) != 0) {
-        die("air: read_error_id: failed to select error id register");
-    }
+uint16_t air_sim_default_tvoc(uint64_t now_us) {
+    double t = now_us / 1e6;
+    return (uint16_t)(30 + 25 * sin(t * 2 * M_PI / 86400) + 5 * sin(t * 2 * M_PI / 900));
+}
+
+/**
+ * Reset the simulator to a powered on sensor in boot mode with a valid
+ * application, the virtual clock at 0 and no faults.
+ */
+void air_sim_reset() {
+    memset(&air_sim, 0, sizeof(air_sim_t));
     
-    char air_error_id;
-    if (i2c.read(AIR_ADDR, &air_error_id, 1) != 0) {
-        die("air: read_error_id: failed to read error id");
-    }
+    air_sim.bus_hz = 100000;
+    air_sim.addr = 0x5A;
+    air_sim.app_valid = 1;
+    air_sim.baseline = 0x847B;
+    air_sim.eco2 = 400;
+    air_sim.eco2_waveform = air_sim_default_eco2;
+    air_sim.tvoc_waveform = air_sim_default_tvoc;
+    air_sim.rand_state = 0x2545F491;
+    air_sim.end_us = AIR_SIM_SECONDS * 1000000ULL;
     
-    return air_error_id;
+    memset(air_sim_timers, 0, sizeof(air_sim_timers));
 }
 
 /**
- * Exits program with there is an error with the air sensor.
+ * Plug a sensor in at 7 bit address addr, 0 to unplug it. Either way it
+ * powers up again in boot mode, the application and baseline are kept.
  */
-void air_die() {
-    air_status_t air_status;
-    air_read_status(&air_status);
-    if (air_status.error) {
-        char air_error_id = air_read_error_id();
-        char *str_air_error_id = NULL;
-        
-        switch(air_error_id) {
-            case AIR_ERROR_ID_BAD_WRITE:
-                str_air_error_id = "a write occurred for an invalid register address";
-                break;
-            case AIR_ERROR_ID_BAD_READ:
-                str_air_error_id = "a read occurred for an invalid register address";
-                break;
-            case AIR_ERROR_ID_BAD_MODE:
-                str_air_error_id = "the measurement drive mode is invalid";
-                break;
-            case AIR_ERROR_ID_MAX_RESISTANCE:
-                str_air_error_id = "the resistance is set too high";
-                break;
-            case AIR_ERROR_ID_HEATER_FAULT:
-                str_air_error_id = "the heater's current was not in range";
-                break;
-            case AIR_ERROR_ID_HEATER_SUPPLY:
-                str_air_error_id = "the heater's voltage is not being applied correctly";
-                break;
-            default:
-                str_air_error_id = "unknown error!";
-                break;
-        }
-        
-        die("air: error: %s\r\n", str_air_error_id);
-    }
+void air_sim_plug(int addr) {
+    air_sim.addr = addr;
+    air_sim.fw_mode = AIR_STATUS_FW_MODE_BOOT;
+    air_sim.meas_mode = AIR_MODE_RESET_VALUE;
+    air_sim.data_ready = 0;
+    air_sim.error_id = 0;
+    air_sim.fault_hang = 0;
 }
 
 /**
- * Boot air sensor.
- * If already booted exits silently.
+ * Simulate an MCU reset, see air_watchdog_reset. The sensor keeps running,
+ * only the MCU's peripherals are reset.
  */
-void air_boot() {
-    // Check if sensor is in a valid state to be booted
-    air_status_t air_status;
-    air_read_status(&air_status);
+void air_sim_mcu_reset() {
+    air_sim.mcu_resets++;
+    air_sim.fault_i2c_wedged = 0;
+}
+
+/**
+ * Returns: Deterministic pseudo random number in [0, 1)
+ */
+double air_sim_rand() {
+    air_sim.rand_state ^= air_sim.rand_state << 13;
+    air_sim.rand_state ^= air_sim.rand_state >> 17;
+    air_sim.rand_state ^= air_sim.rand_state << 5;
     
-    // Check if already booted
-    if(air_status.fw_mode == AIR_STATUS_FW_MODE_APP) {
-        // Already booted
+    return air_sim.rand_state / 4294967296.0;
+}
+
+/**
+ * Produce every sample which became due up to the virtual clock.
+ */
+void air_sim_update() {
+    int drive_mode = air_mode_drive_mode_t::get(air_sim.meas_mode);
+    if (air_sim.fw_mode != AIR_STATUS_FW_MODE_APP || drive_mode == 0 || drive_mode > 4) {
         return;
     }
     
-    // Check if a valid application is loaded to be booted
-    if (!air_status.app_valid) {
-        die("air: boot: cannot boot, invalid app on device");
-    }
+    uint64_t period_us = AIR_SIM_DRIVE_MODE_PERIOD_US[drive_mode];
     
-    // Send boot command
-    if (i2c.write(AIR_ADDR, &AIR_BOOT_APP_START_REG, 1) != 0) {
-        die("air: boot: failed to boot");
+    while (air_sim.next_sample_us <= air_sim.now_us) {
+        uint64_t sample_us = air_sim.next_sample_us;
+        air_sim.next_sample_us += period_us;
+        
+        if (air_sim.fault_hang) {
+            continue;
+        }
+        
+        bool heater_fault = air_sim.fault_heater;
+        if (air_sim.fault_heater_period_us > 0) {
+            heater_fault |= sample_us % air_sim.fault_heater_period_us >= air_sim.fault_heater_period_us - air_sim.fault_heater_len_us;
+        }
+        
+        if (heater_fault) {
+            air_sim.error_id |= AIR_SIM_ERROR_HEATER_FAULT;
+            continue;
+        }
+        
+        // Drive mode 4 only updates the raw data
+        if (drive_mode != 4) {
+            air_sim.eco2 = air_sim.eco2_waveform(sample_us);
+            air_sim.tvoc = air_sim.tvoc_waveform(sample_us);
+            
+            uint64_t running_us = sample_us - air_sim.app_start_us;
+            if (running_us < AIR_SIM_WARMUP_US) {
+                air_sim.eco2 += AIR_SIM_WARMUP_ECO2 * (AIR_SIM_WARMUP_US - running_us) / AIR_SIM_WARMUP_US;
+            }
+        }
+        
+        air_sim.raw = (0x10 << 10) | ((air_sim.tvoc * 3 + 200) & 0x3FF);
+        if (!air_sim.data_ready && air_mode_int_datardy_t::get(air_sim.meas_mode)) {
+            air_sim.nint_falls++;
+        }
+        air_sim.data_ready = 1;
+        air_sim.sample_us = sample_us;
+        air_sim.samples++;
     }
 }
 
 /**
- * Read measurement drive mode.
- * Returns: drive mode
+ * Current baseline, including drift since it was last written.
  */
-char air_read_mode() {
-    if (i2c.write(AIR_ADDR, &AIR_MODE_REG, 1) != 0) {
-         die("air: read_mode: failed to set drive mode to constant high freq");
-    }
+uint16_t air_sim_baseline() {
+    return air_sim.baseline + (air_sim.now_us - air_sim.baseline_us) / AIR_SIM_BASELINE_DRIFT_US;
+}
+
+/**
+ * Advance the virtual clock, producing sensor samples and running timers in
+ * time order as their due times are passed.
+ */
+void air_sim_advance_us(uint64_t us) {
+    uint64_t target_us = air_sim.now_us + us;
     
-    char air_mode_buf;
-    if (i2c.read(AIR_ADDR, &air_mode_buf, 1) != 0) {
-        die("air: read_mode: failed to read mode register");
+    while (true) {
+        // Next event: a timer, a sensor sample or the target
+        uint64_t next_us = target_us;
+        
+        int drive_mode = air_mode_drive_mode_t::get(air_sim.meas_mode);
+        if (air_sim.fw_mode == AIR_STATUS_FW_MODE_APP && drive_mode > 0 && drive_mode <= 4 &&
+            air_sim.next_sample_us < next_us) {
+            next_us = air_sim.next_sample_us;
+        }
+        
+        int timer = -1;
+        for (int i = 0; i < AIR_SIM_TIMERS; i++) {
+            if (air_sim_timers[i].active && air_sim_timers[i].due_us <= next_us) {
+                if (timer < 0 || air_sim_timers[i].due_us < air_sim_timers[timer].due_us) {
+                    timer = i;
+                }
+            }
+        }
+        
+        if (timer >= 0) {
+            next_us = air_sim_timers[timer].due_us;
+        }
+        
+        if (air_sim.end_us > 0 && next_us >= air_sim.end_us) {
+            air_sim.now_us = air_sim.end_us;
+            air_sim_update();
+            printf("air: sim: stopped at %llu s, %llu samples\r\n",
+                   (unsigned long long)(air_sim.now_us / 1000000), (unsigned long long)air_sim.samples);
+            exit(0);
+        }
+        
+        if (next_us > air_sim.now_us) {
+            air_sim.now_us = next_us;
+        }
+        air_sim_update();
+        
+        if (timer >= 0) {
+            air_sim_timer_t *t = &air_sim_timers[timer];
+            if (t->period_us > 0) {
+                t->due_us += t->period_us;
+            } else {
+                t->active = false;
+            }
+            
+            // The callback may advance the clock itself
+            t->func();
+            continue;
+        }
+        
+        if (air_sim.now_us >= target_us) {
+            return;
+        }
     }
+}
+
+/**
+ * Charge the bus time of a transaction carrying len data bytes to the virtual
+ * clock: start, address byte, data bytes, stop, with every byte followed by an
+ * ACK bit.
+ */
+void air_sim_charge_bus(int len) {
+    int bits = 1 + 9 * (1 + len) + 1;
     
-    air_mode_buf = (air_mode_buf & AIR_MODE_DRIVE_MODE_MASK) >> 4;
+    air_sim.stat_transactions++;
+    air_sim.stat_bytes += len;
+    air_sim.stat_bits += bits;
     
-    return air_mode_buf;
+    air_sim_advance_us((uint64_t)bits * 1000000ULL / air_sim.bus_hz);
 }
 
 /**
- * Set measurement drive mode.
- * Previous measurement drive mode is read so new drive_mode value can be inserted into the
- * bitpacked register correctly.
+ * Clock a slave holding SDA out with 9 SCL pulses and a STOP, see
+ * air_i2c_recover.
  */
-void air_write_mode(char drive_mode) {
-    // Read current measurement mode
-    if (i2c.write(AIR_ADDR, &AIR_MODE_REG, 1) != 0) {
-        die("air: write_mode: failed to select measurement mode register");
+void air_sim_clock_out() {
+    air_sim_advance_us(10ULL * 1000000ULL / air_sim.bus_hz);
+    air_sim.fault_sda_held = 0;
+}
+
+/**
+ * If the sensor NACKs a transaction addressed to the 8 bit address addr.
+ * Boolean.
+ */
+char air_sim_nack(int addr) {
+    if ((addr >> 1) != air_sim.addr) {
+        return 1;
     }
     
-    char measurement_mode;
-    if (i2c.read(AIR_ADDR, &measurement_mode, 1) != 0) {
-        die("air: write_mode: failed to read measurement mode register");
+    if (air_sim.fault_nack_count > 0) {
+        air_sim.fault_nack_count--;
+        return 1;
     }
     
-    // Bitpack new drive_mode into measurement_mode
-    char write_drive_mode = drive_mode << 4;
-    measurement_mode = measurement_mode & (!AIR_MODE_DRIVE_MODE_MASK);
+    if (air_sim.fault_stuck_period_us > 0 &&
+        air_sim.now_us % air_sim.fault_stuck_period_us >= air_sim.fault_stuck_period_us - air_sim.fault_stuck_len_us) {
+        return 1;
+    }
     
-    char write_measurement_mode = write_drive_mode | measurement_mode;
+    return air_sim.fault_nack_rate > 0 && air_sim_rand() < air_sim.fault_nack_rate;
+}
+
+/**
+ * Level of the active low nINT pin.
+ */
+int air_sim_nint() {
+    return !(air_mode_int_datardy_t::get(air_sim.meas_mode) && air_sim.data_ready);
+}
+
+void air_sim_wait_us(uint64_t us);
+
+/**
+ * Charge a hung or stretched transaction to the virtual clock. The HAL gives
+ * up after AIR_SIM_I2C_SPIN_US.
+ * Returns: Non zero if the transaction failed
+ */
+char air_sim_i2c_hang() {
+    if (air_sim.fault_sda_held || air_sim.fault_i2c_wedged) {
+        // No START can be generated
+        air_sim_advance_us(AIR_SIM_I2C_SPIN_US);
+        return 1;
+    }
+    
+    if (air_sim.fault_stretch_us >= AIR_SIM_I2C_SPIN_US) {
+        air_sim_advance_us(AIR_SIM_I2C_SPIN_US);
+        return 1;
+    }
+    
+    air_sim_advance_us(air_sim.fault_stretch_us);
+    
+    return 0;
+}
+
+/**
+ * Advance the virtual clock until nINT is asserted.
+ * Returns: 0 once asserted, non zero if it never will be
+ */
+int air_sim_wait_nint() {
+    if (air_sim_nint() == 0) {
+        return 0;
+    }
+    
+    int drive_mode = air_mode_drive_mode_t::get(air_sim.meas_mode);
+    if (!air_mode_int_datardy_t::get(air_sim.meas_mode) || drive_mode == 0 || drive_mode > 4 || air_sim.fault_hang) {
+        return 1;
+    }
+    
+    while (air_sim_nint() != 0) {
+        air_sim_wait_us(air_sim.next_sample_us - air_sim.now_us);
+    }
+    
+    return 0;
+}
+
+/**
+ * Advance the virtual clock until nINT falls, as an InterruptIn sees it, or
+ * until due_us. nINT already low does not count.
+ * falls: Falls seen so far, updated
+ * Returns: 0 once it fell, non zero at due_us
+ */
+int air_sim_wait_nint_fall(uint64_t *falls, uint64_t due_us) {
+    while (air_sim.nint_falls == *falls && air_sim.now_us < due_us) {
+        uint64_t next_us = due_us;
+        if (air_sim.next_sample_us > air_sim.now_us && air_sim.next_sample_us < next_us) {
+            next_us = air_sim.next_sample_us;
+        }
+        
+        air_sim_wait_us(next_us - air_sim.now_us);
+    }
+    
+    if (air_sim.nint_falls == *falls) {
+        return 1;
+    }
+    
+    *falls = air_sim.nint_falls;
+    
+    return 0;
+}
+
+/**
+ * Current status register value.
+ */
+char air_sim_status() {
+    char status = 0;
+    status = air_status_fw_mode_t::set(status, air_sim.fw_mode);
+    status = air_status_app_valid_t::set(status, air_sim.app_valid);
+    status = air_status_data_ready_t::set(status, air_sim.data_ready);
+    status = air_status_error_t::set(status, air_sim.error_id != 0);
+    
+    return status;
+}
+
+/**
+ * Handle a register write. data[0] is the mailbox, the rest the register
+ * contents.
+ */
+void air_sim_write_reg(const char *data, int len) {
+    char reg = data[0];
+    const char *value = data + 1;
+    int value_len = len - 1;
+    
+    air_sim.mailbox = reg;
+    
+    if (reg == AIR_SW_RESET_REG) {
+        if (value_len == 4 && memcmp(value, AIR_SW_RESET_KEY, 4) == 0) {
+            air_sim.fw_mode = AIR_STATUS_FW_MODE_BOOT;
+            air_sim.meas_mode = AIR_MODE_RESET_VALUE;
+            air_sim.data_ready = 0;
+            air_sim.error_id = 0;
+            air_sim.fault_hang = 0;
+        }
+        return;
+    }
+    
+    // Registers which only take a selection, or are valid in both modes
+    if (value_len == 0) {
+        switch (reg) {
+            case AIR_STATUS_REG:
+            case AIR_ERROR_ID_REG:
+            case air_hw_id_reg_t::addr:
+            case air_hw_version_reg_t::addr:
+            case air_fw_boot_version_reg_t::addr:
+            case air_fw_app_version_reg_t::addr:
+                return;
+        }
+    }
+    
+    if (air_sim.fw_mode == AIR_STATUS_FW_MODE_BOOT) {
+        bool busy = air_sim.now_us < air_sim.boot_busy_us;
+        
+        switch (reg) {
+            case AIR_BOOT_APP_ERASE_REG:
+                if (busy) {
+                    air_sim.boot_busy_writes++;
+                } else if (value_len == 4 && memcmp(value, AIR_BOOT_APP_ERASE_KEY, 4) == 0) {
+                    air_sim.app_erased = 1;
+                    air_sim.app_corrupt = 0;
+                    air_sim.app_valid = 0;
+                    air_sim.app_bytes = 0;
+                    air_sim.boot_busy_us = air_sim.now_us + AIR_BOOT_APP_ERASE_DELAY_MS * 1000ULL;
+                }
+                return;
+            case AIR_BOOT_APP_DATA_REG:
+                if (value_len != AIR_BOOT_APP_DATA_LEN || !air_sim.app_erased) {
+                    return;
+                }
+                
+                if (busy) {
+                    air_sim.boot_busy_writes++;
+                    air_sim.app_corrupt = 1;
+                } else if (air_sim.app_bytes + value_len > AIR_SIM_APP_SIZE) {
+                    air_sim.app_corrupt = 1;
+                } else {
+                    memcpy(&air_sim.app[air_sim.app_bytes], value, value_len);
+                    air_sim.boot_busy_us = air_sim.now_us + AIR_BOOT_APP_DATA_DELAY_MS * 1000ULL;
+                }
+                air_sim.app_bytes += value_len;
+                return;
+            case AIR_BOOT_APP_VERIFY_REG:
+                if (busy) {
+                    air_sim.boot_busy_writes++;
+                    return;
+                }
+                
+                air_sim.app_valid = air_sim.app_erased && air_sim.app_bytes > 0 && !air_sim.app_corrupt;
+                air_sim.app_erased = 0;
+                air_sim.boot_busy_us = air_sim.now_us + AIR_BOOT_APP_VERIFY_DELAY_MS * 1000ULL;
+                return;
+            case AIR_BOOT_APP_START_REG:
+                if (busy) {
+                    air_sim.boot_busy_writes++;
+                } else if (air_sim.app_valid) {
+                    air_sim.fw_mode = AIR_STATUS_FW_MODE_APP;
+                    air_sim.meas_mode = AIR_MODE_RESET_VALUE;
+                    air_sim.app_start_us = air_sim.now_us;
+                }
+                return;
+        }
+    } else {
+        switch (reg) {
+            case AIR_MODE_REG:
+                if (value_len == 0) {
+                    return;
+                }
+                
+                if (air_mode_drive_mode_t::get(value[0]) > 4) {
+                    air_sim.error_id |= AIR_SIM_ERROR_MEASMODE_INVALID;
+                    return;
+                }
+                
+                // A new drive mode restarts the sample timer
+                if (air_mode_drive_mode_t::get(value[0]) != air_mode_drive_mode_t::get(air_sim.meas_mode)) {
+                    int drive_mode = air_mode_drive_mode_t::get(value[0]);
+                    air_sim.next_sample_us = air_sim.now_us + AIR_SIM_DRIVE_MODE_PERIOD_US[drive_mode];
+                }
+                
+                air_sim.meas_mode = value[0];
+                return;
+            case AIR_ALG_RESULT_DATA_REG:
+            case AIR_SIM_RAW_DATA_REG:
+            case AIR_SIM_NTC_REG:
+                if (value_len == 0) {
+                    return;
+                }
+                break;
+            case AIR_SIM_ENV_DATA_REG:
+            case AIR_SIM_THRESHOLDS_REG:
+                return;
+            case AIR_SIM_BASELINE_REG:
+                if (value_len >= 2) {
+                    air_sim.baseline = ((unsigned char)value[0] << 8) | (unsigned char)value[1];
+                    air_sim.baseline_us = air_sim.now_us;
+                }
+                return;
+        }
+    }
+    
+    air_sim.error_id |= AIR_SIM_ERROR_WRITE_REG_INVALID;
+}
+
+/**
+ * Handle a read from the selected mailbox.
+ */
+void air_sim_read_reg(char *buf, int len) {
+    char reg[8];
+    memset(reg, 0, sizeof(reg));
+    
+    char valid = 1;
+    
+    switch (air_sim.mailbox) {
+        case AIR_STATUS_REG:
+            reg[0] = air_sim_status();
+            break;
+        case AIR_ERROR_ID_REG:
+            reg[0] = air_sim.error_id;
+            air_sim.error_id = 0;
+            break;
+        case air_hw_id_reg_t::addr:
+            reg[0] = AIR_HW_ID_EXPECTED;
+            break;
+        case air_hw_version_reg_t::addr:
+            reg[0] = 0x12;
+            break;
+        case air_fw_boot_version_reg_t::addr:
+            reg[0] = 0x10;
+            reg[1] = 0x00;
+            break;
+        case air_fw_app_version_reg_t::addr:
+            reg[0] = 0x20;
+            reg[1] = 0x00;
+            break;
+        default:
+            valid = air_sim.fw_mode == AIR_STATUS_FW_MODE_APP;
+            
+            switch (air_sim.mailbox) {
+                case AIR_MODE_REG:
+                    reg[0] = air_sim.meas_mode;
+                    break;
+                case AIR_ALG_RESULT_DATA_REG:
+                    reg[0] = air_sim.eco2 >> 8;
+                    reg[1] = air_sim.eco2;
+                    reg[2] = air_sim.tvoc >> 8;
+                    reg[3] = air_sim.tvoc;
+                    reg[4] = air_sim_status();
+                    reg[5] = air_sim.error_id;
+                    reg[6] = air_sim.raw >> 8;
+                    reg[7] = air_sim.raw;
+                    
+                    // Reading the result clears DATA_READY, reading past
+                    // ERROR_ID clears it too
+                    air_sim.data_ready = 0;
+                    if (len > 5) {
+                        air_sim.error_id = 0;
+                    }
+                    break;
+                case AIR_SIM_RAW_DATA_REG:
+                    reg[0] = air_sim.raw >> 8;
+                    reg[1] = air_sim.raw;
+                    break;
+                case AIR_SIM_NTC_REG:
+                    reg[0] = 0x3A;
+                    reg[1] = 0x98;
+                    reg[2] = 0x3A;
+                    reg[3] = 0x98;
+                    break;
+                case AIR_SIM_BASELINE_REG:
+                    reg[0] = air_sim_baseline() >> 8;
+                    reg[1] = air_sim_baseline();
+                    break;
+                default:
+                    valid = 0;
+                    break;
+            }
+            break;
+    }
+    
+    if (!valid) {
+        air_sim.error_id |= AIR_SIM_ERROR_READ_REG_INVALID;
+    }
+    
+    memcpy(buf, reg, len < 8 ? len : 8);
+}
+
+#ifdef AIR_REPLAY
+void air_replay_load();
+void air_replay_hold();
+int air_replay_write(int address, const char *data, int length);
+int air_replay_read(int address, char *data, int length);
+#endif
+
+/**
+ * Mbed API shims routed to the simulator.
+ */
+typedef int PinName;
+const PinName p8 = 8;
+const PinName p9 = 9;
+const PinName p10 = 10;
+
+class I2C {
+public:
+    I2C(PinName, PinName) {
+        air_sim_reset();
+        
+#ifdef AIR_REPLAY
+        air_replay_load();
+#endif
+    }
+    
+    int write(int address, const char *data, int length, bool = false) {
+#ifdef AIR_REPLAY
+        return air_replay_write(address, data, length);
+#endif
+        
+        if (air_sim_i2c_hang()) {
+            return 1;
+        }
+        
+        air_sim_charge_bus(length);
+        
+        if (air_sim_nack(address)) {
+            return 1;
+        }
+        
+        if (length > 0) {
+            air_sim_write_reg(data, length);
+        }
+        
+        return 0;
+    }
+    
+    int read(int address, char *data, int length, bool = false) {
+#ifdef AIR_REPLAY
+        return air_replay_read(address, data, length);
+#endif
+        
+        if (air_sim_i2c_hang()) {
+            return 1;
+        }
+        
+        air_sim_charge_bus(length);
+        
+        if (air_sim_nack(address)) {
+            return 1;
+        }
+        
+        air_sim_read_reg(data, length);
+        
+        return 0;
+    }
+};
+
+class Timer {
+public:
+    Timer() : start_us(0), elapsed_us(0), running(false) {}
+    
+    void start() {
+        if (!running) {
+            start_us = air_sim.now_us;
+            running = true;
+        }
+    }
+    
+    void stop() {
+        if (running) {
+            elapsed_us += air_sim.now_us - start_us;
+            running = false;
+        }
+    }
+    
+    void reset() {
+        start_us = air_sim.now_us;
+        elapsed_us = 0;
+    }
+    
+    int read_us() {
+        return (int)(elapsed_us + (running ? air_sim.now_us - start_us : 0));
+    }
+    
+    int read_ms() {
+        return read_us() / 1000;
+    }
+    
+    float read() {
+        return read_us() / 1e6f;
+    }
+
+private:
+    uint64_t start_us;
+    uint64_t elapsed_us;
+    bool running;
+};
+
+/**
+ * Ticker and Timeout run their callback from the virtual time scheduler, in
+ * whichever wait() or bus transaction passes the due time.
+ */
+class Ticker {
+public:
+    Ticker() : timer(-1) {}
+    
+    ~Ticker() {
+        detach();
+    }
+    
+    void attach(void (*func)(), float t) {
+        attach_us(func, (uint64_t)(t * 1e6));
+    }
+    
+    void attach_us(void (*func)(), uint64_t us) {
+        schedule(func, us, repeats() ? us : 0);
+    }
+    
+    void detach() {
+        if (timer >= 0) {
+            air_sim_timers[timer].active = false;
+            timer = -1;
+        }
+    }
+
+protected:
+    virtual bool repeats() {
+        return true;
+    }
+    
+    void schedule(void (*func)(), uint64_t us, uint64_t period_us) {
+        detach();
+        
+        for (int i = 0; i < AIR_SIM_TIMERS; i++) {
+            if (!air_sim_timers[i].active) {
+                air_sim_timers[i].func = func;
+                air_sim_timers[i].due_us = air_sim.now_us + us;
+                air_sim_timers[i].period_us = period_us;
+                air_sim_timers[i].active = true;
+                timer = i;
+                return;
+            }
+        }
+        
+        fprintf(stderr, "air: sim: out of timers\n");
+        exit(1);
+    }
+    
+    int timer;
+};
+
+class Timeout : public Ticker {
+protected:
+    virtual bool repeats() {
+        return false;
+    }
+};
+
+#ifdef AIR_RTOS
+/**
+ * Thread scheduler for AIR_RTOS on the host. Threads take turns on one
+ * simulated CPU, as on the single core target: the running thread holds
+ * air_sim_cpu and only gives it up to wait. The virtual clock only moves on,
+ * to the earliest deadline, once every thread is waiting and has seen the
+ * latest state. A producer can then never run ahead of its consumers, and
+ * only one thread at a time touches the simulator.
+ *
+ * The CPU is never destroyed, threads are still waiting on it when the
+ * simulation exits.
+ */
+const int AIR_SIM_THREADS = 4;
+
+std::mutex *air_sim_cpu = new std::mutex;
+std::condition_variable_any *air_sim_cpu_cond = new std::condition_variable_any;
+
+/**
+ * Threads taking part, and the state generation, bumped whenever a thread
+ * stops running or the clock moves on.
+ */
+int air_sim_threads = 1;
+uint64_t air_sim_epoch = 0;
+
+/**
+ * A waiting thread's deadline and the generation it last found itself still
+ * waiting at.
+ */
+typedef struct {
+    bool waiting;
+    uint64_t due_us;
+    uint64_t epoch;
+} air_sim_waiter_t;
+
+air_sim_waiter_t air_sim_waiters[AIR_SIM_THREADS];
+
+/**
+ * Give up the CPU until ready() returns true or the virtual clock reaches
+ * due_us. Once threads are started the caller must hold the CPU.
+ * Returns: ready()
+ */
+template <typename F>
+bool air_sim_block(F ready, uint64_t due_us) {
+    int slot = 0;
+    while (air_sim_waiters[slot].waiting) {
+        slot++;
+    }
+    
+    air_sim_waiter_t *waiter = &air_sim_waiters[slot];
+    waiter->waiting = true;
+    waiter->due_us = due_us;
+    
+    // Whatever this thread did since it last waited may have readied others
+    air_sim_epoch++;
+    air_sim_cpu_cond->notify_all();
+    
+    while (!ready() && air_sim.now_us < due_us) {
+        waiter->epoch = air_sim_epoch;
+        
+        int waiting = 0;
+        bool settled = true;
+        uint64_t next_us = UINT64_MAX;
+        for (int i = 0; i < AIR_SIM_THREADS; i++) {
+            if (air_sim_waiters[i].waiting) {
+                waiting++;
+                settled = settled && air_sim_waiters[i].epoch == air_sim_epoch;
+                if (air_sim_waiters[i].due_us < next_us) {
+                    next_us = air_sim_waiters[i].due_us;
+                }
+            }
+        }
+        
+        // Nothing can run until the next deadline
+        if (waiting == air_sim_threads && settled) {
+            air_sim_advance_us(next_us - air_sim.now_us);
+            air_sim_epoch++;
+            air_sim_cpu_cond->notify_all();
+            continue;
+        }
+        
+        air_sim_cpu_cond->wait(*air_sim_cpu);
+    }
+    
+    waiter->waiting = false;
+    
+    return ready();
+}
+
+/**
+ * Run func on a new simulated thread. It first runs once the caller waits.
+ */
+template <typename F>
+void air_sim_thread_start(F func) {
+    if (air_sim_threads == AIR_SIM_THREADS) {
+        fprintf(stderr, "air: sim: out of threads\n");
+        exit(1);
+    }
+    
+    // The first thread has had the CPU to itself until now
+    if (air_sim_threads == 1) {
+        air_sim_cpu->lock();
+    }
+    air_sim_threads++;
+    
+    std::thread thread([func] {
+        air_sim_cpu->lock();
+        func();
+        
+        air_sim_threads--;
+        air_sim_epoch++;
+        air_sim_cpu_cond->notify_all();
+        air_sim_cpu->unlock();
+    });
+    
+    // Runs until it returns or the simulation exits
+    thread.detach();
+}
+#endif
+
+/**
+ * Waits advance the virtual clock, with AIR_RTOS through the thread
+ * scheduler. With AIR_SIM_REALTIME defined they also sleep for the same time,
+ * the virtual clock still drives the simulation so a real time run produces
+ * the same output as a virtual one.
+ */
+void air_sim_wait_us(uint64_t us) {
+#ifdef AIR_SIM_REALTIME
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+#endif
+    
+#ifdef AIR_RTOS
+    air_sim_block([] { return false; }, air_sim.now_us + us);
+#else
+    air_sim_advance_us(us);
+#endif
+}
+
+void wait_us(int us) {
+    air_sim_wait_us(us);
+}
+
+void wait_ms(int ms) {
+    air_sim_wait_us(ms * 1000ULL);
+}
+
+void wait(float s) {
+    air_sim_wait_us((uint64_t)(s * 1e6));
+}
+
+/**
+ * Simulated on-chip flash, laid out like the LPC1768's 512 KB: 16 4 KB sectors
+ * then 14 32 KB sectors, programmed in 256 byte pages. Like NOR flash, erasing
+ * sets bytes to 0xFF and programming can only clear bits. It is not reset by
+ * air_sim_reset so its contents outlive simulated reboots.
+ *
+ * Setting cut_countdown to n cuts the power during the nth program or erase
+ * from then on. The interrupted operation is torn: a program stores a random
+ * number of leading bytes and garbles the next one, an erase only erases a
+ * random number of leading pages. Everything then fails until
+ * air_sim_flash_power_cycle.
+ */
+const uint32_t AIR_SIM_FLASH_SIZE = 512 * 1024;
+const uint32_t AIR_SIM_FLASH_PAGE = 256;
+
+typedef struct {
+    uint8_t mem[AIR_SIM_FLASH_SIZE];
+    bool initialised;
+    
+    int cut_countdown;
+    bool powered_off;
+    
+    uint32_t programs;
+    uint64_t programmed_bytes;
+    uint32_t erases;
+} air_sim_flash_t;
+
+air_sim_flash_t air_sim_flash;
+
+/**
+ * Erase the whole flash and clear its counters.
+ */
+void air_sim_flash_wipe() {
+    memset(air_sim_flash.mem, 0xFF, AIR_SIM_FLASH_SIZE);
+    air_sim_flash.initialised = true;
+    air_sim_flash.cut_countdown = 0;
+    air_sim_flash.powered_off = false;
+    air_sim_flash.programs = 0;
+    air_sim_flash.programmed_bytes = 0;
+    air_sim_flash.erases = 0;
+}
+
+void air_sim_flash_power_cycle() {
+    air_sim_flash.cut_countdown = 0;
+    air_sim_flash.powered_off = false;
+}
+
+/**
+ * Returns: If the power is cut during this operation
+ */
+bool air_sim_flash_cut() {
+    if (air_sim_flash.cut_countdown > 0 && --air_sim_flash.cut_countdown == 0) {
+        air_sim_flash.powered_off = true;
+        return true;
+    }
+    
+    return false;
+}
+
+class FlashIAP {
+public:
+    int init() {
+        if (!air_sim_flash.initialised) {
+            air_sim_flash_wipe();
+        }
+        
+        return 0;
+    }
+    
+    int deinit() {
+        return 0;
+    }
+    
+    int read(void *buffer, uint32_t addr, uint32_t size) {
+        if (air_sim_flash.powered_off || addr + size > AIR_SIM_FLASH_SIZE) {
+            return -1;
+        }
+        
+        memcpy(buffer, &air_sim_flash.mem[addr], size);
+        
+        return 0;
+    }
+    
+    int program(const void *buffer, uint32_t addr, uint32_t size) {
+        if (air_sim_flash.powered_off || addr % AIR_SIM_FLASH_PAGE != 0 || size % AIR_SIM_FLASH_PAGE != 0 ||
+            addr + size > AIR_SIM_FLASH_SIZE) {
+            return -1;
+        }
+        
+        const uint8_t *data = (const uint8_t *)buffer;
+        uint32_t len = size;
+        
+        bool cut = air_sim_flash_cut();
+        if (cut) {
+            len = (uint32_t)(air_sim_rand() * size);
+        }
+        
+        for (uint32_t i = 0; i < len; i++) {
+            air_sim_flash.mem[addr + i] &= data[i];
+        }
+        
+        if (cut) {
+            air_sim_flash.mem[addr + len] &= data[len] | (uint8_t)(air_sim_rand() * 256);
+            return -1;
+        }
+        
+        air_sim_flash.programs++;
+        air_sim_flash.programmed_bytes += size;
+        
+        return 0;
+    }
+    
+    int erase(uint32_t addr, uint32_t size) {
+        if (air_sim_flash.powered_off || addr % get_sector_size(addr) != 0 || addr + size > AIR_SIM_FLASH_SIZE) {
+            return -1;
+        }
+        
+        uint32_t len = size;
+        
+        bool cut = air_sim_flash_cut();
+        if (cut) {
+            len = (uint32_t)(air_sim_rand() * (size / AIR_SIM_FLASH_PAGE)) * AIR_SIM_FLASH_PAGE;
+        }
+        
+        memset(&air_sim_flash.mem[addr], 0xFF, len);
+        
+        if (cut) {
+            return -1;
+        }
+        
+        air_sim_flash.erases++;
+        
+        return 0;
+    }
+    
+    uint32_t get_page_size() const {
+        return AIR_SIM_FLASH_PAGE;
+    }
+    
+    uint32_t get_sector_size(uint32_t addr) const {
+        return addr < 0x10000 ? 4096 : 32768;
+    }
+    
+    uint32_t get_flash_start() const {
+        return 0;
+    }
+    
+    uint32_t get_flash_size() const {
+        return AIR_SIM_FLASH_SIZE;
+    }
+};
+#endif
+
+/**
+ * Pins wired to the sensor's SDA, SCL and nINT.
+ */
+const PinName AIR_SDA_PIN = p9;
+const PinName AIR_SCL_PIN = p10;
+const PinName AIR_NINT_PIN = p8;
+
+#if defined(AIR_SIM)
+I2C i2c(AIR_SDA_PIN, AIR_SCL_PIN);
+#else
+/**
+ * Mbed's I2C, with the peripheral re-initialised in place by bus recovery.
+ */
+class air_i2c_t : public I2C {
+public:
+    air_i2c_t(PinName sda, PinName scl) : I2C(sda, scl) {}
+    
+    /**
+     * Initialise the peripheral again through the HAL, which also takes SDA
+     * and SCL back from GPIO. Holds the I2C lock so no other user of the
+     * peripheral sees it half initialised.
+     */
+    void reinit() {
+        lock();
+        i2c_init(&_i2c, AIR_SDA_PIN, AIR_SCL_PIN);
+        i2c_frequency(&_i2c, _hz);
+        unlock();
+    }
+};
+
+air_i2c_t i2c(AIR_SDA_PIN, AIR_SCL_PIN);
+#endif
+
+#ifdef DEVICE_LOCALFILESYSTEM
+LocalFileSystem local("local");
+#endif
+
+/**
+ * Sensor firmware image applied at start up if present, then removed.
+ */
+const char *AIR_FW_UPDATE_PATH = "/local/ccs811.bin";
+
+/**
+ * Monotonic time in microseconds, the virtual clock in the simulator.
+ */
+#ifdef AIR_SIM
+uint64_t air_now_us() {
+    return air_sim.now_us;
+}
+#else
+uint64_t air_now_us() {
+    static Timer timer;
+    static bool started = false;
+    if (!started) {
+        timer.start();
+        started = true;
+    }
+    
+    return timer.read_high_resolution_us();
+}
+#endif
+
+/**
+ * Cycle counter used for profiling and tracing timestamps. The Cortex-M3 DWT
+ * cycle counter on target, started on first use. The time stamp counter on x86
+ * hosts, nanoseconds elsewhere.
+ */
+#ifndef AIR_SIM
+uint32_t air_cycles() {
+    static bool started = false;
+    if (!started) {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        started = true;
+    }
+    
+    return DWT->CYCCNT;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+uint32_t air_cycles() {
+    return (uint32_t)__rdtsc();
+}
+#else
+uint32_t air_cycles() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+/**
+ * Hot path profiler.
+ *
+ * With AIR_PROFILE defined every air_* function counts its calls and the
+ * cycles spent in it, including callees, with a log2 histogram of per call
+ * cycles. Storage is static, air_profile_dump prints it. Without AIR_PROFILE
+ * AIR_PROFILE_SCOPE expands to nothing.
+ */
+const int AIR_PROFILE_I2C_WRITE = 0;
+const int AIR_PROFILE_I2C_READ = 1;
+const int AIR_PROFILE_READ_STATUS = 2;
+const int AIR_PROFILE_READ_ERROR_ID = 3;
+const int AIR_PROFILE_DIE = 4;
+const int AIR_PROFILE_READ_INFO = 5;
+const int AIR_PROFILE_SYNC_MEAS_MODE = 6;
+const int AIR_PROFILE_BOOT = 7;
+const int AIR_PROFILE_WRITE_MEAS_MODE = 8;
+const int AIR_PROFILE_READ_ALG_RESULT = 9;
+const int AIR_PROFILE_READ_ALG_RESULT_STATUS = 10;
+const int AIR_PROFILE_SW_RESET = 11;
+const int AIR_PROFILE_FW_UPDATE = 12;
+const int AIR_PROFILE_COUNT = 13;
+
+const char *AIR_PROFILE_NAMES[AIR_PROFILE_COUNT] = {
+    "air_i2c_write",
+    "air_i2c_read",
+    "air_read_status",
+    "air_read_error_id",
+    "air_die",
+    "air_read_info",
+    "air_sync_meas_mode",
+    "air_boot",
+    "air_write_meas_mode",
+    "air_read_alg_result",
+    "air_read_alg_result_status",
+    "air_sw_reset",
+    "air_fw_update",
+};
+
+/**
+ * Histogram bucket i counts calls which took [2^i, 2^(i+1)) cycles, the last
+ * bucket everything longer.
+ */
+const int AIR_PROFILE_BUCKETS = 24;
+
+/**
+ * Number of samples main() takes between profile dumps.
+ */
+const int AIR_PROFILE_DUMP_SAMPLES = 60;
+
+#ifdef AIR_PROFILE
+typedef struct {
+    uint32_t calls;
+    uint64_t cycles;
+    uint32_t max_cycles;
+    uint32_t histogram[AIR_PROFILE_BUCKETS];
+} air_profile_t;
+
+air_profile_t air_profile[AIR_PROFILE_COUNT];
+
+/**
+ * Charges the cycles between construction and destruction to one function.
+ */
+class air_profile_scope_t {
+public:
+    air_profile_scope_t(int id) : id(id), start(air_cycles()) {}
+    
+    ~air_profile_scope_t() {
+        uint32_t cycles = air_cycles() - start;
+        air_profile_t *profile = &air_profile[id];
+        
+        int bucket = cycles == 0 ? 0 : 31 - __builtin_clz(cycles);
+        if (bucket >= AIR_PROFILE_BUCKETS) {
+            bucket = AIR_PROFILE_BUCKETS - 1;
+        }
+        
+        profile->calls++;
+        profile->cycles += cycles;
+        profile->histogram[bucket]++;
+        if (cycles > profile->max_cycles) {
+            profile->max_cycles = cycles;
+        }
+    }
+
+private:
+    int id;
+    uint32_t start;
+};
+
+#define AIR_PROFILE_SCOPE(id) air_profile_scope_t air_profile_scope(id)
+
+/**
+ * Print per function call counts, cycles and non empty histogram buckets.
+ */
+void air_profile_dump() {
+    for (int i = 0; i < AIR_PROFILE_COUNT; i++) {
+        air_profile_t *profile = &air_profile[i];
+        if (profile->calls == 0) {
+            continue;
+        }
+        
+        printf("air: profile: %s calls=%lu cycles=%llu mean=%lu max=%lu hist=",
+               AIR_PROFILE_NAMES[i], (unsigned long)profile->calls,
+               (unsigned long long)profile->cycles,
+               (unsigned long)(profile->cycles / profile->calls),
+               (unsigned long)profile->max_cycles);
+        
+        for (int bucket = 0; bucket < AIR_PROFILE_BUCKETS; bucket++) {
+            if (profile->histogram[bucket] > 0) {
+                printf("%d:%lu,", bucket, (unsigned long)profile->histogram[bucket]);
+            }
+        }
+        printf("\r\n");
+    }
+}
+#else
+#define AIR_PROFILE_SCOPE(id)
+#endif
+
+/**
+ * I2C transaction tracer.
+ *
+ * Every driver transaction goes through air_i2c_write and air_i2c_read. With
+ * AIR_TRACE defined each one is recorded into a RAM ring, which is dumped by
+ * air_trace_dump and on die(). A dump can be replayed against the driver on a
+ * host, see AIR_REPLAY. Without AIR_TRACE the wrappers only add the
+ * transaction timeout and bus hang recovery, see air_i2c_check.
+ */
+
+/**
+ * Data bytes kept per record, enough for the largest driver transaction, an
+ * APP_DATA chunk with its mailbox byte.
+ */
+const int AIR_TRACE_DATA_LEN = 9;
+
+#ifndef AIR_TRACE_RECORDS
+#define AIR_TRACE_RECORDS 256
+#endif
+
+/**
+ * One traced transaction, 16 bytes.
+ */
+typedef struct {
+    /**
+     * Trace clock at the start of the transaction, see air_trace_clock_hz.
+     */
+    uint32_t timestamp;
+    
+    /**
+     * 8 bit address, the LSB is set for reads.
+     */
+    uint8_t addr;
+    
+    /**
+     * Number of bytes transferred, only the first AIR_TRACE_DATA_LEN are kept.
+     */
+    uint8_t len;
+    
+    /**
+     * I2C API result, 0 on ACK.
+     */
+    int8_t result;
+    
+    uint8_t data[AIR_TRACE_DATA_LEN];
+} air_trace_record_t;
+
+#ifdef AIR_TRACE
+air_trace_record_t air_trace_ring[AIR_TRACE_RECORDS];
+
+/**
+ * Index the next record is written at.
+ */
+uint32_t air_trace_head = 0;
+
+/**
+ * Total number of records written, including overwritten ones.
+ */
+uint32_t air_trace_total = 0;
+
+#ifdef AIR_SIM
+uint32_t air_trace_clock() {
+    return (uint32_t)air_sim.now_us;
+}
+
+uint32_t air_trace_clock_hz() {
+    return 1000000;
+}
+#else
+uint32_t air_trace_clock() {
+    return air_cycles();
+}
+
+uint32_t air_trace_clock_hz() {
+    return SystemCoreClock;
+}
+#endif
+
+void air_trace_record(uint32_t timestamp, int addr, const char *data, int len, int result) {
+    air_trace_record_t *record = &air_trace_ring[air_trace_head];
+    
+    record->timestamp = timestamp;
+    record->addr = addr;
+    record->len = len;
+    record->result = result;
+    
+    memset(record->data, 0, AIR_TRACE_DATA_LEN);
+    memcpy(record->data, data, len < AIR_TRACE_DATA_LEN ? len : AIR_TRACE_DATA_LEN);
+    
+    air_trace_head = (air_trace_head + 1) % AIR_TRACE_RECORDS;
+    air_trace_total++;
+}
+
+/**
+ * Print the trace ring, oldest record first, in the format read by
+ * air_replay_load.
+ */
+void air_trace_dump() {
+    uint32_t count = air_trace_total < AIR_TRACE_RECORDS ? air_trace_total : AIR_TRACE_RECORDS;
+    uint32_t index = (air_trace_head + AIR_TRACE_RECORDS - count) % AIR_TRACE_RECORDS;
+    
+    printf("air: trace: begin hz=%lu records=%lu dropped=%lu\r\n",
+           (unsigned long)air_trace_clock_hz(), (unsigned long)count,
+           (unsigned long)(air_trace_total - count));
+    
+    for (uint32_t i = 0; i < count; i++) {
+        air_trace_record_t *record = &air_trace_ring[index];
+        
+        printf("air: trace: %lu %02x %d %d", (unsigned long)record->timestamp,
+               record->addr, record->len, record->result);
+        
+        for (int j = 0; j < record->len && j < AIR_TRACE_DATA_LEN; j++) {
+            printf(" %02x", record->data[j]);
+        }
+        printf("\r\n");
+        
+        index = (index + 1) % AIR_TRACE_RECORDS;
+    }
+    
+    printf("air: trace: end\r\n");
+}
+#endif
+
+/**
+ * I2C bus hang recovery.
+ *
+ * A slave holding SDA low, or clock stretching without end, hangs the bus.
+ * Mbed's blocking I2C calls cannot be cancelled, but the HAL gives up waiting
+ * on the bus after a spin limit. air_i2c_write and air_i2c_read report a
+ * failed transaction which took longer than AIR_I2C_TIMEOUT_US as
+ * AIR_I2C_TIMEOUT. The time is wall time, which includes preemption and
+ * interrupts masked by flash writes, so it never fails a transaction the HAL
+ * completed. After a timeout, or a failure with SDA held low, they recover
+ * the bus: clock out up to 9 SCL pulses until the slave lets go of SDA, issue
+ * a STOP and re-initialise the peripheral.
+ */
+const uint64_t AIR_I2C_TIMEOUT_US = 4000;
+
+/**
+ * I2C API result for a timed out transaction.
+ */
+const int AIR_I2C_TIMEOUT = -3;
+
+/**
+ * Bus hang counters. Time spent recovering is in recover_us, the longest
+ * transaction took transaction_max_us.
+ */
+typedef struct {
+    uint32_t timeouts;
+    uint32_t recoveries;
+    uint64_t recover_us;
+    uint64_t recover_max_us;
+    uint64_t transaction_max_us;
+} air_i2c_stats_t;
+
+air_i2c_stats_t air_i2c_stats;
+
+#if defined(AIR_SIM)
+/**
+ * Level of the SDA line, 1 if released.
+ */
+int air_i2c_sda() {
+    return !air_sim.fault_sda_held;
+}
+
+/**
+ * Clock out a slave holding SDA and re-initialise the peripheral.
+ */
+void air_i2c_clock_out() {
+    air_sim_clock_out();
+}
+#else
+#ifdef TARGET_LPC1768
+/**
+ * p9 is P0.0. A GPIO port reads the pin level whatever function the pin has.
+ */
+const uint32_t AIR_SDA_GPIO_MASK = 1 << 0;
+
+int air_i2c_sda() {
+    return (LPC_GPIO0->FIOPIN & AIR_SDA_GPIO_MASK) != 0;
+}
+#else
+int air_i2c_sda() {
+    return 1;
+}
+#endif
+
+/**
+ * Half of an SCL period at 100 kHz.
+ */
+const int AIR_I2C_HALF_CLOCK_US = 5;
+
+void air_i2c_clock_out() {
+    {
+        // Open drain by hand: driven low as an output, released as an input
+        DigitalInOut sda(AIR_SDA_PIN);
+        DigitalInOut scl(AIR_SCL_PIN);
+        sda.input();
+        scl.input();
+        
+        for (int i = 0; i < 9 && sda.read() == 0; i++) {
+            scl.write(0);
+            scl.output();
+            wait_us(AIR_I2C_HALF_CLOCK_US);
+            scl.input();
+            wait_us(AIR_I2C_HALF_CLOCK_US);
+        }
+        
+        // STOP: SDA rises while SCL is high
+        scl.write(0);
+        scl.output();
+        sda.write(0);
+        sda.output();
+        wait_us(AIR_I2C_HALF_CLOCK_US);
+        scl.input();
+        wait_us(AIR_I2C_HALF_CLOCK_US);
+        sda.input();
+        wait_us(AIR_I2C_HALF_CLOCK_US);
+    }
+    
+    i2c.reinit();
+}
+#endif
+
+/**
+ * Recover a hung bus. The caller must own the bus.
+ */
+void air_i2c_recover() {
+    uint64_t start_us = air_now_us();
+    
+    air_i2c_clock_out();
+    
+    uint64_t recover_us = air_now_us() - start_us;
+    air_i2c_stats.recoveries++;
+    air_i2c_stats.recover_us += recover_us;
+    if (recover_us > air_i2c_stats.recover_max_us) {
+        air_i2c_stats.recover_max_us = recover_us;
+    }
+}
+
+/**
+ * Apply the transaction timeout to a failed transaction and recover the bus
+ * if it hung.
+ * Returns: result, AIR_I2C_TIMEOUT if the transaction failed and timed out
+ */
+int air_i2c_check(int result, uint64_t start_us) {
+    uint64_t elapsed_us = air_now_us() - start_us;
+    if (elapsed_us > air_i2c_stats.transaction_max_us) {
+        air_i2c_stats.transaction_max_us = elapsed_us;
+    }
+    
+    if (result == 0) {
+        return result;
+    }
+    
+    if (elapsed_us >= AIR_I2C_TIMEOUT_US) {
+        air_i2c_stats.timeouts++;
+        result = AIR_I2C_TIMEOUT;
+    }
+    
+    if (result == AIR_I2C_TIMEOUT || !air_i2c_sda()) {
+        air_i2c_recover();
+    }
+    
+    return result;
+}
+
+/**
+ * Print bus hang counters.
+ */
+void air_i2c_dump() {
+    printf("air: i2c: timeouts=%lu recoveries=%lu recover_us_mean=%lu recover_us_max=%lu transaction_us_max=%lu\r\n",
+           (unsigned long)air_i2c_stats.timeouts, (unsigned long)air_i2c_stats.recoveries,
+           (unsigned long)(air_i2c_stats.recoveries > 0 ? air_i2c_stats.recover_us / air_i2c_stats.recoveries : 0),
+           (unsigned long)air_i2c_stats.recover_max_us, (unsigned long)air_i2c_stats.transaction_max_us);
+}
+
+int air_i2c_write(int addr, const char *data, int len, bool repeated = false) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_I2C_WRITE);
+    
+#ifdef AIR_REPLAY
+    air_replay_hold();
+#endif
+    uint64_t start_us = air_now_us();
+#ifdef AIR_TRACE
+    uint32_t timestamp = air_trace_clock();
+#endif
+    
+    int result = air_i2c_check(i2c.write(addr, data, len, repeated), start_us);
+    
+#ifdef AIR_TRACE
+    air_trace_record(timestamp, addr & ~1, data, len, result);
+#endif
+    
+    return result;
+}
+
+int air_i2c_read(int addr, char *data, int len, bool repeated = false) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_I2C_READ);
+    
+#ifdef AIR_REPLAY
+    air_replay_hold();
+#endif
+    uint64_t start_us = air_now_us();
+#ifdef AIR_TRACE
+    uint32_t timestamp = air_trace_clock();
+#endif
+    
+    int result = air_i2c_check(i2c.read(addr, data, len, repeated), start_us);
+    
+#ifdef AIR_TRACE
+    air_trace_record(timestamp, addr | 1, data, len, result);
+#endif
+    
+    return result;
+}
+
+/**
+ * Binary telemetry.
+ *
+ * Building with AIR_TELEMETRY defined makes main() and die() send binary
+ * frames instead of text lines. A frame is
+ *
+ *     type:u8 seq:u8 timestamp_ms:u32 body crc:u16
+ *
+ * little endian, crc being the CRC-16/CCITT-FALSE of everything before it. It
+ * is COBS encoded, so it holds no zero bytes, and followed by a zero byte, so
+ * a receiver can start or resynchronise at any zero. seq counts frames so a
+ * receiver can spot lost ones. Bodies:
+ *
+ *     SAMPLE  seq:u32 eco2:u16 tvoc:u16
+ *     STATUS  status:u8 meas_mode:u8 hw_id:u8 hw_version:u8
+ *             fw_boot_version:u16 fw_app_version:u16
+ *     ERROR   error_id:u8 text, up to AIR_TLM_TEXT_MAX bytes
+ *     EVENT   event:u8 arg:u32
+ *
+ * status is the STATUS register. error_id is the ERROR_ID register for sensor
+ * errors, 0 for others.
+ */
+const uint8_t AIR_TLM_SAMPLE = 1;
+const uint8_t AIR_TLM_STATUS = 2;
+const uint8_t AIR_TLM_ERROR = 3;
+const uint8_t AIR_TLM_EVENT = 4;
+
+const uint8_t AIR_TLM_EVENT_BOOTING = 1;
+const uint8_t AIR_TLM_EVENT_MODE_SET = 2;
+const uint8_t AIR_TLM_EVENT_FW_UPDATED = 3;
+const uint8_t AIR_TLM_EVENT_NO_SAMPLE = 4;
+const uint8_t AIR_TLM_EVENT_RECOVERY = 5;
+const uint8_t AIR_TLM_EVENT_WATCHDOG_RESET = 6;
+const uint8_t AIR_TLM_EVENT_REMOVED = 7;
+const uint8_t AIR_TLM_EVENT_APPEARED = 8;
+const uint8_t AIR_TLM_EVENT_RESUMED = 9;
+
+const int AIR_TLM_HEADER_BYTES = 6;
+const int AIR_TLM_TEXT_MAX = 48;
+const int AIR_TLM_PAYLOAD_MAX = AIR_TLM_HEADER_BYTES + 1 + AIR_TLM_TEXT_MAX + 2;
+
+/**
+ * Largest encoded frame, COBS adds a byte per 254 and the delimiter.
+ */
+const int AIR_TLM_FRAME_MAX = AIR_TLM_PAYLOAD_MAX + 2;
+
+uint8_t air_tlm_seq = 0;
+
+/**
+ * ERROR_ID for the next die(), set by air_die.
+ */
+char air_tlm_error_id = 0;
+
+/**
+ * CRC-16/CCITT-FALSE, a nibble at a time to keep the table small.
+ */
+const uint16_t AIR_CRC16_NIBBLES[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+uint16_t air_crc16(const uint8_t *data, int len) {
+    uint16_t crc = 0xFFFF;
+    
+    for (int i = 0; i < len; i++) {
+        crc = (crc << 4) ^ AIR_CRC16_NIBBLES[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ AIR_CRC16_NIBBLES[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    
+    return crc;
+}
+
+void air_tlm_put_u16(uint8_t *buf, uint16_t value) {
+    buf[0] = value;
+    buf[1] = value >> 8;
+}
+
+void air_tlm_put_u32(uint8_t *buf, uint32_t value) {
+    air_tlm_put_u16(buf, value);
+    air_tlm_put_u16(buf + 2, value >> 16);
+}
+
+uint16_t air_tlm_get_u16(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8);
+}
+
+uint32_t air_tlm_get_u32(const uint8_t *buf) {
+    return air_tlm_get_u16(buf) | ((uint32_t)air_tlm_get_u16(buf + 2) << 16);
+}
+
+/**
+ * COBS encode len bytes into out, which needs len + len / 254 + 1 bytes.
+ * Returns: Encoded length, without the delimiter
+ */
+int air_cobs_encode(const uint8_t *in, int len, uint8_t *out) {
+    int code_at = 0;
+    int n = 1;
+    uint8_t code = 1;
+    
+    for (int i = 0; i < len; i++) {
+        if (in[i] != 0) {
+            out[n++] = in[i];
+            code++;
+        }
+        
+        if (in[i] == 0 || code == 0xFF) {
+            out[code_at] = code;
+            code_at = n++;
+            code = 1;
+        }
+    }
+    
+    out[code_at] = code;
+    
+    return n;
+}
+
+/**
+ * Build a frame, delimiter included.
+ * Returns: Frame length
+ */
+int air_tlm_encode(uint8_t *frame, uint8_t type, uint32_t timestamp_ms, const uint8_t *body, int body_len) {
+    uint8_t payload[AIR_TLM_PAYLOAD_MAX];
+    
+    payload[0] = type;
+    payload[1] = air_tlm_seq++;
+    air_tlm_put_u32(&payload[2], timestamp_ms);
+    memcpy(&payload[AIR_TLM_HEADER_BYTES], body, body_len);
+    
+    int len = AIR_TLM_HEADER_BYTES + body_len;
+    air_tlm_put_u16(&payload[len], air_crc16(payload, len));
+    len += 2;
+    
+    int n = air_cobs_encode(payload, len, frame);
+    frame[n++] = 0;
+    
+    return n;
+}
+
+/**
+ * Send a frame on stdout, the serial port on the target.
+ */
+void air_tlm_send(uint8_t type, const uint8_t *body, int body_len) {
+    uint8_t frame[AIR_TLM_FRAME_MAX];
+    int n = air_tlm_encode(frame, type, air_now_us() / 1000, body, body_len);
+    
+    fwrite(frame, 1, n, stdout);
+    fflush(stdout);
+}
+
+void air_tlm_event(uint8_t event, uint32_t arg) {
+    uint8_t body[5];
+    body[0] = event;
+    air_tlm_put_u32(&body[1], arg);
+    
+    air_tlm_send(AIR_TLM_EVENT, body, sizeof(body));
+}
+
+/**
+ * Send an error, text is cut to AIR_TLM_TEXT_MAX bytes without a trailing
+ * line end.
+ */
+void air_tlm_error(char error_id, const char *text) {
+    uint8_t body[1 + AIR_TLM_TEXT_MAX];
+    body[0] = error_id;
+    
+    int len = strlen(text);
+    while (len > 0 && (text[len - 1] == '\r' || text[len - 1] == '\n')) {
+        len--;
+    }
+    if (len > AIR_TLM_TEXT_MAX) {
+        len = AIR_TLM_TEXT_MAX;
+    }
+    memcpy(&body[1], text, len);
+    
+    air_tlm_send(AIR_TLM_ERROR, body, 1 + len);
+}
+
+#ifdef AIR_SIM
+/**
+ * Streaming telemetry decoder for the host.
+ *
+ * air_tlm_decode takes the received bytes in chunks of any size and calls the
+ * handler for each good frame. Frames are COBS decoded in place and handed to
+ * the handler as pointers into the chunk, only a frame split between chunks
+ * is copied. Frames failing their CRC or COBS decoding, too short or too long
+ * are counted and dropped.
+ */
+typedef struct {
+    uint8_t type;
+    uint8_t seq;
+    uint32_t timestamp_ms;
+    
+    /**
+     * Points into the chunk being decoded, valid during the handler call.
+     */
+    const uint8_t *body;
+    int body_len;
+} air_tlm_frame_t;
+
+typedef void (*air_tlm_handler_t)(void *ctx, const air_tlm_frame_t *frame);
+
+typedef struct {
+    /**
+     * Start of a frame split between chunks. discard is set once it grew too
+     * long, until the next delimiter.
+     */
+    uint8_t carry[AIR_TLM_FRAME_MAX];
+    int carry_len;
+    bool discard;
+    
+    uint32_t frames;
+    uint32_t crc_errors;
+    uint32_t framing_errors;
+} air_tlm_decoder_t;
+
+/**
+ * COBS decode in place.
+ * Returns: Decoded length, -1 if not valid COBS
+ */
+int air_cobs_decode(uint8_t *data, int len) {
+    int in = 0;
+    int out = 0;
+    
+    while (in < len) {
+        uint8_t code = data[in++];
+        if (code == 0 || in + code - 1 > len) {
+            return -1;
+        }
+        
+        for (int i = 1; i < code; i++) {
+            data[out++] = data[in++];
+        }
+        
+        if (code != 0xFF && in < len) {
+            data[out++] = 0;
+        }
+    }
+    
+    return out;
+}
+
+void air_tlm_decode_frame(air_tlm_decoder_t *decoder, uint8_t *data, int len,
+                          air_tlm_handler_t handler, void *ctx) {
+    // Back to back delimiters
+    if (len == 0) {
+        return;
+    }
+    
+    len = air_cobs_decode(data, len);
+    if (len < AIR_TLM_HEADER_BYTES + 2) {
+        decoder->framing_errors++;
+        return;
+    }
+    
+    len -= 2;
+    if (air_tlm_get_u16(&data[len]) != air_crc16(data, len)) {
+        decoder->crc_errors++;
+        return;
+    }
+    
+    air_tlm_frame_t frame;
+    frame.type = data[0];
+    frame.seq = data[1];
+    frame.timestamp_ms = air_tlm_get_u32(&data[2]);
+    frame.body = &data[AIR_TLM_HEADER_BYTES];
+    frame.body_len = len - AIR_TLM_HEADER_BYTES;
+    
+    decoder->frames++;
+    handler(ctx, &frame);
+}
+
+/**
+ * Keep the start of a frame which continues in the next chunk.
+ */
+void air_tlm_carry(air_tlm_decoder_t *decoder, const uint8_t *data, int len) {
+    if (decoder->discard) {
+        return;
+    }
+    
+    if (decoder->carry_len + len > AIR_TLM_FRAME_MAX) {
+        decoder->discard = true;
+        decoder->framing_errors++;
+        return;
+    }
+    
+    memcpy(&decoder->carry[decoder->carry_len], data, len);
+    decoder->carry_len += len;
+}
+
+/**
+ * Decode a chunk of received bytes, which are overwritten.
+ */
+void air_tlm_decode(air_tlm_decoder_t *decoder, uint8_t *data, int len, air_tlm_handler_t handler, void *ctx) {
+    int start = 0;
+    
+    while (start < len) {
+        uint8_t *end = (uint8_t *)memchr(&data[start], 0, len - start);
+        if (end == NULL) {
+            air_tlm_carry(decoder, &data[start], len - start);
+            return;
+        }
+        
+        int n = end - &data[start];
+        
+        if (decoder->carry_len > 0 || decoder->discard) {
+            air_tlm_carry(decoder, &data[start], n);
+            if (!decoder->discard) {
+                air_tlm_decode_frame(decoder, decoder->carry, decoder->carry_len, handler, ctx);
+            }
+            
+            decoder->carry_len = 0;
+            decoder->discard = false;
+        } else if (n > AIR_TLM_FRAME_MAX) {
+            decoder->framing_errors++;
+        } else {
+            air_tlm_decode_frame(decoder, &data[start], n, handler, ctx);
+        }
+        
+        start += n + 1;
+    }
+}
+#endif
+
+void die(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    
+#ifdef AIR_TELEMETRY
+    char text[AIR_TLM_TEXT_MAX + 1];
+    vsnprintf(text, sizeof(text), fmt, args);
+    air_tlm_error(air_tlm_error_id, text);
+#else
+    vprintf(fmt, args);
+    printf("\r\n");
+#endif
+    
+    va_end(args);
+    
+#ifdef AIR_TRACE
+    air_trace_dump();
+#endif
+    
+    exit(1);
+}
+
+#ifdef AIR_REPLAY
+/**
+ * Trace replay.
+ *
+ * Building with AIR_REPLAY defined runs main() against a trace dump read from
+ * stdin instead of the simulated sensor:
+ *
+ *     g++ -DAIR_REPLAY -o air_replay main.cpp && ./air_replay < serial.log
+ *
+ * Each driver transaction must match the next traced one, reads return the
+ * traced bytes and every transaction returns the traced result. The virtual
+ * clock is held back to the traced timestamps so the driver sees the same
+ * timing as on the device. Replay stops with an error at the first
+ * divergence.
+ */
+
+air_trace_record_t *air_replay_records = NULL;
+uint32_t air_replay_count = 0;
+uint32_t air_replay_next = 0;
+
+/**
+ * Traced time of each record relative to the first, in microseconds.
+ */
+uint64_t *air_replay_offset_us = NULL;
+
+/**
+ * Virtual time the first replayed transaction happened at.
+ */
+uint64_t air_replay_base_us = 0;
+
+/**
+ * Largest amount the driver ran behind the trace, in microseconds.
+ */
+uint64_t air_replay_max_lag_us = 0;
+
+/**
+ * Read a trace dump from stdin. Lines without the trace prefix, such as other
+ * serial output, are skipped.
+ */
+void air_replay_load() {
+    const char *prefix = "air: trace: ";
+    unsigned long hz = 0;
+    unsigned long dropped = 0;
+    uint32_t capacity = 0;
+    uint32_t last_timestamp = 0;
+    
+    char line[256];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        const char *p = strstr(line, prefix);
+        if (p == NULL) {
+            continue;
+        }
+        p += strlen(prefix);
+        
+        if (strncmp(p, "begin", 5) == 0) {
+            unsigned long records;
+            sscanf(p, "begin hz=%lu records=%lu dropped=%lu", &hz, &records, &dropped);
+            continue;
+        } else if (strncmp(p, "end", 3) == 0) {
+            break;
+        }
+        
+        unsigned long timestamp;
+        unsigned int addr;
+        int len;
+        int result;
+        int n;
+        if (sscanf(p, "%lu %x %d %d%n", &timestamp, &addr, &len, &result, &n) != 4) {
+            die("air: replay: malformed trace line: %s", line);
+        }
+        p += n;
+        
+        if (air_replay_count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            air_replay_records = (air_trace_record_t *)realloc(air_replay_records, capacity * sizeof(air_trace_record_t));
+            air_replay_offset_us = (uint64_t *)realloc(air_replay_offset_us, capacity * sizeof(uint64_t));
+        }
+        
+        air_trace_record_t *record = &air_replay_records[air_replay_count];
+        memset(record, 0, sizeof(air_trace_record_t));
+        record->timestamp = timestamp;
+        record->addr = addr;
+        record->len = len;
+        record->result = result;
+        
+        for (int i = 0; i < len && i < AIR_TRACE_DATA_LEN; i++) {
+            unsigned int byte;
+            if (sscanf(p, " %x%n", &byte, &n) != 1) {
+                die("air: replay: malformed trace data: %s", line);
+            }
+            p += n;
+            record->data[i] = byte;
+        }
+        
+        // The trace clock wraps, offsets are accumulated from the deltas
+        if (air_replay_count == 0) {
+            air_replay_offset_us[0] = 0;
+        } else {
+            uint32_t delta = record->timestamp - last_timestamp;
+            air_replay_offset_us[air_replay_count] = air_replay_offset_us[air_replay_count - 1] + (uint64_t)delta * 1000000ULL / hz;
+        }
+        last_timestamp = record->timestamp;
+        
+        air_replay_count++;
+    }
+    
+    if (hz == 0 || air_replay_count == 0) {
+        die("air: replay: no trace found on stdin");
+    }
+    
+    if (dropped > 0) {
+        printf("air: replay: trace dropped %lu records, replay may diverge at the start\r\n", dropped);
+    }
+    
+    printf("air: replay: loaded %lu records at %lu Hz\r\n", (unsigned long)air_replay_count, hz);
+}
+
+/**
+ * Hold the virtual clock to the next traced transaction's timestamp. Called
+ * before the transaction starts, so the jump is not counted against the
+ * transaction timeout by air_i2c_check.
+ */
+void air_replay_hold() {
+    if (air_replay_next == air_replay_count) {
+        return;
+    }
+    
+    if (air_replay_next == 0) {
+        air_replay_base_us = air_sim.now_us;
+    }
+    
+    uint64_t traced_us = air_replay_base_us + air_replay_offset_us[air_replay_next];
+    if (air_sim.now_us < traced_us) {
+        air_sim.now_us = traced_us;
+    } else if (air_sim.now_us - traced_us > air_replay_max_lag_us) {
+        air_replay_max_lag_us = air_sim.now_us - traced_us;
+    }
+}
+
+/**
+ * Match a driver transaction against the next traced one.
+ * Returns: Matching trace record
+ */
+air_trace_record_t *air_replay_match(int addr, const char *data, int len) {
+    if (air_replay_next == air_replay_count) {
+        printf("air: replay: complete, %lu records, driver ran at most %llu us behind the trace\r\n",
+               (unsigned long)air_replay_count, (unsigned long long)air_replay_max_lag_us);
+        exit(0);
+    }
+    
+    air_trace_record_t *record = &air_replay_records[air_replay_next];
+    
+    bool match = record->addr == addr && record->len == len;
+    if (match && data != NULL) {
+        match = memcmp(record->data, data, len < AIR_TRACE_DATA_LEN ? len : AIR_TRACE_DATA_LEN) == 0;
+    }
+    
+    if (!match) {
+        printf("air: replay: diverged at record %lu, traced addr=%02x len=%d, driver addr=%02x len=%d\r\n",
+               (unsigned long)air_replay_next, record->addr, record->len, addr, len);
+        exit(1);
+    }
+    
+    air_replay_next++;
+    
+    return record;
+}
+
+int air_replay_write(int address, const char *data, int length) {
+    return air_replay_match(address & ~1, data, length)->result;
+}
+
+int air_replay_read(int address, char *data, int length) {
+    air_trace_record_t *record = air_replay_match(address | 1, NULL, length);
+    
+    memset(data, 0, length);
+    memcpy(data, record->data, length < AIR_TRACE_DATA_LEN ? length : AIR_TRACE_DATA_LEN);
+    
+    return record->result;
+}
+#endif
+
+/**
+ * Shared I2C bus arbiter.
+ *
+ * Every driver transfer, and those of any other peripheral on the bus, goes
+ * through air_bus_transfer. A transfer is an optional write followed by an
+ * optional read with a repeated start, so selecting a register and reading it
+ * cannot be split by another bus user. Waiting transfers are served highest
+ * priority first: sample reads, then configuration, then firmware chunks, so
+ * a firmware update cannot starve sampling. Whoever holds the bus also runs
+ * queued transfers for the same device back to back, up to
+ * AIR_BUS_MAX_BATCH, without handing the bus over in between. Without
+ * AIR_RTOS there is a single bus user and transfers run immediately.
+ */
+const int AIR_BUS_PRIO_SAMPLE = 0;
+const int AIR_BUS_PRIO_CONFIG = 1;
+const int AIR_BUS_PRIO_FIRMWARE = 2;
+const int AIR_BUS_PRIOS = 3;
+const char *AIR_BUS_PRIO_NAMES[AIR_BUS_PRIOS] = { "sample", "config", "firmware" };
+
+const int AIR_BUS_MAX_BATCH = 8;
+
+/**
+ * Queued bus transfer, lives on the submitter's stack.
+ */
+typedef struct air_bus_txn {
+    int addr;
+    const char *write_buf;
+    int write_len;
+    char *read_buf;
+    int read_len;
+    
+    /**
+     * I2C API result of the first failed step, 0 on success.
+     */
+    int result;
+    
+    bool done;
+    uint64_t queued_us;
+    struct air_bus_txn *next;
+} air_bus_txn_t;
+
+/**
+ * Per priority class counters.
+ */
+typedef struct {
+    uint32_t transfers;
+    
+    /**
+     * Transfers run in the same bus hold as the previous one.
+     */
+    uint32_t merged;
+    
+    uint64_t wait_us;
+    uint64_t wait_max_us;
+} air_bus_stats_t;
+
+air_bus_stats_t air_bus_stats[AIR_BUS_PRIOS];
+
+air_bus_txn_t *air_bus_head[AIR_BUS_PRIOS];
+air_bus_txn_t *air_bus_tail[AIR_BUS_PRIOS];
+
+/**
+ * If a transfer is being run.
+ */
+bool air_bus_busy = false;
+
+#if defined(AIR_RTOS) && !defined(AIR_SIM)
+Mutex air_bus_mutex;
+ConditionVariable air_bus_cond(air_bus_mutex);
+
+void air_bus_lock() {
+    air_bus_mutex.lock();
+}
+
+void air_bus_unlock() {
+    air_bus_mutex.unlock();
+}
+
+void air_bus_wait() {
+    air_bus_cond.wait();
+}
+
+void air_bus_notify() {
+    air_bus_cond.notify_all();
+}
+#elif defined(AIR_RTOS)
+std::mutex air_bus_mutex;
+std::condition_variable_any air_bus_cond;
+
+void air_bus_lock() {
+    air_bus_mutex.lock();
+}
+
+void air_bus_unlock() {
+    air_bus_mutex.unlock();
+}
+
+void air_bus_wait() {
+    air_bus_cond.wait(air_bus_mutex);
+}
+
+void air_bus_notify() {
+    air_bus_cond.notify_all();
+}
+#else
+void air_bus_lock() {}
+void air_bus_unlock() {}
+
+void air_bus_wait() {
+    die("air: bus: wait without threads, transfer started from a callback?");
+}
+
+void air_bus_notify() {}
+#endif
+
+/**
+ * Remove the highest priority queued transfer. Must hold the bus lock.
+ * addr: Only take the transfer if it is for this device, -1 for any
+ * Returns: Transfer, NULL if none or it is for another device
+ */
+air_bus_txn_t *air_bus_dequeue(int addr, int *prio) {
+    for (int i = 0; i < AIR_BUS_PRIOS; i++) {
+        air_bus_txn_t *txn = air_bus_head[i];
+        if (txn == NULL) {
+            continue;
+        }
+        
+        if (addr >= 0 && txn->addr != addr) {
+            return NULL;
+        }
+        
+        air_bus_head[i] = txn->next;
+        if (air_bus_head[i] == NULL) {
+            air_bus_tail[i] = NULL;
+        }
+        
+        *prio = i;
+        return txn;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Run a transfer on the bus.
+ */
+void air_bus_execute(air_bus_txn_t *txn) {
+    txn->result = 0;
+    
+    if (txn->write_len > 0) {
+        txn->result = air_i2c_write(txn->addr, txn->write_buf, txn->write_len, txn->read_len > 0);
+    }
+    
+    if (txn->result == 0 && txn->read_len > 0) {
+        txn->result = air_i2c_read(txn->addr, txn->read_buf, txn->read_len);
+    }
+}
+
+/**
+ * Write write_len bytes then read read_len bytes, with a repeated start in
+ * between, once the bus is free and no higher priority transfer is waiting.
+ * Returns: 0 on success, the I2C API result of the failed step otherwise
+ */
+int air_bus_transfer(int prio, int addr, const char *write_buf, int write_len, char *read_buf, int read_len) {
+    air_bus_txn_t txn;
+    txn.addr = addr;
+    txn.write_buf = write_buf;
+    txn.write_len = write_len;
+    txn.read_buf = read_buf;
+    txn.read_len = read_len;
+    txn.result = 0;
+    txn.done = false;
+    txn.queued_us = air_now_us();
+    txn.next = NULL;
+    
+    air_bus_lock();
+    
+    if (air_bus_tail[prio] != NULL) {
+        air_bus_tail[prio]->next = &txn;
+    } else {
+        air_bus_head[prio] = &txn;
+    }
+    air_bus_tail[prio] = &txn;
+    
+    while (!txn.done) {
+        if (air_bus_busy) {
+            air_bus_wait();
+            continue;
+        }
+        
+        // Take the bus and run a batch of transfers for one device
+        air_bus_busy = true;
+        
+        int batch_addr = -1;
+        for (int batch = 0; batch < AIR_BUS_MAX_BATCH; batch++) {
+            int next_prio;
+            air_bus_txn_t *next = air_bus_dequeue(batch_addr, &next_prio);
+            if (next == NULL) {
+                break;
+            }
+            
+            air_bus_stats_t *stats = &air_bus_stats[next_prio];
+            uint64_t wait_us = air_now_us() - next->queued_us;
+            
+            stats->transfers++;
+            stats->wait_us += wait_us;
+            if (wait_us > stats->wait_max_us) {
+                stats->wait_max_us = wait_us;
+            }
+            if (batch > 0) {
+                stats->merged++;
+            }
+            
+            air_bus_unlock();
+            air_bus_execute(next);
+            air_bus_lock();
+            
+            next->done = true;
+            batch_addr = next->addr;
+        }
+        
+        air_bus_busy = false;
+        air_bus_notify();
+    }
+    
+    air_bus_unlock();
+    
+    return txn.result;
+}
+
+/**
+ * 8 bit address of the sensor, AIR_ADDR or AIR_ADDR_ALT with its ADDR pin
+ * high. Set by air_probe.
+ */
+int air_addr = AIR_ADDR;
+
+/**
+ * Select an air sensor register and read it in one bus transfer.
+ */
+int air_bus_read_reg(int prio, const char *reg, char *buf, int len) {
+    return air_bus_transfer(prio, air_addr, reg, 1, buf, len);
+}
+
+/**
+ * Write to the air sensor, buf[0] being the register.
+ */
+int air_bus_write(int prio, const char *buf, int len) {
+    return air_bus_transfer(prio, air_addr, buf, len, NULL, 0);
+}
+
+/**
+ * Print transfers, merged transfers and wait times per priority class.
+ */
+void air_bus_dump() {
+    for (int i = 0; i < AIR_BUS_PRIOS; i++) {
+        air_bus_stats_t *stats = &air_bus_stats[i];
+        
+        printf("air: bus: %s transfers=%lu merged=%lu wait_us_mean=%llu wait_us_max=%llu\r\n",
+               AIR_BUS_PRIO_NAMES[i], (unsigned long)stats->transfers, (unsigned long)stats->merged,
+               (unsigned long long)(stats->transfers > 0 ? stats->wait_us / stats->transfers : 0),
+               (unsigned long long)stats->wait_max_us);
+    }
+}
+
+/**
+ * Air sensor status register fields.
+ */
+typedef struct {
+    /**
+     * Firmware mode, see AIR_STATUS_FW_MODE_* constants.
+     */
+    char fw_mode;
+    
+    /**
+     * Indicates if the application on the sensor is valid.
+     * Boolean.
+     */
+    char app_valid;
+    
+    /**
+     * If an error has occured.
+     * Boolean.
+     */
+    char error;
+    
+    /**
+     * If a new data measurement is available.
+     * Boolean.
+     */
+    char data_ready;
+    
+    /**
+     * Raw bit packed status valid, useful to have here for debugging purposes.
+     */
+     char raw;
+} air_status_t;
+
+/**
+ * Unpack a raw status register value into the air_status argument.
+ */
+void air_decode_status(char raw_status, air_status_t *air_status) {
+    air_status->fw_mode = air_status_fw_mode_t::get(raw_status);
+    air_status->app_valid = air_status_app_valid_t::get(raw_status);
+    air_status->data_ready = air_status_data_ready_t::get(raw_status);
+    air_status->error = air_status_error_t::get(raw_status);
+    air_status->raw = raw_status;
+}
+
+/**
+ * Read air sensor status register into the air_status arugment.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_status(air_status_t *air_status) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_STATUS);
+    
+    char raw_status;
+    if (air_bus_read_reg(AIR_BUS_PRIO_SAMPLE, &AIR_STATUS_REG, &raw_status, 1) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    air_decode_status(raw_status, air_status);
+    
+    return AIR_OK;
+}
+
+/**
+ * Read air sensor status register into the air_status arugment.
+ */
+void air_read_status(air_status_t *air_status) {
+    if (air_try_read_status(air_status) != AIR_OK) {
+        die("air: read_status: failed to read air status register");
+    }
+}
+
+/**
+ * Read error ID from the air sensor, which clears it.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_error_id(char *air_error_id) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_ERROR_ID);
+    
+    if (air_bus_read_reg(AIR_BUS_PRIO_SAMPLE, &AIR_ERROR_ID_REG, air_error_id, 1) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Read error ID from the air sensor.
+ * Returns: Error ID
+ */
+char air_read_error_id() {
+    char air_error_id;
+    if (air_try_read_error_id(&air_error_id) != AIR_OK) {
+        die("air: read_error_id: failed to read error id");
+    }
+    
+    return air_error_id;
+}
+
+/**
+ * Exits program with there is an error with the air sensor.
+ */
+void air_die() {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_DIE);
+    
+    air_status_t air_status;
+    air_read_status(&air_status);
+    if (air_status.error) {
+        char air_error_id = air_read_error_id();
+        const char *str_air_error_id = NULL;
+        
+        // Report the lowest error bit set
+        int air_error_bit = 0;
+        while (air_error_bit < 8 && !(air_error_id & (1 << air_error_bit))) {
+            air_error_bit++;
+        }
+        
+        switch(air_error_bit) {
+            case AIR_ERROR_ID_BAD_WRITE:
+                str_air_error_id = "a write occurred for an invalid register address";
+                break;
+            case AIR_ERROR_ID_BAD_READ:
+                str_air_error_id = "a read occurred for an invalid register address";
+                break;
+            case AIR_ERROR_ID_BAD_MODE:
+                str_air_error_id = "the measurement drive mode is invalid";
+                break;
+            case AIR_ERROR_ID_MAX_RESISTANCE:
+                str_air_error_id = "the resistance is set too high";
+                break;
+            case AIR_ERROR_ID_HEATER_FAULT:
+                str_air_error_id = "the heater's current was not in range";
+                break;
+            case AIR_ERROR_ID_HEATER_SUPPLY:
+                str_air_error_id = "the heater's voltage is not being applied correctly";
+                break;
+            default:
+                str_air_error_id = "unknown error!";
+                break;
+        }
+        
+#ifdef AIR_TELEMETRY
+        air_tlm_error_id = air_error_id;
+#endif
+        die("air: error: %s\r\n", str_air_error_id);
+    }
+}
+
+/**
+ * Air sensor device information, read once by air_boot.
+ */
+typedef struct {
+    /**
+     * Hardware ID, AIR_HW_ID_EXPECTED for a CCS811.
+     */
+    char hw_id;
+    
+    /**
+     * Hardware version, major in the high nibble.
+     */
+    char hw_version;
+    
+    /**
+     * Bootloader and application firmware versions. Bits 15:12 are the
+     * major, 11:8 the minor and 7:0 the trivial version.
+     */
+    uint16_t fw_boot_version;
+    uint16_t fw_app_version;
+} air_info_t;
+
+air_info_t air_info_cache;
+
+/**
+ * If air_info_cache holds the connected sensor's information.
+ * Boolean.
+ */
+char air_info_valid = 0;
+
+/**
+ * Read one device information register, a mailbox read like any other
+ * register. HW_ID, HW_VERSION, FW_BOOT_VERSION and FW_APP_VERSION are not
+ * contiguous, so the four reads cannot be merged.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_info_reg(const char *reg, char *buf, int len) {
+    if (air_bus_read_reg(AIR_BUS_PRIO_CONFIG, reg, buf, len) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Device information registers in the order they are read. Their contents
+ * are read back to back into one raw buffer for air_store_info.
+ */
+const int AIR_INFO_REGS = 4;
+const char air_info_reg_addrs[AIR_INFO_REGS] = {
+    air_hw_id_reg_t::addr,
+    air_hw_version_reg_t::addr,
+    air_fw_boot_version_reg_t::addr,
+    air_fw_app_version_reg_t::addr,
+};
+const int air_info_reg_lens[AIR_INFO_REGS] = {
+    air_hw_id_reg_t::len,
+    air_hw_version_reg_t::len,
+    air_fw_boot_version_reg_t::len,
+    air_fw_app_version_reg_t::len,
+};
+const int AIR_INFO_RAW_LEN = 6;
+
+/**
+ * Decode the raw device information registers, read in air_info_reg_addrs
+ * order, into air_info_cache and mark it valid if the sensor is a CCS811.
+ * Returns: AIR_OK, AIR_ERR_SENSOR if the hardware ID is not a CCS811's
+ */
+int air_store_info(const char *raw) {
+    air_info_cache.hw_id = raw[0];
+    air_info_cache.hw_version = raw[1];
+    air_info_cache.fw_boot_version = ((unsigned char)raw[2] << 8) | (unsigned char)raw[3];
+    air_info_cache.fw_app_version = ((unsigned char)raw[4] << 8) | (unsigned char)raw[5];
+    
+    if (air_info_cache.hw_id != AIR_HW_ID_EXPECTED) {
+        return AIR_ERR_SENSOR;
+    }
+    
+    air_info_valid = 1;
+    
+    return AIR_OK;
+}
+
+/**
+ * Read the device information registers into air_info_cache.
+ * Works in both boot and application firmware modes.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed, AIR_ERR_SENSOR if the
+ *          hardware ID is not a CCS811's
+ */
+int air_try_read_info() {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_INFO);
+    
+    char raw[AIR_INFO_RAW_LEN];
+    int offset = 0;
+    
+    for (int i = 0; i < AIR_INFO_REGS; i++) {
+        if (air_try_read_info_reg(&air_info_reg_addrs[i], raw + offset, air_info_reg_lens[i]) != AIR_OK) {
+            return AIR_ERR_BUS;
+        }
+        offset += air_info_reg_lens[i];
+    }
+    
+    return air_store_info(raw);
+}
+
+/**
+ * Read the device information registers into air_info_cache.
+ */
+void air_read_info() {
+    int err = air_try_read_info();
+    if (err == AIR_ERR_SENSOR) {
+        die("air: read_info: unexpected hardware id %#x", air_info_cache.hw_id);
+    } else if (err != AIR_OK) {
+        die("air: read_info: failed to read info registers");
+    }
+}
+
+/**
+ * Air sensor device information. Never touches the bus.
+ * Returns: Information read by air_boot, NULL if the sensor has not been booted
+ */
+const air_info_t *air_info() {
+    if (!air_info_valid) {
+        return NULL;
+    }
+    
+    return &air_info_cache;
+}
+
+/**
+ * Look for a sensor at AIR_ADDR and AIR_ADDR_ALT, the current address first,
+ * by reading its hardware ID. Two transactions per address, cheap enough to
+ * run every few seconds.
+ * Returns: AIR_OK with air_addr set to the sensor's address, AIR_ERR_ABSENT
+ *          if nothing answered, AIR_ERR_BUS if the bus failed
+ */
+int air_probe() {
+    const int addrs[2] = {
+        air_addr,
+        air_addr == AIR_ADDR ? AIR_ADDR_ALT : AIR_ADDR,
+    };
+    
+    int err = AIR_ERR_ABSENT;
+    for (int i = 0; i < 2; i++) {
+        char hw_id;
+        int result = air_bus_transfer(AIR_BUS_PRIO_CONFIG, addrs[i], &air_hw_id_reg_t::addr, 1, &hw_id, 1);
+        
+        if (result == 0 && hw_id == AIR_HW_ID_EXPECTED) {
+            air_addr = addrs[i];
+            return AIR_OK;
+        } else if (result == AIR_I2C_TIMEOUT) {
+            // A hung bus says nothing about the sensor
+            err = AIR_ERR_BUS;
+        }
+    }
+    
+    return err;
+}
+
+/**
+ * Shadow copy of the measurement mode register. Kept in sync by air_boot,
+ * air_sw_reset and air_write_meas_mode so the register never has to be read
+ * back before it is changed.
+ */
+char air_meas_mode = AIR_MODE_RESET_VALUE;
+
+/**
+ * Read the measurement mode register into the air_meas_mode shadow.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_sync_meas_mode() {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_SYNC_MEAS_MODE);
+    
+    if (air_bus_read_reg(AIR_BUS_PRIO_CONFIG, &AIR_MODE_REG, &air_meas_mode, 1) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Read the measurement mode register into the air_meas_mode shadow.
+ */
+void air_sync_meas_mode() {
+    if (air_try_sync_meas_mode() != AIR_OK) {
+        die("air: sync_meas_mode: failed to read measurement mode register");
+    }
+}
+
+/**
+ * Boot air sensor without exiting on errors, see air_boot.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed, AIR_ERR_SENSOR if the
+ *          sensor is not a CCS811 or has no valid application to boot
+ */
+int air_try_boot() {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_BOOT);
+    
+    // Check if sensor is in a valid state to be booted
+    air_status_t air_status;
+    if (air_try_read_status(&air_status) != AIR_OK) {
+        return AIR_ERR_BUS;
+    }
+    
+    // Cache device information, it only changes with a firmware update
+    if (!air_info_valid) {
+        int err = air_try_read_info();
+        if (err != AIR_OK) {
+            return err;
+        }
+    }
+    
+    // Check if already booted
+    if(air_status.fw_mode == AIR_STATUS_FW_MODE_APP) {
+        // Already booted, measurement mode could be anything
+        return air_try_sync_meas_mode();
+    }
+    
+    // Check if a valid application is loaded to be booted
+    if (!air_status.app_valid) {
+        return AIR_ERR_SENSOR;
+    }
+    
+    // Send boot command
+    if (air_bus_write(AIR_BUS_PRIO_CONFIG, &AIR_BOOT_APP_START_REG, 1) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    // Application starts with the measurement mode register reset
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    
+    return AIR_OK;
+}
+
+/**
+ * Boot air sensor.
+ * If already booted exits silently.
+ */
+void air_boot() {
+    int err = air_try_boot();
+    if (err == AIR_ERR_SENSOR) {
+        if (air_info_valid) {
+            die("air: boot: cannot boot, invalid app on device");
+        }
+        
+        die("air: boot: unexpected hardware id %#x", air_info_cache.hw_id);
+    } else if (err != AIR_OK) {
+        die("air: boot: failed to boot");
+    }
+}
+
+/**
+ * Read measurement drive mode, from the air_meas_mode shadow.
+ * Returns: drive mode
+ */
+char air_read_mode() {
+    return air_mode_drive_mode_t::get(air_meas_mode);
+}
+
+/**
+ * Write the whole bitpacked measurement mode register in one transaction and
+ * update the air_meas_mode shadow.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_write_meas_mode(char meas_mode) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_WRITE_MEAS_MODE);
+    
+    char buf[2] = {
+        AIR_MODE_REG,
+        meas_mode,
+    };
+    
+    if (air_bus_write(AIR_BUS_PRIO_CONFIG, buf, 2) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    air_meas_mode = meas_mode;
+    
+    return AIR_OK;
+}
+
+/**
+ * Write the whole bitpacked measurement mode register, see
+ * air_try_write_meas_mode.
+ */
+void air_write_meas_mode(char meas_mode) {
+    if (air_try_write_meas_mode(meas_mode) != AIR_OK) {
+        die("air: write_meas_mode: failed to write measurement mode %#x", meas_mode);
+    }
+}
+
+/**
+ * Set measurement drive mode.
+ * The other measurement mode fields are taken from the air_meas_mode shadow.
+ */
+void air_write_mode(char drive_mode) {
+    air_write_meas_mode(air_mode_drive_mode_t::set(air_meas_mode, drive_mode));
+}
+
+/**
+ * Enable or disable the nINT pin.
+ * data_ready: Boolean, assert nINT when a new sample is ready
+ * thresh: Boolean, only assert nINT when eCO2 crosses the thresholds
+ */
+void air_write_interrupt(char data_ready, char thresh) {
+    char meas_mode = air_mode_int_datardy_t::set(air_meas_mode, data_ready != 0);
+    meas_mode = air_mode_int_thresh_t::set(meas_mode, thresh != 0);
+    
+    air_write_meas_mode(meas_mode);
+}
+
+/**
+ * Read the algorithm baseline into the baseline argument.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_baseline(uint16_t *baseline) {
+    char buf[air_baseline_reg_t::len];
+    if (air_bus_read_reg(AIR_BUS_PRIO_CONFIG, &AIR_BASELINE_REG, buf, sizeof(buf)) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    *baseline = ((unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+    
+    return AIR_OK;
+}
+
+/**
+ * Write a baseline read earlier back, so the algorithm does not have to learn
+ * it again after the sensor restarted.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_write_baseline(uint16_t baseline) {
+    char buf[1 + air_baseline_reg_t::len] = {
+        AIR_BASELINE_REG,
+        (char)(baseline >> 8),
+        (char)baseline,
+    };
+    
+    if (air_bus_write(AIR_BUS_PRIO_CONFIG, buf, sizeof(buf)) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Air sensor algorithm result data.
+ */
+typedef struct {
+    /**
+     * Equivalent calculated carbon-dioxide (eCO2) in ppm from 400 to 8192.
+     */
+    uint16_t eco2;
+    
+    /**
+     * Total volume of carbon (TVOC) in ppb from 0 1187.
+     */
+    uint16_t tvoc;
+} air_alg_result_t;
+
+void air_read_alg_result(air_alg_result_t *air_alg_result) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_ALG_RESULT);
+    
+    // Read register
+    char buf[4];
+    if (air_bus_read_reg(AIR_BUS_PRIO_SAMPLE, &AIR_ALG_RESULT_DATA_REG, buf, 4) != 0) {
+        die("air: read_alg_result: failed to read alg result data register");
+    }
+    
+    // Unpack into air_alg_result_data_t
+    air_alg_result->eco2 = ((unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+    air_alg_result->tvoc = ((unsigned char)buf[2] << 8) | (unsigned char)buf[3];
+}
+
+/**
+ * Read the algorithm result and the status register in one burst.
+ * STATUS follows the result in the ALG_RESULT_DATA mailbox, so polling this
+ * way costs the same as polling the status register alone and the result
+ * needs no further transactions once air_status->data_ready is set.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_alg_result_status(air_alg_result_t *air_alg_result, air_status_t *air_status) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_ALG_RESULT_STATUS);
+    
+    char buf[5];
+    if (air_bus_read_reg(AIR_BUS_PRIO_SAMPLE, &AIR_ALG_RESULT_DATA_REG, buf, 5) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    air_alg_result->eco2 = ((unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+    air_alg_result->tvoc = ((unsigned char)buf[2] << 8) | (unsigned char)buf[3];
+    air_decode_status(buf[4], air_status);
+    
+    return AIR_OK;
+}
+
+/**
+ * Read the algorithm result and the status register in one burst, see
+ * air_try_read_alg_result_status.
+ */
+void air_read_alg_result_status(air_alg_result_t *air_alg_result, air_status_t *air_status) {
+    if (air_try_read_alg_result_status(air_alg_result, air_status) != AIR_OK) {
+        die("air: read_alg_result_status: failed to read alg result data register");
+    }
+}
+
+/**
+ * ALG_RESULT_DATA bytes read by each poll: eCO2, TVOC and STATUS.
+ */
+const int AIR_RAW_SAMPLE_LEN = 5;
+
+/**
+ * Sample slot as read off the bus.
+ *
+ * Polls read ALG_RESULT_DATA straight into data and nothing is unpacked until
+ * asked for. Each accessor decodes only its own field, so a poll which finds
+ * no new sample only ever looks at the DATA_READY and ERROR bits. Slots are
+ * not copied, consumers share them by reference, see air_acq_pool.
+ */
+class air_raw_sample_t {
+public:
+    char data[AIR_RAW_SAMPLE_LEN];
+    
+    /**
+     * References held, 0 while the slot is free.
+     */
+    std::atomic<uint8_t> refs;
+    
+    /**
+     * air_now_us when the sample was read, and its sequence number.
+     */
+    uint64_t timestamp_us;
+    uint32_t seq;
+    
+    uint16_t eco2() const {
+        return ((unsigned char)data[0] << 8) | (unsigned char)data[1];
+    }
+    
+    uint16_t tvoc() const {
+        return ((unsigned char)data[2] << 8) | (unsigned char)data[3];
+    }
+    
+    /**
+     * Raw STATUS register.
+     */
+    char status() const {
+        return data[4];
+    }
+    
+    char data_ready() const {
+        return air_status_data_ready_t::get(data[4]);
+    }
+    
+    char error() const {
+        return air_status_error_t::get(data[4]);
+    }
+    
+    air_alg_result_t result() const {
+        air_alg_result_t air_alg_result = { eco2(), tvoc() };
+        return air_alg_result;
+    }
+};
+
+/**
+ * Read the algorithm result and the status register in one burst into
+ * sample's data, see air_try_read_alg_result_status.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_read_raw_sample(air_raw_sample_t *sample) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_READ_ALG_RESULT_STATUS);
+    
+    if (air_bus_read_reg(AIR_BUS_PRIO_SAMPLE, &AIR_ALG_RESULT_DATA_REG, sample->data, AIR_RAW_SAMPLE_LEN) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * How air_poll_sample retries failed bus transactions.
+ */
+typedef struct {
+    /**
+     * Retries after the first failed attempt before giving up.
+     */
+    int max_retries;
+    
+    /**
+     * Wait before the first retry, doubled for every further retry up to
+     * backoff_max_ms.
+     */
+    int backoff_ms;
+    int backoff_max_ms;
+} air_retry_policy_t;
+
+const air_retry_policy_t AIR_RETRY_DEFAULT = { 3, 5, 100 };
+
+/**
+ * Counters kept by air_poll_sample.
+ */
+typedef struct {
+    uint32_t attempts;
+    uint32_t retries;
+    uint32_t bus_errors;
+    uint32_t sensor_errors;
+    
+    /**
+     * Error ID read for the last sensor error.
+     */
+    char last_error_id;
+} air_retry_stats_t;
+
+/**
+ * Poll for a new sample into a raw sample slot without exiting on errors.
+ * Failed transactions are retried with exponential backoff. If the sensor
+ * reports an error its error ID is read, which clears it, and stored in
+ * stats->last_error_id.
+ * Returns: AIR_OK with a new sample in sample, AIR_ERR_NOT_READY if there is
+ *          no new sample yet, AIR_ERR_SENSOR on a sensor error, AIR_ERR_BUS
+ *          if the bus failed after all retries
+ */
+int air_poll_raw_sample(air_raw_sample_t *sample, const air_retry_policy_t *policy, air_retry_stats_t *stats) {
+    int backoff_ms = policy->backoff_ms;
+    
+    for (int attempt = 0; ; attempt++) {
+        stats->attempts++;
+        
+        if (air_try_read_raw_sample(sample) == AIR_OK) {
+            break;
+        }
+        
+        stats->bus_errors++;
+        if (attempt == policy->max_retries) {
+            return AIR_ERR_BUS;
+        }
+        
+        stats->retries++;
+        wait_ms(backoff_ms);
+        
+        backoff_ms *= 2;
+        if (backoff_ms > policy->backoff_max_ms) {
+            backoff_ms = policy->backoff_max_ms;
+        }
+    }
+    
+    if (sample->error()) {
+        stats->sensor_errors++;
+        if (air_try_read_error_id(&stats->last_error_id) != AIR_OK) {
+            stats->bus_errors++;
+        }
+        
+        return AIR_ERR_SENSOR;
+    }
+    
+    if (!sample->data_ready()) {
+        return AIR_ERR_NOT_READY;
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Poll for a new sample without exiting on errors, see air_poll_raw_sample.
+ * Returns: AIR_OK with a new sample in air_alg_result, AIR_ERR_NOT_READY if
+ *          there is no new sample yet, AIR_ERR_SENSOR on a sensor error,
+ *          AIR_ERR_BUS if the bus failed after all retries
+ */
+int air_poll_sample(air_alg_result_t *air_alg_result, const air_retry_policy_t *policy, air_retry_stats_t *stats) {
+    air_raw_sample_t sample;
+    
+    int err = air_poll_raw_sample(&sample, policy, stats);
+    if (err == AIR_OK) {
+        *air_alg_result = sample.result();
+    }
+    
+    return err;
+}
+
+/**
+ * Firmware image source used by air_fw_update.
+ * Fills buf with up to len bytes of the image.
+ * Returns: Number of bytes read, 0 at the end of the image, negative on error
+ */
+typedef int (*air_fw_read_t)(void *ctx, char *buf, int len);
+
+/**
+ * air_fw_read_t which reads from a FILE *, passed as ctx. Works for
+ * LocalFileSystem files and host streams alike.
+ */
+int air_fw_read_file(void *ctx, char *buf, int len) {
+    FILE *file = (FILE *)ctx;
+    
+    int n = fread(buf, 1, len, file);
+    if (n < len && ferror(file)) {
+        return -1;
+    }
+    
+    return n;
+}
+
+/**
+ * Firmware update timings, filled in by air_fw_update.
+ */
+typedef struct {
+    /**
+     * Number of image bytes written, including padding of the last chunk.
+     */
+    int bytes;
+    
+    /**
+     * Number of APP_DATA chunks written.
+     */
+    int chunks;
+    
+    /**
+     * Time spent in each phase of the update, in milliseconds.
+     */
+    int erase_ms;
+    int data_ms;
+    int verify_ms;
+    
+    /**
+     * Total update time, from reset into the bootloader to verified image, in
+     * milliseconds.
+     */
+    int total_ms;
+} air_fw_update_stats_t;
+
+/**
+ * Software reset the air sensor, which puts it back into boot mode.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_try_sw_reset() {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_SW_RESET);
+    
+    char buf[5] = {
+        AIR_SW_RESET_REG,
+        AIR_SW_RESET_KEY[0],
+        AIR_SW_RESET_KEY[1],
+        AIR_SW_RESET_KEY[2],
+        AIR_SW_RESET_KEY[3],
+    };
+    
+    if (air_bus_write(AIR_BUS_PRIO_CONFIG, buf, 5) != 0) {
+        return AIR_ERR_BUS;
+    }
+    
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    
+    wait_ms(AIR_SW_RESET_DELAY_MS);
+    
+    return AIR_OK;
+}
+
+/**
+ * Software reset the air sensor, see air_try_sw_reset.
+ */
+void air_sw_reset() {
+    if (air_try_sw_reset() != AIR_OK) {
+        die("air: sw_reset: failed to write reset sequence");
+    }
+}
+
+/**
+ * Fill the next APP_DATA chunk from the firmware image source.
+ * The last chunk is padded with 0xFF, the erased flash value.
+ * Returns: Number of image bytes in the chunk, 0 at the end of the image
+ */
+int air_fw_read_chunk(air_fw_read_t read, void *ctx, char *chunk) {
+    int n = 0;
+    
+    while (n < AIR_BOOT_APP_DATA_LEN) {
+        int r = read(ctx, chunk + n, AIR_BOOT_APP_DATA_LEN - n);
+        if (r < 0) {
+            die("air: fw_update: failed to read firmware image");
+        } else if (r == 0) {
+            break;
+        }
+        
+        n += r;
+    }
+    
+    if (n > 0) {
+        memset(chunk + n, 0xFF, AIR_BOOT_APP_DATA_LEN - n);
+    }
+    
+    return n;
+}
+
+/**
+ * Wait until at least delay_ms have passed on timer.
+ */
+void air_fw_wait_until(Timer *timer, int delay_ms) {
+    int elapsed_ms = timer->read_ms();
+    if (elapsed_ms < delay_ms) {
+        wait_ms(delay_ms - elapsed_ms);
+    }
+}
+
+/**
+ * Stream a new application firmware image onto the air sensor.
+ *
+ * The sensor is reset into its bootloader, the application flash is erased,
+ * the image is written in 8 byte APP_DATA chunks and then verified. Only one
+ * chunk of the image is held in memory at a time. The next chunk is read from
+ * the source while the bootloader is busy with the previous one, so a slow
+ * source only costs time when it is slower than the bootloader.
+ *
+ * The sensor is left in boot mode with the new application, call air_boot
+ * to start it.
+ */
+void air_fw_update(air_fw_read_t read, void *ctx, air_fw_update_stats_t *stats) {
+    AIR_PROFILE_SCOPE(AIR_PROFILE_FW_UPDATE);
+    
+    Timer total_timer;
+    Timer phase_timer;
+    Timer chunk_timer;
+    
+    total_timer.start();
+    phase_timer.start();
+    chunk_timer.start();
+    
+    memset(stats, 0, sizeof(air_fw_update_stats_t));
+    
+    // Enter bootloader
+    air_status_t air_status;
+    air_read_status(&air_status);
+    
+    if (air_status.fw_mode == AIR_STATUS_FW_MODE_APP) {
+        air_sw_reset();
+    }
+    
+    // Application version is about to change, re-read on next boot
+    air_info_valid = 0;
+    
+    // Erase application
+    char erase_buf[5] = {
+        AIR_BOOT_APP_ERASE_REG,
+        AIR_BOOT_APP_ERASE_KEY[0],
+        AIR_BOOT_APP_ERASE_KEY[1],
+        AIR_BOOT_APP_ERASE_KEY[2],
+        AIR_BOOT_APP_ERASE_KEY[3],
+    };
+    
+    phase_timer.reset();
+    
+    if (air_bus_write(AIR_BUS_PRIO_FIRMWARE, erase_buf, 5) != 0) {
+        die("air: fw_update: failed to erase application");
+    }
+    
+    // The bootloader is busy from the end of each command
+    chunk_timer.reset();
+    
+    // Write data chunks, with data_buf[0] holding the APP_DATA register so
+    // each chunk is sent in one transaction
+    char data_buf[1 + AIR_BOOT_APP_DATA_LEN];
+    data_buf[0] = AIR_BOOT_APP_DATA_REG;
+    
+    char *chunk = &data_buf[1];
+    int chunk_len = air_fw_read_chunk(read, ctx, chunk);
+    
+    air_fw_wait_until(&chunk_timer, AIR_BOOT_APP_ERASE_DELAY_MS);
+    
+    stats->erase_ms = phase_timer.read_ms();
+    phase_timer.reset();
+    
+    while (chunk_len > 0) {
+        if (air_bus_write(AIR_BUS_PRIO_FIRMWARE, data_buf, 1 + AIR_BOOT_APP_DATA_LEN) != 0) {
+            die("air: fw_update: failed to write chunk %d", stats->chunks);
+        }
+        
+        chunk_timer.reset();
+        stats->chunks++;
+        stats->bytes += AIR_BOOT_APP_DATA_LEN;
+        
+        // The write has completed, so the next chunk can be read from the
+        // image source while the bootloader programs this one
+        chunk_len = air_fw_read_chunk(read, ctx, chunk);
+        
+        air_fw_wait_until(&chunk_timer, AIR_BOOT_APP_DATA_DELAY_MS);
+    }
+    
+    stats->data_ms = phase_timer.read_ms();
+    phase_timer.reset();
+    
+    // Verify application
+    if (air_bus_write(AIR_BUS_PRIO_FIRMWARE, &AIR_BOOT_APP_VERIFY_REG, 1) != 0) {
+        die("air: fw_update: failed to start verify");
+    }
+    
+    wait_ms(AIR_BOOT_APP_VERIFY_DELAY_MS);
+    
+    air_read_status(&air_status);
+    if (air_status.error || !air_status.app_valid) {
+        die("air: fw_update: application failed to verify, status=%#x", air_status.raw);
+    }
+    
+    stats->verify_ms = phase_timer.read_ms();
+    stats->total_ms = total_timer.read_ms();
+}
+
+/**
+ * Air sensor sample as handed to consumers.
+ */
+typedef struct {
+    air_alg_result_t result;
+    
+    /**
+     * air_now_us when the sample was read.
+     */
+    uint64_t timestamp_us;
+    
+    /**
+     * Sample sequence number, gaps mean samples were missed.
+     */
+    uint32_t seq;
+} air_sample_t;
+
+/**
+ * Unpack a raw sample slot for consumers which keep samples.
+ */
+void air_raw_sample_decode(const air_raw_sample_t *raw, air_sample_t *sample) {
+    sample->result = raw->result();
+    sample->timestamp_us = raw->timestamp_us;
+    sample->seq = raw->seq;
+}
+
+/**
+ * Latest sample, published for any number of concurrent readers.
+ *
+ * Two copies are kept behind a sequence counter (a seqlock latch). The writer
+ * bumps the counter before updating each copy in turn, readers read the copy
+ * the writer is not touching and retry only if the counter moved meanwhile.
+ * Readers take no locks, never touch the bus and never wait for a preempted
+ * writer. There must be a single writer.
+ */
+const int AIR_LATEST_WORDS = (sizeof(air_sample_t) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+class air_latest_t {
+public:
+    air_latest_t() : seq(0), retries(0) {}
+    
+    /**
+     * Publish a new sample. Single writer only.
+     */
+    void publish(const air_sample_t *sample) {
+        uint32_t words[AIR_LATEST_WORDS];
+        memset(words, 0, sizeof(words));
+        memcpy(words, sample, sizeof(air_sample_t));
+        
+        for (int copy = 0; copy < 2; copy++) {
+            // Odd counter: readers use copy 1 while copy 0 is written, even:
+            // copy 0 while copy 1 is written
+            seq.fetch_add(1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_release);
+            
+            for (int i = 0; i < AIR_LATEST_WORDS; i++) {
+                copies[copy][i].store(words[i], std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    /**
+     * Read a consistent snapshot of the latest sample.
+     * Returns: false until the first publish has completed
+     */
+    bool read(air_sample_t *sample) {
+        uint32_t words[AIR_LATEST_WORDS];
+        
+        while (true) {
+            // Copy 1 is only written once the counter reaches 2, before that
+            // the first publish has not finished
+            uint32_t before = seq.load(std::memory_order_acquire);
+            if (before < 2) {
+                return false;
+            }
+            
+            int copy = before & 1;
+            for (int i = 0; i < AIR_LATEST_WORDS; i++) {
+                words[i] = copies[copy][i].load(std::memory_order_relaxed);
+            }
+            
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+            
+            retries.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        memcpy(sample, words, sizeof(air_sample_t));
+        
+        return true;
+    }
+    
+    /**
+     * Number of reads which had to retry because a publish overlapped.
+     */
+    uint32_t read_retries() {
+        return retries.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> copies[2][AIR_LATEST_WORDS];
+    std::atomic<uint32_t> retries;
+};
+
+air_latest_t air_latest;
+
+/**
+ * Sample cache for on demand reads.
+ *
+ * air_cache_read answers from the newest sample while it is younger than
+ * max_age_ms. Otherwise it gets a new one. With acquisition running every
+ * sample is read by the acquisition thread and published here, so requests
+ * wait for its next publish: reading the bus would clear DATA_READY and take
+ * the sample from acquisition and its subscribers. Without acquisition a
+ * request reads ALG_RESULT_DATA itself, if STATUS says a sample is ready, and
+ * publishes it as air_latest. Requests arriving while that read is in flight
+ * wait for it and share its result instead of making their own.
+ */
+typedef struct {
+    uint32_t hits;
+    
+    /**
+     * Requests which read the bus.
+     */
+    uint32_t misses;
+    
+    /**
+     * Requests answered by the next sample from acquisition or another
+     * request's bus read.
+     */
+    uint32_t shared;
+    
+    uint32_t errors;
+} air_cache_stats_t;
+
+/**
+ * How long a request waits for the next sample, longer than the slowest drive
+ * mode's 60 s period.
+ */
+const uint32_t AIR_CACHE_WAIT_MS = 61000;
+
+air_cache_stats_t air_cache_stats;
+
+air_sample_t air_cache_sample;
+bool air_cache_valid = false;
+
+/**
+ * Set by air_acq_start, samples then only come from acquisition.
+ */
+bool air_cache_acq = false;
+
+/**
+ * Sequence numbers of samples read by requests, only without acquisition.
+ */
+uint32_t air_cache_seq = 0;
+
+/**
+ * If a request is reading the bus, how many samples or errors were published
+ * and the last result.
+ */
+bool air_cache_reading = false;
+uint32_t air_cache_generation = 0;
+int air_cache_result = AIR_OK;
+
+#if defined(AIR_RTOS) && !defined(AIR_SIM)
+Mutex air_cache_mutex;
+ConditionVariable air_cache_cond(air_cache_mutex);
+
+void air_cache_lock() {
+    air_cache_mutex.lock();
+}
+
+void air_cache_unlock() {
+    air_cache_mutex.unlock();
+}
+
+/**
+ * Wait, holding the cache lock, for a publish after generation.
+ * Returns: false if none came within timeout_ms
+ */
+bool air_cache_wait(uint32_t generation, uint32_t timeout_ms) {
+    uint64_t due_us = air_now_us() + timeout_ms * 1000ULL;
+    
+    while (air_cache_generation == generation) {
+        uint64_t now_us = air_now_us();
+        if (now_us >= due_us) {
+            return false;
+        }
+        
+        air_cache_cond.wait_for((due_us - now_us + 999) / 1000);
+    }
+    
+    return true;
+}
+
+void air_cache_notify() {
+    air_cache_cond.notify_all();
+}
+#elif defined(AIR_RTOS)
+// Threads take turns on the simulated CPU, see air_mail_t
+void air_cache_lock() {}
+void air_cache_unlock() {}
+
+bool air_cache_wait(uint32_t generation, uint32_t timeout_ms) {
+    return air_sim_block([generation] { return air_cache_generation != generation; },
+                         air_sim.now_us + timeout_ms * 1000ULL);
+}
+
+void air_cache_notify() {}
+#else
+void air_cache_lock() {}
+void air_cache_unlock() {}
+
+bool air_cache_wait(uint32_t, uint32_t) {
+    die("air: cache: wait without threads, read started from a callback?");
+    return false;
+}
+
+void air_cache_notify() {}
+#endif
+
+/**
+ * Make a sample, or the error from trying to read one, the newest and wake
+ * the requests waiting for it. Called by acquisition for every sample, and
+ * ends a request's bus read.
+ */
+void air_cache_publish(const air_sample_t *sample, int result) {
+    air_cache_lock();
+    
+    air_cache_reading = false;
+    if (result == AIR_OK) {
+        air_cache_sample = *sample;
+        air_cache_valid = true;
+    }
+    
+    air_cache_result = result;
+    air_cache_generation++;
+    air_cache_notify();
+    
+    air_cache_unlock();
+}
+
+/**
+ * Get a sample no older than max_age_ms.
+ * Returns: AIR_OK, AIR_ERR_NOT_READY if no sample came within
+ *          AIR_CACHE_WAIT_MS or none was ready, AIR_ERR_BUS or AIR_ERR_SENSOR
+ *          if the bus read failed
+ */
+int air_cache_read(air_sample_t *sample, uint32_t max_age_ms) {
+    air_cache_lock();
+    
+    if (air_cache_valid && air_now_us() - air_cache_sample.timestamp_us <= (uint64_t)max_age_ms * 1000) {
+        air_cache_stats.hits++;
+        *sample = air_cache_sample;
+        air_cache_unlock();
+        
+        return AIR_OK;
+    }
+    
+    // Wait for acquisition's next sample, or share a bus read in flight
+    if (air_cache_acq || air_cache_reading) {
+        int result = AIR_ERR_NOT_READY;
+        if (air_cache_wait(air_cache_generation, AIR_CACHE_WAIT_MS)) {
+            result = air_cache_result;
+        }
+        
+        air_cache_stats.shared++;
+        if (result == AIR_OK) {
+            *sample = air_cache_sample;
+        } else {
+            air_cache_stats.errors++;
+        }
+        air_cache_unlock();
+        
+        return result;
+    }
+    
+    air_cache_reading = true;
+    air_cache_stats.misses++;
+    air_cache_unlock();
+    
+    air_sample_t fresh;
+    air_status_t air_status;
+    int result = air_try_read_alg_result_status(&fresh.result, &air_status);
+    if (result == AIR_OK && air_status.error) {
+        result = AIR_ERR_SENSOR;
+    } else if (result == AIR_OK && !air_status.data_ready) {
+        result = AIR_ERR_NOT_READY;
+    }
+    
+    if (result == AIR_OK) {
+        fresh.timestamp_us = air_now_us();
+        fresh.seq = air_cache_seq++;
+        air_latest.publish(&fresh);
+        *sample = fresh;
+    }
+    
+    air_cache_lock();
+    if (result != AIR_OK) {
+        air_cache_stats.errors++;
+    }
+    air_cache_unlock();
+    
+    air_cache_publish(&fresh, result);
+    
+    return result;
+}
+
+void air_cache_dump() {
+    air_cache_lock();
+    air_cache_stats_t stats = air_cache_stats;
+    air_cache_unlock();
+    
+    uint32_t requests = stats.hits + stats.misses + stats.shared;
+    
+    printf("air: cache: requests=%lu hits=%lu misses=%lu shared=%lu errors=%lu hit_rate=%.1f%%\r\n",
+           (unsigned long)requests, (unsigned long)stats.hits, (unsigned long)stats.misses,
+           (unsigned long)stats.shared, (unsigned long)stats.errors,
+           requests > 0 ? 100.0 * stats.hits / requests : 0.0);
+}
+
+/**
+ * Sample history.
+ *
+ * Keeps as many of the most recent samples as fit in AIR_HISTORY_BLOCKS fixed
+ * size blocks, 32 KB, evicting the oldest block when full. The first sample of
+ * a block is stored as is in its header, the rest are bit packed:
+ *
+ *     0                                   same spacing and values as before
+ *     1 <timestamp> <eco2> <tvoc>
+ *
+ *     timestamp, delta of delta of the ms since the block's first sample:
+ *         0                           0
+ *         10  <7 bits zigzag>         -64 to 63
+ *         110 <12 bits zigzag>        -2048 to 2047
+ *         111 <32 bits>               the delta itself
+ *
+ *     eco2 and tvoc, delta from the previous value:
+ *         0                           0
+ *         10   <2 bits zigzag - 1>    -2 to 2
+ *         110  <4 bits zigzag - 5>    -10 to 10
+ *         1110 <7 bits zigzag>        -64 to 63
+ *         1111 <16 bits>              the value itself
+ *
+ * At 1 Hz from nINT the spacing barely changes and values drift slowly, so
+ * most samples take a bit or a few. Timestamps are kept to the ms. Not thread
+ * safe, append and iterate from the same thread.
+ */
+const int AIR_HISTORY_BLOCK_BYTES = 512;
+const int AIR_HISTORY_BLOCKS = 64;
+const int AIR_HISTORY_HEADER_BYTES = 20;
+const int AIR_HISTORY_BLOCK_BITS = (AIR_HISTORY_BLOCK_BYTES - AIR_HISTORY_HEADER_BYTES) * 8;
+
+typedef struct {
+    uint64_t first_us;
+    
+    /**
+     * History position of the first sample, counting every sample appended.
+     */
+    uint32_t first_seq;
+    
+    uint16_t count;
+    uint16_t bits;
+    uint16_t first_eco2;
+    uint16_t first_tvoc;
+    uint8_t data[AIR_HISTORY_BLOCK_BYTES - AIR_HISTORY_HEADER_BYTES];
+} air_history_block_t;
+
+static_assert(sizeof(air_history_block_t) == AIR_HISTORY_BLOCK_BYTES, "history block size");
+
+/**
+ * Decoder state, the previous sample of a block.
+ */
+typedef struct {
+    uint32_t ms;
+    int32_t delta_ms;
+    uint16_t eco2;
+    uint16_t tvoc;
+} air_history_state_t;
+
+/**
+ * The LPC1768 has 32 KB of main SRAM, blocks go into the two 16 KB AHB SRAM
+ * banks, unused without Ethernet and USB.
+ */
+#if defined(TARGET_LPC1768) && !defined(AIR_SIM)
+#define AIR_HISTORY_BANK0 __attribute__((section("AHBSRAM0")))
+#define AIR_HISTORY_BANK1 __attribute__((section("AHBSRAM1")))
+#else
+#define AIR_HISTORY_BANK0
+#define AIR_HISTORY_BANK1
+#endif
+
+air_history_block_t air_history_bank0[AIR_HISTORY_BLOCKS / 2] AIR_HISTORY_BANK0;
+air_history_block_t air_history_bank1[AIR_HISTORY_BLOCKS / 2] AIR_HISTORY_BANK1;
+
+/**
+ * Ring of blocks, oldest first.
+ */
+int air_history_oldest = 0;
+int air_history_used = 0;
+
+/**
+ * Encoder state of the newest block.
+ */
+air_history_state_t air_history_state;
+
+uint32_t air_history_appended = 0;
+uint32_t air_history_evicted = 0;
+
+/**
+ * Returns: Block n of the ring, 0 being the oldest
+ */
+air_history_block_t *air_history_block(int n) {
+    int i = (air_history_oldest + n) % AIR_HISTORY_BLOCKS;
+    
+    return i < AIR_HISTORY_BLOCKS / 2 ? &air_history_bank0[i] : &air_history_bank1[i - AIR_HISTORY_BLOCKS / 2];
+}
+
+uint32_t air_history_zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+int32_t air_history_unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/**
+ * Append the low n bits of value, most significant first.
+ * Returns: false if the block is full
+ */
+bool air_history_put_bits(air_history_block_t *block, uint32_t value, int n) {
+    if (block->bits + n > AIR_HISTORY_BLOCK_BITS) {
+        return false;
+    }
+    
+    for (int i = n - 1; i >= 0; i--) {
+        int bit = block->bits++;
+        uint8_t mask = 0x80 >> (bit & 7);
+        
+        if ((value >> i) & 1) {
+            block->data[bit >> 3] |= mask;
+        } else {
+            block->data[bit >> 3] &= ~mask;
+        }
+    }
+    
+    return true;
+}
+
+uint32_t air_history_get_bits(const air_history_block_t *block, int *pos, int n) {
+    uint32_t value = 0;
+    
+    for (int i = 0; i < n; i++) {
+        int bit = (*pos)++;
+        value = (value << 1) | ((block->data[bit >> 3] >> (7 - (bit & 7))) & 1);
+    }
+    
+    return value;
+}
+
+bool air_history_put_value(air_history_block_t *block, uint16_t value, uint16_t prev) {
+    uint32_t z = air_history_zigzag((int32_t)value - prev);
+    
+    if (z == 0) {
+        return air_history_put_bits(block, 0, 1);
+    } else if (z <= 4) {
+        return air_history_put_bits(block, 0x2, 2) && air_history_put_bits(block, z - 1, 2);
+    } else if (z <= 20) {
+        return air_history_put_bits(block, 0x6, 3) && air_history_put_bits(block, z - 5, 4);
+    } else if (z < 128) {
+        return air_history_put_bits(block, 0xE, 4) && air_history_put_bits(block, z, 7);
+    }
+    
+    return air_history_put_bits(block, 0xF, 4) && air_history_put_bits(block, value, 16);
+}
+
+uint16_t air_history_get_value(const air_history_block_t *block, int *pos, uint16_t prev) {
+    if (air_history_get_bits(block, pos, 1) == 0) {
+        return prev;
+    } else if (air_history_get_bits(block, pos, 1) == 0) {
+        return prev + air_history_unzigzag(air_history_get_bits(block, pos, 2) + 1);
+    } else if (air_history_get_bits(block, pos, 1) == 0) {
+        return prev + air_history_unzigzag(air_history_get_bits(block, pos, 4) + 5);
+    } else if (air_history_get_bits(block, pos, 1) == 0) {
+        return prev + air_history_unzigzag(air_history_get_bits(block, pos, 7));
+    }
+    
+    return air_history_get_bits(block, pos, 16);
+}
+
+/**
+ * Encode a sample after the previous one in state.
+ * Returns: false, leaving the block as it was, if the sample does not fit
+ */
+bool air_history_encode(air_history_block_t *block, air_history_state_t *state, const air_sample_t *sample) {
+    uint32_t ms = (sample->timestamp_us - block->first_us) / 1000;
+    int32_t delta_ms = ms - state->ms;
+    int32_t dod = delta_ms - state->delta_ms;
+    
+    int bits = block->bits;
+    bool fits;
+    
+    if (dod == 0 && sample->result.eco2 == state->eco2 && sample->result.tvoc == state->tvoc) {
+        fits = air_history_put_bits(block, 0, 1);
+    } else {
+        uint32_t z = air_history_zigzag(dod);
+        
+        fits = air_history_put_bits(block, 1, 1);
+        if (z == 0) {
+            fits = fits && air_history_put_bits(block, 0, 1);
+        } else if (z < 128) {
+            fits = fits && air_history_put_bits(block, 0x2, 2) && air_history_put_bits(block, z, 7);
+        } else if (z < 4096) {
+            fits = fits && air_history_put_bits(block, 0x6, 3) && air_history_put_bits(block, z, 12);
+        } else {
+            fits = fits && air_history_put_bits(block, 0x7, 3) && air_history_put_bits(block, delta_ms, 32);
+        }
+        
+        fits = fits && air_history_put_value(block, sample->result.eco2, state->eco2) &&
+               air_history_put_value(block, sample->result.tvoc, state->tvoc);
+    }
+    
+    if (!fits) {
+        block->bits = bits;
+        return false;
+    }
+    
+    state->ms = ms;
+    state->delta_ms = delta_ms;
+    state->eco2 = sample->result.eco2;
+    state->tvoc = sample->result.tvoc;
+    
+    return true;
+}
+
+/**
+ * Decode the sample after the previous one in state.
+ */
+void air_history_decode(const air_history_block_t *block, int *pos, air_history_state_t *state) {
+    if (air_history_get_bits(block, pos, 1) == 0) {
+        state->ms += state->delta_ms;
+        return;
+    }
+    
+    if (air_history_get_bits(block, pos, 1) == 0) {
+        // Same spacing
+    } else if (air_history_get_bits(block, pos, 1) == 0) {
+        state->delta_ms += air_history_unzigzag(air_history_get_bits(block, pos, 7));
+    } else if (air_history_get_bits(block, pos, 1) == 0) {
+        state->delta_ms += air_history_unzigzag(air_history_get_bits(block, pos, 12));
+    } else {
+        state->delta_ms = air_history_get_bits(block, pos, 32);
+    }
+    
+    state->ms += state->delta_ms;
+    state->eco2 = air_history_get_value(block, pos, state->eco2);
+    state->tvoc = air_history_get_value(block, pos, state->tvoc);
+}
+
+/**
+ * Drop all samples.
+ */
+void air_history_clear() {
+    air_history_oldest = 0;
+    air_history_used = 0;
+    air_history_appended = 0;
+    air_history_evicted = 0;
+}
+
+/**
+ * Append a sample, timestamps should not go backwards.
+ */
+void air_history_append(const air_sample_t *sample) {
+    if (air_history_used > 0) {
+        air_history_block_t *block = air_history_block(air_history_used - 1);
+        
+        if (block->count < 0xFFFF && air_history_encode(block, &air_history_state, sample)) {
+            block->count++;
+            air_history_appended++;
+            return;
+        }
+    }
+    
+    // Start a new block, evicting the oldest if the ring is full
+    if (air_history_used == AIR_HISTORY_BLOCKS) {
+        air_history_evicted += air_history_block(0)->count;
+        air_history_oldest = (air_history_oldest + 1) % AIR_HISTORY_BLOCKS;
+        air_history_used--;
+    }
+    
+    air_history_block_t *block = air_history_block(air_history_used++);
+    block->first_us = sample->timestamp_us;
+    block->first_seq = air_history_appended++;
+    block->count = 1;
+    block->bits = 0;
+    block->first_eco2 = sample->result.eco2;
+    block->first_tvoc = sample->result.tvoc;
+    
+    air_history_state.ms = 0;
+    air_history_state.delta_ms = 0;
+    air_history_state.eco2 = sample->result.eco2;
+    air_history_state.tvoc = sample->result.tvoc;
+}
+
+/**
+ * Iterator over the samples in [from_us, to_us].
+ */
+typedef struct {
+    uint64_t from_us;
+    uint64_t to_us;
+    
+    /**
+     * Block from the oldest, sample in the block and bit position of the next
+     * sample.
+     */
+    int block;
+    int index;
+    int pos;
+    
+    air_history_state_t state;
+} air_history_iter_t;
+
+void air_history_begin(air_history_iter_t *iter, uint64_t from_us, uint64_t to_us) {
+    iter->from_us = from_us;
+    iter->to_us = to_us;
+    iter->block = 0;
+    iter->index = 0;
+    iter->pos = 0;
+    
+    // Skip blocks which end before the range, without decoding them
+    while (iter->block + 1 < air_history_used && air_history_block(iter->block + 1)->first_us <= from_us) {
+        iter->block++;
+    }
+}
+
+/**
+ * Returns: false once there are no more samples in the range
+ */
+bool air_history_next(air_history_iter_t *iter, air_sample_t *sample) {
+    while (iter->block < air_history_used) {
+        const air_history_block_t *block = air_history_block(iter->block);
+        
+        if (iter->index == block->count) {
+            iter->block++;
+            iter->index = 0;
+            iter->pos = 0;
+            continue;
+        }
+        
+        if (iter->index == 0) {
+            iter->state.ms = 0;
+            iter->state.delta_ms = 0;
+            iter->state.eco2 = block->first_eco2;
+            iter->state.tvoc = block->first_tvoc;
+        } else {
+            air_history_decode(block, &iter->pos, &iter->state);
+        }
+        
+        sample->result.eco2 = iter->state.eco2;
+        sample->result.tvoc = iter->state.tvoc;
+        sample->timestamp_us = block->first_us + iter->state.ms * 1000ULL;
+        sample->seq = block->first_seq + iter->index;
+        iter->index++;
+        
+        if (sample->timestamp_us > iter->to_us) {
+            iter->block = air_history_used;
+            return false;
+        }
+        
+        if (sample->timestamp_us >= iter->from_us) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+typedef struct {
+    uint32_t samples;
+    uint32_t evicted;
+    
+    /**
+     * Headers and packed bits of the blocks in use.
+     */
+    uint32_t bytes;
+    
+    uint64_t first_us;
+    uint64_t last_us;
+} air_history_stats_t;
+
+void air_history_stats(air_history_stats_t *stats) {
+    memset(stats, 0, sizeof(air_history_stats_t));
+    stats->evicted = air_history_evicted;
+    
+    for (int i = 0; i < air_history_used; i++) {
+        const air_history_block_t *block = air_history_block(i);
+        stats->samples += block->count;
+        stats->bytes += AIR_HISTORY_HEADER_BYTES + (block->bits + 7) / 8;
+    }
+    
+    if (air_history_used > 0) {
+        const air_history_block_t *newest = air_history_block(air_history_used - 1);
+        stats->first_us = air_history_block(0)->first_us;
+        stats->last_us = newest->first_us + air_history_state.ms * 1000ULL;
+    }
+}
+
+void air_history_dump() {
+    air_history_stats_t stats;
+    air_history_stats(&stats);
+    
+    printf("air: history: samples=%lu evicted=%lu span_s=%lu blocks=%d/%d bytes=%lu bytes_per_sample=%.3f\r\n",
+           (unsigned long)stats.samples, (unsigned long)stats.evicted,
+           (unsigned long)((stats.last_us - stats.first_us) / 1000000), air_history_used, AIR_HISTORY_BLOCKS,
+           (unsigned long)stats.bytes, stats.samples > 0 ? (double)stats.bytes / stats.samples : 0.0);
+}
+
+/**
+ * CRC-32, IEEE polynomial, bitwise to keep flash use down. Checks flash log
+ * records and retained RAM.
+ */
+uint32_t air_crc32(const void *data, int len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    
+    for (int i = 0; i < len; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    
+    return ~crc;
+}
+
+#if defined(DEVICE_FLASH) || defined(AIR_SIM)
+#define AIR_LOG
+#endif
+
+#ifdef AIR_LOG
+/**
+ * Power loss safe sample log in on-chip flash.
+ *
+ * The log takes the last AIR_LOG_SECTORS flash sectors, used in turn so they
+ * wear evenly. The image must end below them. Each sector starts with a header
+ * page holding a sequence number, which orders the sectors, and an erase count.
+ * Records follow, AIR_LOG_RECORD_BYTES each with their own CRC. Appends are
+ * buffered in RAM and programmed a page at a time. air_log_sync programs a
+ * partial page, the rest of that page is then left unused. When the newest
+ * sector is full the next one is erased, dropping its records, and becomes
+ * the newest.
+ *
+ * A power cut loses at most the records not yet programmed. air_log_mount
+ * rebuilds the log from flash. A torn page write leaves records which fail
+ * their CRC, those are skipped and appends continue on the next page. A torn
+ * erase or header write leaves a sector without a valid header, which is
+ * ignored until it is next erased. Not thread safe.
+ */
+#ifndef AIR_LOG_SECTORS
+#define AIR_LOG_SECTORS 4
+#endif
+
+const uint32_t AIR_LOG_MAGIC = 0x4C524941;
+const int AIR_LOG_RECORD_BYTES = 16;
+const int AIR_LOG_PAGE_MAX = 512;
+
+typedef struct {
+    uint32_t magic;
+    
+    /**
+     * Order the sector was last started in, 0 if its header is not valid.
+     */
+    uint32_t seq;
+    
+    uint32_t erase_count;
+    uint32_t crc;
+} air_log_header_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t timestamp_ms;
+    uint16_t eco2;
+    uint16_t tvoc;
+    uint32_t crc;
+} air_log_record_t;
+
+static_assert(sizeof(air_log_record_t) == AIR_LOG_RECORD_BYTES, "log record size");
+static_assert(sizeof(air_log_header_t) <= AIR_LOG_RECORD_BYTES * 2, "log header size");
+
+typedef struct {
+    uint32_t appended;
+    
+    /**
+     * Records before this sequence number are in flash.
+     */
+    uint32_t durable_seq;
+    
+    uint32_t pages;
+    uint32_t programmed_bytes;
+    uint32_t erases;
+    
+    /**
+     * Records found at mount which failed their CRC.
+     */
+    uint32_t torn;
+    
+    uint32_t errors;
+} air_log_stats_t;
+
+air_log_stats_t air_log_stats;
+
+FlashIAP air_log_flash;
+uint32_t air_log_page_size;
+uint32_t air_log_sector_addr[AIR_LOG_SECTORS];
+uint32_t air_log_sector_size[AIR_LOG_SECTORS];
+air_log_header_t air_log_headers[AIR_LOG_SECTORS];
+
+/**
+ * Newest sector and its next free page.
+ */
+int air_log_active;
+uint32_t air_log_write_addr;
+
+/**
+ * Records waiting for the next page.
+ */
+uint8_t air_log_page[AIR_LOG_PAGE_MAX];
+int air_log_buffered;
+
+uint32_t air_log_next_seq;
+
+bool air_log_erased(const void *data, int len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    
+    for (int i = 0; i < len; i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool air_log_record_valid(const air_log_record_t *record) {
+    return record->crc == air_crc32(record, offsetof(air_log_record_t, crc));
+}
+
+void air_log_read_header(int sector) {
+    air_log_header_t *header = &air_log_headers[sector];
+    
+    if (air_log_flash.read(header, air_log_sector_addr[sector], sizeof(air_log_header_t)) != 0 ||
+        header->magic != AIR_LOG_MAGIC || header->crc != air_crc32(header, offsetof(air_log_header_t, crc))) {
+        memset(header, 0, sizeof(air_log_header_t));
+    }
+}
+
+/**
+ * Erase a sector and make it the newest.
+ * Returns: AIR_OK or AIR_ERR_FLASH
+ */
+int air_log_start_sector(int sector) {
+    air_log_header_t *active = &air_log_headers[air_log_active];
+    air_log_header_t *header = &air_log_headers[sector];
+    
+    // Keep counting erases across a lost header from the sector's neighbour
+    uint32_t erase_count = (header->seq != 0 ? header->erase_count : active->erase_count) + 1;
+    uint32_t seq = active->seq + 1;
+    
+    memset(header, 0, sizeof(air_log_header_t));
+    
+    air_log_stats.erases++;
+    if (air_log_flash.erase(air_log_sector_addr[sector], air_log_sector_size[sector]) != 0) {
+        return AIR_ERR_FLASH;
+    }
+    
+    uint8_t page[AIR_LOG_PAGE_MAX];
+    memset(page, 0xFF, air_log_page_size);
+    
+    air_log_header_t *new_header = (air_log_header_t *)page;
+    new_header->magic = AIR_LOG_MAGIC;
+    new_header->seq = seq;
+    new_header->erase_count = erase_count;
+    new_header->crc = air_crc32(new_header, offsetof(air_log_header_t, crc));
+    
+    air_log_stats.pages++;
+    air_log_stats.programmed_bytes += air_log_page_size;
+    if (air_log_flash.program(page, air_log_sector_addr[sector], air_log_page_size) != 0) {
+        return AIR_ERR_FLASH;
+    }
+    
+    *header = *new_header;
+    air_log_active = sector;
+    air_log_write_addr = air_log_sector_addr[sector] + air_log_page_size;
+    
+    return AIR_OK;
+}
+
+/**
+ * Program the buffered records as the next page, padded with erased records.
+ * Returns: AIR_OK or AIR_ERR_FLASH
+ */
+int air_log_program_page() {
+    uint32_t sector_end = air_log_sector_addr[air_log_active] + air_log_sector_size[air_log_active];
+    
+    if (air_log_write_addr >= sector_end) {
+        int err = air_log_start_sector((air_log_active + 1) % AIR_LOG_SECTORS);
+        if (err != AIR_OK) {
+            air_log_stats.errors++;
+            return err;
+        }
+    }
+    
+    memset(&air_log_page[air_log_buffered * AIR_LOG_RECORD_BYTES], 0xFF,
+           air_log_page_size - air_log_buffered * AIR_LOG_RECORD_BYTES);
+    
+    uint32_t addr = air_log_write_addr;
+    air_log_write_addr += air_log_page_size;
+    air_log_buffered = 0;
+    
+    air_log_stats.pages++;
+    air_log_stats.programmed_bytes += air_log_page_size;
+    if (air_log_flash.program(air_log_page, addr, air_log_page_size) != 0) {
+        air_log_stats.errors++;
+        return AIR_ERR_FLASH;
+    }
+    
+    air_log_stats.durable_seq = air_log_next_seq;
+    
+    return AIR_OK;
+}
+
+/**
+ * Find the log in flash, starting an empty one if there is none, and carry
+ * on after its newest record.
+ * Returns: AIR_OK or AIR_ERR_FLASH
+ */
+int air_log_mount() {
+    memset(&air_log_stats, 0, sizeof(air_log_stats_t));
+    air_log_buffered = 0;
+    
+    if (air_log_flash.init() != 0) {
+        return AIR_ERR_FLASH;
+    }
+    
+    air_log_page_size = air_log_flash.get_page_size();
+    if (air_log_page_size > (uint32_t)AIR_LOG_PAGE_MAX || air_log_page_size % AIR_LOG_RECORD_BYTES != 0) {
+        die("air: log: unsupported flash page size %lu", (unsigned long)air_log_page_size);
+    }
+    
+    // Last sectors of flash
+    uint32_t addr = air_log_flash.get_flash_start() + air_log_flash.get_flash_size();
+    for (int i = AIR_LOG_SECTORS - 1; i >= 0; i--) {
+        air_log_sector_size[i] = air_log_flash.get_sector_size(addr - 1);
+        addr -= air_log_sector_size[i];
+        air_log_sector_addr[i] = addr;
+    }
+    
+#ifdef FLASHIAP_APP_ROM_END_ADDR
+    if (air_log_sector_addr[0] < FLASHIAP_APP_ROM_END_ADDR) {
+        die("air: log: image overlaps the log sectors");
+    }
+#endif
+    
+    air_log_active = 0;
+    for (int i = 0; i < AIR_LOG_SECTORS; i++) {
+        air_log_read_header(i);
+        if (air_log_headers[i].seq > air_log_headers[air_log_active].seq) {
+            air_log_active = i;
+        }
+    }
+    
+    air_log_next_seq = 0;
+    
+    if (air_log_headers[air_log_active].seq == 0) {
+        int err = air_log_start_sector(0);
+        air_log_stats.durable_seq = air_log_next_seq;
+        
+        return err;
+    }
+    
+    // Newest record and torn records of every sector, free pages of the newest
+    for (int i = 0; i < AIR_LOG_SECTORS; i++) {
+        if (air_log_headers[i].seq == 0) {
+            continue;
+        }
+        
+        uint32_t end = air_log_sector_addr[i] + air_log_sector_size[i];
+        uint32_t last_used = air_log_sector_addr[i];
+        
+        for (uint32_t page = air_log_sector_addr[i] + air_log_page_size; page < end; page += air_log_page_size) {
+            for (uint32_t offset = 0; offset < air_log_page_size; offset += AIR_LOG_RECORD_BYTES) {
+                air_log_record_t record;
+                if (air_log_flash.read(&record, page + offset, sizeof(air_log_record_t)) != 0) {
+                    return AIR_ERR_FLASH;
+                }
+                
+                if (air_log_erased(&record, sizeof(air_log_record_t))) {
+                    continue;
+                }
+                
+                last_used = page;
+                
+                if (!air_log_record_valid(&record)) {
+                    air_log_stats.torn++;
+                } else if (record.seq >= air_log_next_seq) {
+                    air_log_next_seq = record.seq + 1;
+                }
+            }
+        }
+        
+        if (i == air_log_active) {
+            air_log_write_addr = last_used + air_log_page_size;
+        }
+    }
+    
+    air_log_stats.durable_seq = air_log_next_seq;
+    
+    return AIR_OK;
+}
+
+/**
+ * Add a sample to the log, programming a page once one is full.
+ * Returns: AIR_OK or AIR_ERR_FLASH
+ */
+int air_log_append(const air_sample_t *sample) {
+    air_log_record_t *record = (air_log_record_t *)&air_log_page[air_log_buffered * AIR_LOG_RECORD_BYTES];
+    record->seq = air_log_next_seq++;
+    record->timestamp_ms = sample->timestamp_us / 1000;
+    record->eco2 = sample->result.eco2;
+    record->tvoc = sample->result.tvoc;
+    record->crc = air_crc32(record, offsetof(air_log_record_t, crc));
+    
+    air_log_buffered++;
+    air_log_stats.appended++;
+    
+    if ((uint32_t)(air_log_buffered * AIR_LOG_RECORD_BYTES) == air_log_page_size) {
+        return air_log_program_page();
+    }
+    
+    return AIR_OK;
+}
+
+/**
+ * Program any buffered records now.
+ * Returns: AIR_OK or AIR_ERR_FLASH
+ */
+int air_log_sync() {
+    if (air_log_buffered == 0) {
+        return AIR_OK;
+    }
+    
+    return air_log_program_page();
+}
+
+/**
+ * Iterator over the log from a sequence number, oldest first. Samples carry
+ * the record's sequence number. Timestamps are kept to the ms and count from
+ * the start up the record was appended in.
+ */
+typedef struct {
+    uint32_t from_seq;
+    
+    /**
+     * Sectors visited, starting after the newest so the oldest comes first,
+     * then the buffered records.
+     */
+    int step;
+    uint32_t addr;
+    int buffered;
+} air_log_iter_t;
+
+void air_log_begin(air_log_iter_t *iter, uint32_t from_seq) {
+    iter->from_seq = from_seq;
+    iter->step = 0;
+    iter->addr = 0;
+    iter->buffered = 0;
+}
+
+/**
+ * Returns: false once there are no more records
+ */
+bool air_log_next(air_log_iter_t *iter, air_sample_t *sample) {
+    air_log_record_t record;
+    
+    while (true) {
+        if (iter->step < AIR_LOG_SECTORS) {
+            int sector = (air_log_active + 1 + iter->step) % AIR_LOG_SECTORS;
+            uint32_t end = sector == air_log_active ? air_log_write_addr :
+                           air_log_sector_addr[sector] + air_log_sector_size[sector];
+            
+            if (iter->addr == 0) {
+                iter->addr = air_log_sector_addr[sector] + air_log_page_size;
+            }
+            
+            if (air_log_headers[sector].seq == 0 || iter->addr >= end) {
+                iter->step++;
+                iter->addr = 0;
+                continue;
+            }
+            
+            if (air_log_flash.read(&record, iter->addr, sizeof(air_log_record_t)) != 0) {
+                return false;
+            }
+            iter->addr += AIR_LOG_RECORD_BYTES;
+            
+            if (!air_log_record_valid(&record)) {
+                continue;
+            }
+        } else if (iter->buffered < air_log_buffered) {
+            memcpy(&record, &air_log_page[iter->buffered++ * AIR_LOG_RECORD_BYTES], sizeof(air_log_record_t));
+        } else {
+            return false;
+        }
+        
+        if (record.seq >= iter->from_seq) {
+            break;
+        }
+    }
+    
+    sample->seq = record.seq;
+    sample->timestamp_us = record.timestamp_ms * 1000ULL;
+    sample->result.eco2 = record.eco2;
+    sample->result.tvoc = record.tvoc;
+    
+    return true;
+}
+
+/**
+ * Lowest and highest erase count of the log sectors, a measure of how evenly
+ * they wear.
+ */
+void air_log_erase_counts(uint32_t *erase_min, uint32_t *erase_max) {
+    *erase_min = 0xFFFFFFFF;
+    *erase_max = 0;
+    
+    for (int i = 0; i < AIR_LOG_SECTORS; i++) {
+        if (air_log_headers[i].seq == 0) {
+            continue;
+        }
+        
+        if (air_log_headers[i].erase_count < *erase_min) {
+            *erase_min = air_log_headers[i].erase_count;
+        }
+        if (air_log_headers[i].erase_count > *erase_max) {
+            *erase_max = air_log_headers[i].erase_count;
+        }
+    }
+}
+
+void air_log_dump() {
+    uint32_t erase_min;
+    uint32_t erase_max;
+    air_log_erase_counts(&erase_min, &erase_max);
+    
+    printf("air: log: next_seq=%lu durable_seq=%lu buffered=%d pages=%lu erases=%lu torn=%lu errors=%lu "
+           "sector_erases=%lu..%lu\r\n",
+           (unsigned long)air_log_next_seq, (unsigned long)air_log_stats.durable_seq, air_log_buffered,
+           (unsigned long)air_log_stats.pages, (unsigned long)air_log_stats.erases,
+           (unsigned long)air_log_stats.torn, (unsigned long)air_log_stats.errors,
+           (unsigned long)erase_min, (unsigned long)erase_max);
+}
+#endif
+
+/**
+ * Change only reporting.
+ *
+ * air_report_filter passes a sample on once eCO2 or TVOC has moved further
+ * than its deadband from the last sample passed on, or once heartbeat_ms has
+ * gone by without one. Comparing to the last sample passed on rather than the
+ * previous one means slow drifts are still reported.
+ */
+typedef struct {
+    /**
+     * Change needed to report, eCO2 in ppm and TVOC in ppb. 0 reports any
+     * change.
+     */
+    uint16_t eco2_deadband;
+    uint16_t tvoc_deadband;
+    
+    /**
+     * Longest time without a report.
+     */
+    uint32_t heartbeat_ms;
+} air_report_policy_t;
+
+const air_report_policy_t AIR_REPORT_DEFAULT = { 10, 2, 60000 };
+
+typedef struct {
+    uint32_t samples;
+    uint32_t reported;
+    
+    /**
+     * Reports due only to the heartbeat.
+     */
+    uint32_t heartbeats;
+    
+    uint32_t suppressed;
+} air_report_stats_t;
+
+typedef struct {
+    bool valid;
+    air_sample_t last;
+    air_report_stats_t stats;
+} air_report_t;
+
+/**
+ * Returns: If sample should be reported
+ */
+bool air_report_filter(air_report_t *report, const air_report_policy_t *policy, const air_sample_t *sample) {
+    report->stats.samples++;
+    
+    bool report_sample = !report->valid;
+    
+    if (report->valid) {
+        int eco2_change = abs((int)sample->result.eco2 - report->last.result.eco2);
+        int tvoc_change = abs((int)sample->result.tvoc - report->last.result.tvoc);
+        
+        if (eco2_change > policy->eco2_deadband || tvoc_change > policy->tvoc_deadband) {
+            report_sample = true;
+        } else if (sample->timestamp_us - report->last.timestamp_us >= policy->heartbeat_ms * 1000ULL) {
+            report_sample = true;
+            report->stats.heartbeats++;
+        }
+    }
+    
+    if (!report_sample) {
+        report->stats.suppressed++;
+        return false;
+    }
+    
+    report->valid = true;
+    report->last = *sample;
+    report->stats.reported++;
+    
+    return true;
+}
+
+void air_report_dump(const air_report_t *report) {
+    const air_report_stats_t *stats = &report->stats;
+    
+    printf("air: report: samples=%lu reported=%lu heartbeats=%lu suppressed=%lu suppressed_pct=%.1f\r\n",
+           (unsigned long)stats->samples, (unsigned long)stats->reported, (unsigned long)stats->heartbeats,
+           (unsigned long)stats->suppressed, stats->samples > 0 ? 100.0 * stats->suppressed / stats->samples : 0.0);
+}
+
+/**
+ * Telemetry frames for driver types.
+ * Returns: Frame length
+ */
+int air_tlm_encode_sample(uint8_t *frame, const air_sample_t *sample) {
+    uint8_t body[8];
+    air_tlm_put_u32(&body[0], sample->seq);
+    air_tlm_put_u16(&body[4], sample->result.eco2);
+    air_tlm_put_u16(&body[6], sample->result.tvoc);
+    
+    return air_tlm_encode(frame, AIR_TLM_SAMPLE, sample->timestamp_us / 1000, body, sizeof(body));
+}
+
+int air_tlm_encode_status(uint8_t *frame, uint32_t timestamp_ms, const air_status_t *air_status,
+                          const air_info_t *info) {
+    uint8_t body[8];
+    body[0] = air_status->raw;
+    body[1] = air_meas_mode;
+    body[2] = info->hw_id;
+    body[3] = info->hw_version;
+    air_tlm_put_u16(&body[4], info->fw_boot_version);
+    air_tlm_put_u16(&body[6], info->fw_app_version);
+    
+    return air_tlm_encode(frame, AIR_TLM_STATUS, timestamp_ms, body, sizeof(body));
+}
+
+/**
+ * Output of main(): text lines, or telemetry frames with AIR_TELEMETRY.
+ */
+
+/**
+ * Progress messages, text only.
+ */
+void air_out_text(const char *fmt, ...) {
+#ifndef AIR_TELEMETRY
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+#else
+    (void)fmt;
+#endif
+}
+
+/**
+ * Print fmt, or send an EVENT frame.
+ */
+void air_out_event(uint8_t event, uint32_t arg, const char *fmt, ...) {
+#ifdef AIR_TELEMETRY
+    (void)fmt;
+    air_tlm_event(event, arg);
+#else
+    (void)event;
+    (void)arg;
+    
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+#endif
+}
+
+void air_out_sample(const air_sample_t *sample) {
+#ifdef AIR_TELEMETRY
+    uint8_t frame[AIR_TLM_FRAME_MAX];
+    int n = air_tlm_encode_sample(frame, sample);
+    
+    fwrite(frame, 1, n, stdout);
+    fflush(stdout);
+#else
+    printf("air: eco2=%d tvoc=%d\r\n", sample->result.eco2, sample->result.tvoc);
+#endif
+}
+
+void air_out_info(const air_info_t *info) {
+#ifdef AIR_TELEMETRY
+    air_status_t air_status;
+    air_read_status(&air_status);
+    
+    uint8_t frame[AIR_TLM_FRAME_MAX];
+    int n = air_tlm_encode_status(frame, air_now_us() / 1000, &air_status, info);
+    
+    fwrite(frame, 1, n, stdout);
+    fflush(stdout);
+#else
+    printf("air: booted, hw_id=%#x hw_version=%#x boot=%d.%d.%d app=%d.%d.%d\r\n",
+           (unsigned char)info->hw_id, (unsigned char)info->hw_version,
+           info->fw_boot_version >> 12, (info->fw_boot_version >> 8) & 0x0F, info->fw_boot_version & 0xFF,
+           info->fw_app_version >> 12, (info->fw_app_version >> 8) & 0x0F, info->fw_app_version & 0xFF);
+#endif
+}
+
+/**
+ * Warm restart.
+ *
+ * Driver state is kept in air_retained, in a .noinit section the start up
+ * code does not clear, so it survives an MCU reset though not a power cycle.
+ * A magic number, its size and a CRC tell state saved before a reset from
+ * whatever RAM held at power up. After a warm reset air_try_resume picks up a
+ * sensor still running its application in the retained measurement mode with
+ * two transactions, skipping the firmware update check, air_boot and the
+ * mode write, and the report filter carries on where it was.
+ *
+ * Once the sensor has run AIR_RETAIN_BASELINE_SAMPLES the algorithm baseline
+ * is read into air_retained every as many samples. Whenever the sensor's
+ * application is started again, by main or the supervisor, the last one is
+ * written back instead of being learnt again.
+ *
+ * With the GCC toolchain the linker script must place .noinit in RAM as
+ * NOLOAD. On the host air_retained is an ordinary global, which survives
+ * air_watchdog_reset as retained RAM would.
+ */
+const uint32_t AIR_RETAINED_MAGIC = 0x52524941; // "AIRR"
+
+/**
+ * 20 minutes in drive mode 1, past the sensor's warm-up.
+ */
+const uint32_t AIR_RETAIN_BASELINE_SAMPLES = 1200;
+
+typedef struct {
+    uint32_t magic;
+    
+    /**
+     * sizeof(air_retained_t), so a firmware with another layout starts cold.
+     */
+    uint32_t size;
+    
+    /**
+     * Sensor address, measurement mode and device information as last saved.
+     */
+    int addr;
+    char meas_mode;
+    char info_valid;
+    air_info_t info;
+    
+    /**
+     * Baseline last read from a warmed up sensor.
+     */
+    char baseline_valid;
+    uint16_t baseline;
+    
+    /**
+     * Samples since the sensor's application was last started.
+     */
+    uint32_t run_samples;
+    
+    air_report_t report;
+    
+    /**
+     * MCU resets with air_retained intact.
+     */
+    uint32_t warm_restarts;
+    
+    uint32_t crc;
+} air_retained_t;
+
+#ifdef AIR_SIM
+air_retained_t air_retained;
+#else
+air_retained_t air_retained __attribute__((section(".noinit")));
+#endif
+
+/**
+ * With AIR_RTOS the acquisition thread saves air_retained, and with it the
+ * sensor state its supervisor owns, while the main thread filters samples
+ * into air_retained.report. Both update the CRC, so every write to
+ * air_retained holds this lock.
+ */
+#if defined(AIR_RTOS) && !defined(AIR_SIM)
+Mutex air_retain_mutex;
+
+void air_retain_lock() {
+    air_retain_mutex.lock();
+}
+
+void air_retain_unlock() {
+    air_retain_mutex.unlock();
+}
+#elif defined(AIR_RTOS)
+std::mutex air_retain_mutex;
+
+void air_retain_lock() {
+    air_retain_mutex.lock();
+}
+
+void air_retain_unlock() {
+    air_retain_mutex.unlock();
+}
+#else
+void air_retain_lock() {}
+void air_retain_unlock() {}
+#endif
+
+/**
+ * Save the driver state into air_retained.
+ */
+void air_retain_save() {
+    air_retain_lock();
+    
+    air_retained.magic = AIR_RETAINED_MAGIC;
+    air_retained.size = sizeof(air_retained_t);
+    air_retained.addr = air_addr;
+    air_retained.meas_mode = air_meas_mode;
+    air_retained.info_valid = air_info_valid;
+    air_retained.info = air_info_cache;
+    air_retained.crc = air_crc32(&air_retained, offsetof(air_retained_t, crc));
+    
+    air_retain_unlock();
+}
+
+/**
+ * Check air_retained after an MCU reset, clearing it unless valid.
+ * Returns: If the reset was warm
+ */
+bool air_retain_load() {
+    air_retain_lock();
+    
+    bool valid = air_retained.magic == AIR_RETAINED_MAGIC && air_retained.size == sizeof(air_retained_t) &&
+                 air_retained.crc == air_crc32(&air_retained, offsetof(air_retained_t, crc));
+    if (!valid) {
+        memset(&air_retained, 0, sizeof(air_retained_t));
+    } else {
+        air_retained.warm_restarts++;
+        
+        // The clock started again, count the heartbeat from now
+        air_retained.report.last.timestamp_us = air_now_us();
+    }
+    
+    air_retain_unlock();
+    
+    return valid;
+}
+
+/**
+ * Pick up a sensor left running across a warm reset, without booting it or
+ * writing its measurement mode. It must answer at the retained address in
+ * application mode, running the retained measurement mode.
+ * Returns: AIR_OK, AIR_ERR_NOT_READY if the sensor has to be set up again,
+ *          AIR_ERR_BUS if a transaction failed
+ */
+int air_try_resume() {
+    if (!air_retained.info_valid) {
+        return AIR_ERR_NOT_READY;
+    }
+    
+    air_addr = air_retained.addr;
+    
+    air_status_t air_status;
+    if (air_try_read_status(&air_status) != AIR_OK) {
+        return AIR_ERR_BUS;
+    }
+    
+    if (air_status.fw_mode != AIR_STATUS_FW_MODE_APP) {
+        return AIR_ERR_NOT_READY;
+    }
+    
+    if (air_try_sync_meas_mode() != AIR_OK) {
+        return AIR_ERR_BUS;
+    }
+    
+    if (air_meas_mode != air_retained.meas_mode) {
+        return AIR_ERR_NOT_READY;
+    }
+    
+    air_info_cache = air_retained.info;
+    air_info_valid = 1;
+    
+    return AIR_OK;
+}
+
+/**
+ * Call after starting the sensor's application: writes the retained
+ * baseline back and waits out the warm-up before reading a new one.
+ * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+ */
+int air_retain_started() {
+    air_retain_lock();
+    air_retained.run_samples = 0;
+    bool baseline_valid = air_retained.baseline_valid;
+    uint16_t baseline = air_retained.baseline;
+    air_retain_unlock();
+    
+    if (!baseline_valid) {
+        return AIR_OK;
+    }
+    
+    return air_try_write_baseline(baseline);
+}
+
+/**
+ * Call for every sample: reads the baseline when due and saves air_retained.
+ * With AIR_RTOS the acquisition thread calls it.
+ */
+void air_retain_sample() {
+    air_retain_lock();
+    bool due = ++air_retained.run_samples % AIR_RETAIN_BASELINE_SAMPLES == 0;
+    air_retain_unlock();
+    
+    uint16_t baseline;
+    if (due && air_try_read_baseline(&baseline) == AIR_OK) {
+        air_retain_lock();
+        air_retained.baseline = baseline;
+        air_retained.baseline_valid = 1;
+        air_retain_unlock();
+    }
+    
+    air_retain_save();
+}
+
+/**
+ * Filter a sample into the retained report, see air_report_filter, and bring
+ * the CRC up to date so a reset before the next save still finds air_retained
+ * valid. With AIR_RTOS the main thread calls it.
+ * Returns: If the sample should be reported
+ */
+bool air_retain_report(const air_sample_t *sample) {
+    air_retain_lock();
+    bool reported = air_report_filter(&air_retained.report, &AIR_REPORT_DEFAULT, sample);
+    air_retained.crc = air_crc32(&air_retained, offsetof(air_retained_t, crc));
+    air_retain_unlock();
+    
+    return reported;
+}
+
+/**
+ * MCU watchdog.
+ *
+ * Resets the MCU unless kicked at least every timeout_ms once started. It is
+ * the last resort of the health supervisor below. On the LPC1768 it is the
+ * WDT clocked from the 4 MHz internal RC oscillator, elsewhere only forced
+ * resets are supported. On the host an MCU reset is simulated by
+ * air_sim_mcu_reset and forgetting what the driver knows about the sensor,
+ * after which execution carries on.
+ */
+#if defined(AIR_SIM)
+void air_watchdog_start(uint32_t) {}
+
+void air_watchdog_kick() {}
+
+/**
+ * If the last MCU reset was caused by the watchdog.
+ * Boolean.
+ */
+char air_watchdog_caused_reset() {
+    return air_sim.mcu_resets > 0;
+}
+
+/**
+ * Reset the MCU now.
+ */
+void air_watchdog_reset() {
+    air_sim_mcu_reset();
+    
+    air_info_valid = 0;
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+}
+#elif defined(TARGET_LPC1768)
+/**
+ * WDMOD bits: enable, reset on timeout and the timeout flag.
+ */
+const uint32_t AIR_WDT_WDEN = 1 << 0;
+const uint32_t AIR_WDT_WDRESET = 1 << 1;
+const uint32_t AIR_WDT_WDTOF = 1 << 2;
+
+/**
+ * The WDT divides its 4 MHz clock by 4 and takes at least 0xFF ticks.
+ */
+const uint32_t AIR_WDT_TICKS_PER_MS = 1000;
+const uint32_t AIR_WDT_MIN_TICKS = 0xFF;
+
+void air_watchdog_kick() {
+    // An interrupt between the two feed writes would fault the feed. Kicks
+    // may come with interrupts already masked, which must stay masked
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    LPC_WDT->WDFEED = 0xAA;
+    LPC_WDT->WDFEED = 0x55;
+    __set_PRIMASK(primask);
+}
+
+void air_watchdog_start(uint32_t timeout_ms) {
+    LPC_WDT->WDCLKSEL = 0;
+    LPC_WDT->WDTC = timeout_ms * AIR_WDT_TICKS_PER_MS;
+    LPC_WDT->WDMOD = AIR_WDT_WDEN | AIR_WDT_WDRESET;
+    
+    // The first feed starts the watchdog
+    air_watchdog_kick();
+}
+
+/**
+ * If the last MCU reset was caused by the watchdog. Clears the flag.
+ * Boolean.
+ */
+char air_watchdog_caused_reset() {
+    char caused = (LPC_WDT->WDMOD & AIR_WDT_WDTOF) != 0;
+    LPC_WDT->WDMOD &= ~AIR_WDT_WDTOF;
+    
+    return caused;
+}
+
+/**
+ * Reset the MCU through the watchdog, with the shortest timeout.
+ */
+void air_watchdog_reset() {
+    LPC_WDT->WDCLKSEL = 0;
+    LPC_WDT->WDTC = AIR_WDT_MIN_TICKS;
+    LPC_WDT->WDMOD = AIR_WDT_WDEN | AIR_WDT_WDRESET;
+    air_watchdog_kick();
+    
+    while (1) {}
+}
+#else
+void air_watchdog_start(uint32_t) {}
+
+void air_watchdog_kick() {}
+
+char air_watchdog_caused_reset() {
+    return 0;
+}
+
+void air_watchdog_reset() {
+    NVIC_SystemReset();
+}
+#endif
+
+/**
+ * Health supervisor.
+ *
+ * air_supervise is fed the result of every air_poll_sample. When no sample
+ * arrives for policy->stall_ms, or max_errors polls fail in a row, it takes
+ * the next recovery action, giving each settle_ms to bring samples back
+ * before escalating:
+ *
+ *   1. ERROR_ID  read ERROR_ID, which clears a latched sensor error
+ *   2. SW_RESET  software reset the sensor, boot it and restore the
+ *                measurement mode
+ *   3. REBOOT    forget the device information and boot through
+ *                air_try_boot as at start up, restore the measurement mode
+ *   4. WATCHDOG  reset the MCU through the watchdog
+ *
+ * The watchdog is kicked on every call, so a main loop which stops calling
+ * air_supervise ends in an MCU reset too. Time to recover is kept per level,
+ * from the fault being detected to the next sample. After a real MCU reset
+ * the supervisor starts over, so level 4 times are only seen on the host.
+ *
+ * Before each action the sensor is probed for. If nothing answers at either
+ * address it has been unplugged: no action is taken and the sensor is probed
+ * for every probe_ms until one appears, which is then booted and set up.
+ * While there is none, present is 0 and the caller should not poll.
+ */
+const int AIR_SUPERVISOR_HEALTHY = 0;
+const int AIR_SUPERVISOR_ERROR_ID = 1;
+const int AIR_SUPERVISOR_SW_RESET = 2;
+const int AIR_SUPERVISOR_REBOOT = 3;
+const int AIR_SUPERVISOR_WATCHDOG = 4;
+const int AIR_SUPERVISOR_LEVELS = 5;
+
+/**
+ * Further results of air_supervise, after the levels.
+ */
+const int AIR_SUPERVISOR_REMOVED = 5;
+const int AIR_SUPERVISOR_APPEARED = 6;
+const int AIR_SUPERVISOR_ACTIONS = 7;
+
+const char *AIR_SUPERVISOR_LEVEL_NAMES[AIR_SUPERVISOR_ACTIONS] = {
+    "healthy",
+    "error_id",
+    "sw_reset",
+    "reboot",
+    "watchdog",
+    "removed",
+    "appeared",
+};
+
+/**
+ * When air_supervise acts. stall_ms must be longer than the drive mode's
+ * sample period.
+ */
+typedef struct {
+    uint32_t stall_ms;
+    int max_errors;
+    uint32_t settle_ms;
+    uint32_t watchdog_ms;
+    uint32_t probe_ms;
+} air_supervisor_policy_t;
+
+const air_supervisor_policy_t AIR_SUPERVISOR_DEFAULT = { 5000, 3, 3000, 10000, 2000 };
+
+/**
+ * Counters for one recovery level.
+ */
+typedef struct {
+    /**
+     * Times the level's action was taken.
+     */
+    uint32_t attempts;
+    
+    /**
+     * Faults which ended while this was the highest level reached, and the
+     * time they took to recover.
+     */
+    uint32_t recoveries;
+    uint64_t recover_us;
+    uint64_t recover_max_us;
+} air_supervisor_level_t;
+
+typedef struct {
+    /**
+     * Measurement mode restored after resets.
+     */
+    char meas_mode;
+    
+    /**
+     * If a sensor is plugged in and set up. While not, the next probe is due
+     * at probe_us.
+     * Boolean.
+     */
+    char present;
+    uint64_t probe_us;
+    
+    uint32_t removals;
+    uint32_t appearances;
+    
+    /**
+     * Highest level reached in the current fault, AIR_SUPERVISOR_HEALTHY
+     * while there is none.
+     */
+    int level;
+    
+    /**
+     * Failed polls in a row.
+     */
+    int errors;
+    
+    /**
+     * Time of the last sample, the current fault being detected and the last
+     * action taken.
+     */
+    uint64_t sample_us;
+    uint64_t fault_us;
+    uint64_t action_us;
+    
+    uint32_t faults;
+    
+    /**
+     * Error ID read by the last ERROR_ID action.
+     */
+    char last_error_id;
+    
+    air_supervisor_level_t levels[AIR_SUPERVISOR_LEVELS];
+} air_supervisor_t;
+
+/**
+ * Boot the sensor, restore the supervised measurement mode and the retained
+ * baseline.
+ * Returns: AIR_OK, AIR_ERR_BUS or AIR_ERR_SENSOR as air_try_boot
+ */
+int air_supervisor_restore(air_supervisor_t *supervisor) {
+    int err = air_try_boot();
+    if (err != AIR_OK) {
+        return err;
+    }
+    
+    err = air_try_write_meas_mode(supervisor->meas_mode);
+    if (err != AIR_OK) {
+        return err;
+    }
+    
+    return air_retain_started();
+}
+
+/**
+ * Start supervising a sensor run in meas_mode and start the watchdog. A
+ * plugged in sensor not yet in meas_mode is booted and set up now, a missing
+ * one when it appears.
+ */
+void air_supervisor_start(air_supervisor_t *supervisor, const air_supervisor_policy_t *policy, char meas_mode) {
+    memset(supervisor, 0, sizeof(air_supervisor_t));
+    
+    supervisor->meas_mode = meas_mode;
+    supervisor->sample_us = air_now_us();
+    supervisor->present = air_probe() == AIR_OK;
+    
+    if (supervisor->present && air_meas_mode != meas_mode) {
+        supervisor->present = air_supervisor_restore(supervisor) == AIR_OK;
+    }
+    
+    air_watchdog_start(policy->watchdog_ms);
+}
+
+/**
+ * Probe for a sensor and set up one which appeared.
+ * Returns: AIR_SUPERVISOR_APPEARED, AIR_SUPERVISOR_HEALTHY if none did
+ */
+int air_supervisor_appear(air_supervisor_t *supervisor, const air_supervisor_policy_t *policy) {
+    uint64_t now_us = air_now_us();
+    if (now_us < supervisor->probe_us) {
+        return AIR_SUPERVISOR_HEALTHY;
+    }
+    
+    supervisor->probe_us = now_us + policy->probe_ms * 1000ULL;
+    
+    if (air_probe() != AIR_OK) {
+        return AIR_SUPERVISOR_HEALTHY;
+    }
+    
+    // Maybe another sensor, or the same one with new firmware, whose
+    // baseline is its own
+    air_info_valid = 0;
+    air_retain_lock();
+    air_retained.baseline_valid = 0;
+    air_retain_unlock();
+    if (air_supervisor_restore(supervisor) != AIR_OK) {
+        return AIR_SUPERVISOR_HEALTHY;
+    }
+    
+    supervisor->present = 1;
+    supervisor->appearances++;
+    supervisor->level = AIR_SUPERVISOR_HEALTHY;
+    supervisor->errors = 0;
+    supervisor->sample_us = air_now_us();
+    
+    return AIR_SUPERVISOR_APPEARED;
+}
+
+/**
+ * Feed the supervisor the result of an air_poll_sample and take the next
+ * recovery action if due.
+ * Returns: Level of the action taken, AIR_SUPERVISOR_HEALTHY if none
+ */
+int air_supervise(air_supervisor_t *supervisor, const air_supervisor_policy_t *policy, int err) {
+    if (!supervisor->present) {
+        air_watchdog_kick();
+        return air_supervisor_appear(supervisor, policy);
+    }
+    
+    uint64_t now_us = air_now_us();
+    
+    if (err == AIR_OK) {
+        if (supervisor->level != AIR_SUPERVISOR_HEALTHY) {
+            air_supervisor_level_t *level = &supervisor->levels[supervisor->level];
+            uint64_t recover_us = now_us - supervisor->fault_us;
+            
+            level->recoveries++;
+            level->recover_us += recover_us;
+            if (recover_us > level->recover_max_us) {
+                level->recover_max_us = recover_us;
+            }
+            
+            supervisor->level = AIR_SUPERVISOR_HEALTHY;
+        }
+        
+        supervisor->errors = 0;
+        supervisor->sample_us = now_us;
+        air_watchdog_kick();
+        
+        return AIR_SUPERVISOR_HEALTHY;
+    }
+    
+    if (err != AIR_ERR_NOT_READY) {
+        supervisor->errors++;
+    }
+    
+    bool failed = supervisor->errors >= policy->max_errors ||
+                  now_us - supervisor->sample_us >= policy->stall_ms * 1000ULL;
+    bool settled = supervisor->level == AIR_SUPERVISOR_HEALTHY ||
+                   now_us - supervisor->action_us >= policy->settle_ms * 1000ULL;
+    
+    if (!failed || !settled) {
+        air_watchdog_kick();
+        return AIR_SUPERVISOR_HEALTHY;
+    }
+    
+    // An unplugged sensor is waited for, not recovered
+    if (air_probe() == AIR_ERR_ABSENT) {
+        supervisor->present = 0;
+        supervisor->removals++;
+        supervisor->level = AIR_SUPERVISOR_HEALTHY;
+        supervisor->probe_us = now_us + policy->probe_ms * 1000ULL;
+        air_watchdog_kick();
+        
+        return AIR_SUPERVISOR_REMOVED;
+    }
+    
+    if (supervisor->level == AIR_SUPERVISOR_HEALTHY) {
+        supervisor->faults++;
+        supervisor->fault_us = now_us;
+    }
+    
+    if (supervisor->level < AIR_SUPERVISOR_WATCHDOG) {
+        supervisor->level++;
+    }
+    supervisor->levels[supervisor->level].attempts++;
+    
+    // Actions may fail, the next level is taken if samples do not come back
+    switch (supervisor->level) {
+        case AIR_SUPERVISOR_ERROR_ID:
+            air_try_read_error_id(&supervisor->last_error_id);
+            break;
+        case AIR_SUPERVISOR_SW_RESET:
+            if (air_try_sw_reset() == AIR_OK) {
+                air_supervisor_restore(supervisor);
+            }
+            break;
+        case AIR_SUPERVISOR_REBOOT:
+            air_info_valid = 0;
+            air_supervisor_restore(supervisor);
+            break;
+        case AIR_SUPERVISOR_WATCHDOG:
+            // Only returns on the host, restart the sensor as main would
+            air_watchdog_reset();
+            if (!air_retain_load() || air_try_resume() != AIR_OK) {
+                air_supervisor_restore(supervisor);
+            }
+            break;
+    }
+    
+    supervisor->errors = 0;
+    supervisor->action_us = air_now_us();
+    air_watchdog_kick();
+    
+    return supervisor->level;
+}
+
+/**
+ * Print supervisor counters, per level.
+ */
+void air_supervisor_dump(const air_supervisor_t *supervisor) {
+    printf("air: supervisor: present=%d addr=%#x faults=%lu level=%s removals=%lu appearances=%lu\r\n",
+           supervisor->present, air_addr >> 1, (unsigned long)supervisor->faults,
+           AIR_SUPERVISOR_LEVEL_NAMES[supervisor->level], (unsigned long)supervisor->removals,
+           (unsigned long)supervisor->appearances);
+    
+    for (int i = AIR_SUPERVISOR_ERROR_ID; i < AIR_SUPERVISOR_LEVELS; i++) {
+        const air_supervisor_level_t *level = &supervisor->levels[i];
+        
+        printf("air: supervisor: %s attempts=%lu recoveries=%lu recover_ms_mean=%lu recover_ms_max=%lu\r\n",
+               AIR_SUPERVISOR_LEVEL_NAMES[i], (unsigned long)level->attempts, (unsigned long)level->recoveries,
+               (unsigned long)(level->recoveries > 0 ? level->recover_us / level->recoveries / 1000 : 0),
+               (unsigned long)(level->recover_max_us / 1000));
+    }
+}
+
+/**
+ * Compile-time pipelines.
+ *
+ * Drive mode, filters, aggregation, output and nINT or polling are fixed per
+ * product, so a product's acquisition can be put together from stage types
+ * instead of being configured at run time:
+ *
+ *     typedef air_pipeline_t<air_source_t<AIR_MODE_1_SECOND, true>,
+ *                            air_filter_chain_t<air_filter_range_t, air_filter_deadband_t<10, 2, 60000> >,
+ *                            air_aggregate_none_t,
+ *                            air_sink_tee_t<air_sink_out_t, air_sink_history_t> > air_product_pipeline_t;
+ *
+ * A sample goes source, filters, aggregator, sink. Every stage is a class
+ * whose methods are defined in the class and called directly, and constants
+ * are template arguments, so the compiler inlines the whole chain into
+ * air_pipeline_t::step with nothing left to branch on. A stage is:
+ *
+ *   source      int read(air_sample_t *sample), AIR_OK with a new sample
+ *   filter      bool pass(const air_sample_t *sample)
+ *   aggregator  bool add(air_sample_t *sample), true with an aggregate
+ *               written over sample
+ *   sink        void put(const air_sample_t *sample)
+ */
+
+/**
+ * Level of the sensor's active low nINT output.
+ */
+#ifdef AIR_SIM
+int air_nint_read() {
+    return air_sim_nint();
+}
+#else
+int air_nint_read() {
+    static DigitalIn nint(AIR_NINT_PIN, PullUp);
+    return nint.read();
+}
+#endif
+
+/**
+ * Source reading the sensor in DRIVE_MODE. With USE_NINT the bus is only
+ * read once nINT says a sample is ready, otherwise every read polls.
+ */
+template <char DRIVE_MODE, bool USE_NINT>
+class air_source_t {
+public:
+    static constexpr char meas_mode =
+        air_mode_int_datardy_t::set(air_mode_drive_mode_t::set(AIR_MODE_RESET_VALUE, DRIVE_MODE), USE_NINT);
+    
+    air_source_t() : seq(0) {
+        memset(&retry_stats, 0, sizeof(air_retry_stats_t));
+    }
+    
+    /**
+     * Put the booted sensor in meas_mode.
+     * Returns: AIR_OK, AIR_ERR_BUS if a transaction failed
+     */
+    int start() {
+        return air_try_write_meas_mode(meas_mode);
+    }
+    
+    int read(air_sample_t *sample) {
+        if (USE_NINT && air_nint_read() != 0) {
+            return AIR_ERR_NOT_READY;
+        }
+    
+        air_raw_sample_t raw;
+        int err = air_poll_raw_sample(&raw, &AIR_RETRY_DEFAULT, &retry_stats);
+        if (err != AIR_OK) {
+            return err;
+        }
+    
+        sample->result = raw.result();
+        sample->timestamp_us = air_now_us();
+        sample->seq = seq++;
+    
+        return AIR_OK;
+    }
+    
+    air_retry_stats_t retry_stats;
+    uint32_t seq;
+};
+
+class air_filter_none_t {
+public:
+    bool pass(const air_sample_t *) {
+        return true;
+    }
+};
+
+/**
+ * Drop readings outside the sensor's output ranges, eCO2 400 to 8192 ppm and
+ * TVOC up to 1187 ppb.
+ */
+class air_filter_range_t {
+public:
+    air_filter_range_t() : dropped(0) {}
+    
+    bool pass(const air_sample_t *sample) {
+        if (sample->result.eco2 < 400 || sample->result.eco2 > 8192 || sample->result.tvoc > 1187) {
+            dropped++;
+            return false;
+        }
+    
+        return true;
+    }
+    
+    uint32_t dropped;
+};
+
+/**
+ * Pass changes past the deadbands and heartbeats, see air_report_filter.
+ */
+template <uint16_t ECO2_DEADBAND, uint16_t TVOC_DEADBAND, uint32_t HEARTBEAT_MS>
+class air_filter_deadband_t {
+public:
+    air_filter_deadband_t() {
+        memset(&report, 0, sizeof(air_report_t));
+    }
+    
+    bool pass(const air_sample_t *sample) {
+        static const air_report_policy_t policy = { ECO2_DEADBAND, TVOC_DEADBAND, HEARTBEAT_MS };
+        return air_report_filter(&report, &policy, sample);
+    }
+    
+    air_report_t report;
+};
+
+/**
+ * Pass samples which pass FIRST and then SECOND.
+ */
+template <typename FIRST, typename SECOND>
+class air_filter_chain_t {
+public:
+    bool pass(const air_sample_t *sample) {
+        return first.pass(sample) && second.pass(sample);
+    }
+    
+    FIRST first;
+    SECOND second;
+};
+
+class air_aggregate_none_t {
+public:
+    bool add(air_sample_t *) {
+        return true;
+    }
+};
+
+/**
+ * Mean of every N samples, stamped with the time and sequence number of the
+ * last.
+ */
+template <int N>
+class air_aggregate_mean_t {
+public:
+    static_assert(N > 0, "mean of at least one sample");
+    
+    air_aggregate_mean_t() : count(0), eco2_sum(0), tvoc_sum(0) {}
+    
+    bool add(air_sample_t *sample) {
+        eco2_sum += sample->result.eco2;
+        tvoc_sum += sample->result.tvoc;
+    
+        if (++count < N) {
+            return false;
+        }
+    
+        sample->result.eco2 = (eco2_sum + N / 2) / N;
+        sample->result.tvoc = (tvoc_sum + N / 2) / N;
+    
+        count = 0;
+        eco2_sum = 0;
+        tvoc_sum = 0;
+    
+        return true;
+    }
+
+private:
+    int count;
+    uint32_t eco2_sum;
+    uint32_t tvoc_sum;
+};
+
+class air_sink_out_t {
+public:
+    void put(const air_sample_t *sample) {
+        air_out_sample(sample);
+    }
+};
+
+class air_sink_history_t {
+public:
+    void put(const air_sample_t *sample) {
+        air_history_append(sample);
+    }
+};
+
+#ifdef AIR_LOG
+class air_sink_log_t {
+public:
+    void put(const air_sample_t *sample) {
+        air_log_append(sample);
+    }
+};
+#endif
+
+/**
+ * Sink calling PUT, for outputs of the application's own.
+ */
+template <void (*PUT)(const air_sample_t *sample)>
+class air_sink_call_t {
+public:
+    void put(const air_sample_t *sample) {
+        PUT(sample);
+    }
+};
+
+/**
+ * Sink putting to FIRST and then SECOND.
+ */
+template <typename FIRST, typename SECOND>
+class air_sink_tee_t {
+public:
+    void put(const air_sample_t *sample) {
+        first.put(sample);
+        second.put(sample);
+    }
+    
+    FIRST first;
+    SECOND second;
+};
+
+template <typename SOURCE, typename FILTER, typename AGGREGATOR, typename SINK>
+class air_pipeline_t {
+public:
+    /**
+     * Read a sample from the source and pass it down the pipeline.
+     * Returns: The source's result
+     */
+    int step() {
+        air_sample_t sample;
+    
+        int err = source.read(&sample);
+        if (err != AIR_OK) {
+            return err;
+        }
+    
+        if (filter.pass(&sample) && aggregator.add(&sample)) {
+            sink.put(&sample);
+        }
+    
+        return AIR_OK;
+    }
+    
+    SOURCE source;
+    FILTER filter;
+    AGGREGATOR aggregator;
+    SINK sink;
+};
+
+#ifdef AIR_RTOS
+/**
+ * RTOS acquisition.
+ *
+ * With AIR_RTOS defined main() runs acquisition in its own thread instead of
+ * the bare metal loop. The thread is driven by an EventQueue, either
+ * periodically or from the nINT pin, and posts every sample to each
+ * subscriber's fixed size mail queue. A subscriber which falls behind loses
+ * samples instead of stalling acquisition. On a host the same is built on
+ * std::thread against the simulator, with the threads taking turns on the
+ * virtual clock, see air_sim_block.
+ *
+ * Samples are read into slots of air_acq_pool and posted by reference, not
+ * copied per subscriber. Each post holds a reference on the slot, which the
+ * subscriber releases once done with the sample, and the slot is free again
+ * after the last release.
+ */
+
+/**
+ * Samples each subscriber can have queued.
+ */
+const int AIR_ACQ_MAIL_DEPTH = 8;
+
+const int AIR_ACQ_SUBSCRIBERS = 4;
+
+/**
+ * Sample slots, enough for one subscriber's full queue with as many in
+ * flight. Only several subscribers falling behind at once run it dry, which
+ * loses the sample for all of them.
+ */
+const int AIR_ACQ_POOL_SLOTS = 2 * AIR_ACQ_MAIL_DEPTH;
+
+/**
+ * Fixed size pool of reference counted sample slots. Lock free, so slots can
+ * be taken and released from any thread.
+ */
+template <int N>
+class air_pool_t {
+public:
+    air_pool_t() : exhausted(0) {
+        for (int i = 0; i < N; i++) {
+            slots[i].refs.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    /**
+     * Take a free slot, holding one reference on it.
+     * Returns: NULL if every slot is referenced
+     */
+    air_raw_sample_t *alloc() {
+        for (int i = 0; i < N; i++) {
+            uint8_t free_refs = 0;
+            if (slots[i].refs.compare_exchange_strong(free_refs, 1, std::memory_order_acquire)) {
+                return &slots[i];
+            }
+        }
+        
+        exhausted.fetch_add(1, std::memory_order_relaxed);
+        
+        return NULL;
+    }
+    
+    /**
+     * Take another reference on a slot already held.
+     */
+    void ref(air_raw_sample_t *slot) {
+        slot->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    /**
+     * Drop a reference, the last one frees the slot.
+     */
+    void release(air_raw_sample_t *slot) {
+        slot->refs.fetch_sub(1, std::memory_order_release);
+    }
+    
+    int used() {
+        int n = 0;
+        for (int i = 0; i < N; i++) {
+            n += slots[i].refs.load(std::memory_order_relaxed) != 0;
+        }
+        
+        return n;
+    }
+    
+    /**
+     * Allocations which found no free slot.
+     */
+    uint32_t exhausted_count() {
+        return exhausted.load(std::memory_order_relaxed);
+    }
+
+private:
+    air_raw_sample_t slots[N];
+    std::atomic<uint32_t> exhausted;
+};
+
+#ifndef AIR_SIM
+/**
+ * Fixed size mail queue, Mbed Mail with a depth counter.
+ */
+template <typename T, int N>
+class air_mail_t {
+public:
+    air_mail_t() : depth(0) {}
+    
+    /**
+     * Queue a copy of item without blocking.
+     * Returns: false if the queue is full
+     */
+    bool try_put(const T *item) {
+        T *slot = mail.alloc(0);
+        if (slot == NULL) {
+            return false;
+        }
+        
+        *slot = *item;
+        core_util_atomic_incr_u32(&depth, 1);
+        mail.put(slot);
+        
+        return true;
+    }
+    
+    /**
+     * Take the oldest item, waiting up to timeout_ms for one.
+     * Returns: false on timeout
+     */
+    bool get(T *item, uint32_t timeout_ms) {
+        osEvent evt = mail.get(timeout_ms);
+        if (evt.status != osEventMail) {
+            return false;
+        }
+        
+        T *slot = (T *)evt.value.p;
+        *item = *slot;
+        mail.free(slot);
+        core_util_atomic_decr_u32(&depth, 1);
+        
+        return true;
+    }
+    
+    uint32_t count() {
+        return depth;
+    }
+
+private:
+    Mail<T, N> mail;
+    volatile uint32_t depth;
+};
+#else
+/**
+ * Fixed size mail queue, host equivalent of the Mbed one. Threads take turns
+ * on the simulated CPU, so it needs no lock, and waits run on the virtual
+ * clock.
+ */
+template <typename T, int N>
+class air_mail_t {
+public:
+    air_mail_t() : head(0), depth(0) {}
+    
+    bool try_put(const T *item) {
+        if (depth == N) {
+            return false;
+        }
+        
+        items[(head + depth) % N] = *item;
+        depth++;
+        
+        return true;
+    }
+    
+    bool get(T *item, uint32_t timeout_ms) {
+        if (!air_sim_block([this] { return depth > 0; }, air_sim.now_us + timeout_ms * 1000ULL)) {
+            return false;
+        }
+        
+        *item = items[head];
+        head = (head + 1) % N;
+        depth--;
+        
+        return true;
+    }
+    
+    uint32_t count() {
+        return depth;
+    }
+
+private:
+    T items[N];
+    int head;
+    int depth;
+};
+#endif
+
+air_pool_t<AIR_ACQ_POOL_SLOTS> air_acq_pool;
+
+/**
+ * Subscriber mail queue of slots in air_acq_pool, each to be released with
+ * air_acq_pool.release.
+ */
+typedef air_mail_t<air_raw_sample_t *, AIR_ACQ_MAIL_DEPTH> air_acq_mail_t;
+
+/**
+ * Subscriber queue and its fan-out metrics.
+ */
+typedef struct {
+    air_acq_mail_t *mail;
+    uint32_t posted;
+    uint32_t dropped;
+    
+    /**
+     * Highest queue depth seen right after a post.
+     */
+    uint32_t max_depth;
+} air_acq_subscriber_t;
+
+air_acq_subscriber_t air_acq_subscribers[AIR_ACQ_SUBSCRIBERS];
+int air_acq_subscriber_count = 0;
+
+air_retry_stats_t air_acq_retry_stats;
+uint32_t air_acq_seq = 0;
+uint32_t air_acq_errors = 0;
+
+/**
+ * Supervises acquisition, started by air_acq_start.
+ */
+air_supervisor_t air_acq_supervisor;
+
+/**
+ * Add a subscriber. Must be called before air_acq_start.
+ */
+void air_acq_subscribe(air_acq_mail_t *mail) {
+    if (air_acq_subscriber_count == AIR_ACQ_SUBSCRIBERS) {
+        die("air: acq: too many subscribers");
+    }
+    
+    air_acq_subscriber_t *subscriber = &air_acq_subscribers[air_acq_subscriber_count++];
+    memset(subscriber, 0, sizeof(air_acq_subscriber_t));
+    subscriber->mail = mail;
+}
+
+/**
+ * Publish a sample as air_latest and to the cache, and post a reference to it
+ * to every subscriber.
+ */
+void air_acq_publish(air_raw_sample_t *slot) {
+    air_sample_t sample;
+    air_raw_sample_decode(slot, &sample);
+    air_latest.publish(&sample);
+    air_cache_publish(&sample, AIR_OK);
+    
+    for (int i = 0; i < air_acq_subscriber_count; i++) {
+        air_acq_subscriber_t *subscriber = &air_acq_subscribers[i];
+        
+        air_acq_pool.ref(slot);
+        if (!subscriber->mail->try_put(&slot)) {
+            air_acq_pool.release(slot);
+            subscriber->dropped++;
+            continue;
+        }
+        
+        subscriber->posted++;
+        
+        uint32_t depth = subscriber->mail->count();
+        if (depth > subscriber->max_depth) {
+            subscriber->max_depth = depth;
+        }
+    }
+}
+
+/**
+ * Acquisition event, reads a sample if one is ready and publishes it.
+ */
+void air_acq_poll() {
+    // Subscribers holding every slot leave the sample on the sensor for now
+    air_raw_sample_t *slot = NULL;
+    if (!air_acq_supervisor.present || (slot = air_acq_pool.alloc()) == NULL) {
+        air_supervise(&air_acq_supervisor, &AIR_SUPERVISOR_DEFAULT, AIR_ERR_NOT_READY);
+        return;
+    }
+    
+    int err = air_poll_raw_sample(slot, &AIR_RETRY_DEFAULT, &air_acq_retry_stats);
+    air_supervise(&air_acq_supervisor, &AIR_SUPERVISOR_DEFAULT, err);
+    
+    if (err == AIR_OK) {
+        slot->timestamp_us = air_now_us();
+        slot->seq = air_acq_seq++;
+        
+        air_acq_publish(slot);
+        air_retain_sample();
+    } else if (err != AIR_ERR_NOT_READY) {
+        air_acq_errors++;
+    }
+    
+    air_acq_pool.release(slot);
+}
+
+/**
+ * Print acquisition and per subscriber queue metrics.
+ */
+void air_acq_dump() {
+    printf("air: acq: samples=%lu errors=%lu retries=%lu pool_used=%d/%d pool_exhausted=%lu\r\n",
+           (unsigned long)air_acq_seq, (unsigned long)air_acq_errors, (unsigned long)air_acq_retry_stats.retries,
+           air_acq_pool.used(), AIR_ACQ_POOL_SLOTS, (unsigned long)air_acq_pool.exhausted_count());
+    
+    for (int i = 0; i < air_acq_subscriber_count; i++) {
+        air_acq_subscriber_t *subscriber = &air_acq_subscribers[i];
+        
+        printf("air: acq: subscriber %d posted=%lu dropped=%lu depth=%lu max_depth=%lu\r\n", i,
+               (unsigned long)subscriber->posted, (unsigned long)subscriber->dropped,
+               (unsigned long)subscriber->mail->count(), (unsigned long)subscriber->max_depth);
+    }
+    
+    air_supervisor_dump(&air_acq_supervisor);
+}
+
+/**
+ * Let the supervisor check for a stall, or probe for a sensor. nINT only
+ * falls when a sample becomes ready, so a sample already waiting at start,
+ * left on the sensor while the pool was exhausted or behind a missed edge is
+ * read here instead.
+ */
+void air_acq_check() {
+    if (air_acq_supervisor.present && air_nint_read() == 0) {
+        air_acq_poll();
+        return;
+    }
+    
+    air_supervise(&air_acq_supervisor, &AIR_SUPERVISOR_DEFAULT, AIR_ERR_NOT_READY);
+}
+
+/**
+ * Stall and presence check period when driven by nINT.
+ */
+const int AIR_ACQ_CHECK_MS = 1000;
+
+#ifndef AIR_SIM
+Thread air_acq_thread(osPriorityHigh);
+EventQueue air_acq_queue(8 * EVENTS_EVENT_SIZE);
+InterruptIn air_acq_nint(AIR_NINT_PIN);
+
+/**
+ * Start the acquisition thread, running the sensor in meas_mode. The sensor
+ * is set up now if plugged in, otherwise once it appears.
+ * use_nint: Boolean, read samples when nINT falls instead of polling every
+ *           period_ms
+ */
+void air_acq_start(bool use_nint, int period_ms, char meas_mode) {
+    if (use_nint) {
+        meas_mode = air_mode_int_datardy_t::set(meas_mode, 1);
+        
+        air_acq_nint.mode(PullUp);
+        air_acq_nint.fall(air_acq_queue.event(air_acq_poll));
+        
+        // nINT stays high when the sensor stops sampling or is unplugged, and
+        // may already be low with no edge to come
+        air_acq_queue.call(air_acq_check);
+        air_acq_queue.call_every(AIR_ACQ_CHECK_MS, air_acq_check);
+    } else {
+        air_acq_queue.call_every(period_ms, air_acq_poll);
+    }
+    
+    air_supervisor_start(&air_acq_supervisor, &AIR_SUPERVISOR_DEFAULT, meas_mode);
+    air_cache_acq = true;
+    
+    air_acq_thread.start(callback(&air_acq_queue, &EventQueue::dispatch_forever));
+}
+#else
+/**
+ * Check at the end of a simulated run that every subscriber got every sample.
+ * The virtual clock waits for consumers, so none may have been dropped.
+ */
+void air_acq_sim_check() {
+    for (int i = 0; i < air_acq_subscriber_count; i++) {
+        air_acq_subscriber_t *subscriber = &air_acq_subscribers[i];
+        
+        if (subscriber->dropped != 0 || subscriber->posted != air_acq_seq) {
+            printf("air: acq: subscriber %d got %lu of %lu samples\r\n", i, (unsigned long)subscriber->posted,
+                   (unsigned long)air_acq_seq);
+            fflush(stdout);
+            _Exit(1);
+        }
+    }
+}
+
+/**
+ * Start the acquisition thread, see the Mbed version. Falling edges of nINT
+ * are waited for in the simulator.
+ */
+void air_acq_start(bool use_nint, int period_ms, char meas_mode) {
+    if (use_nint) {
+        meas_mode = air_mode_int_datardy_t::set(meas_mode, 1);
+    }
+    
+    air_supervisor_start(&air_acq_supervisor, &AIR_SUPERVISOR_DEFAULT, meas_mode);
+    air_cache_acq = true;
+    
+    // Handlers run last registered first
+    atexit(air_acq_sim_check);
+    atexit(air_acq_dump);
+    
+    air_sim_thread_start([use_nint, period_ms] {
+        // Edges before the handler is attached are not seen, the first check
+        // runs at once
+        uint64_t falls = air_sim.nint_falls;
+        uint64_t check_us = air_sim.now_us;
+        
+        while (true) {
+            if (use_nint) {
+                if (air_sim_wait_nint_fall(&falls, check_us) != 0) {
+                    check_us = air_sim.now_us + AIR_ACQ_CHECK_MS * 1000ULL;
+                    air_acq_check();
+                    continue;
+                }
+            } else {
+                wait_ms(period_ms);
+            }
+            
+            air_acq_poll();
+        }
+    });
+}
+
+/**
+ * On demand readers for the simulated run. Reader i asks air_cache_read for a
+ * sample no older than AIR_CACHE_SIM_MAX_AGE_MS every
+ * AIR_CACHE_SIM_PERIOD_MS[i], so some requests hit, some wait for the next
+ * sample together. The run fails if a request errs, gets an older sample than
+ * the last one or one older than asked for.
+ */
+const int AIR_CACHE_SIM_READERS = 2;
+const uint32_t AIR_CACHE_SIM_MAX_AGE_MS = 500;
+const int AIR_CACHE_SIM_PERIOD_MS[AIR_CACHE_SIM_READERS] = { 700, 1300 };
+
+void air_cache_sim_start() {
+    atexit(air_cache_dump);
+    
+    for (int i = 0; i < AIR_CACHE_SIM_READERS; i++) {
+        int period_ms = AIR_CACHE_SIM_PERIOD_MS[i];
+        
+        air_sim_thread_start([i, period_ms] {
+            uint32_t last_seq = 0;
+            
+            while (true) {
+                wait_ms(period_ms);
+                
+                air_sample_t sample;
+                int err = air_cache_read(&sample, AIR_CACHE_SIM_MAX_AGE_MS);
+                if (err != AIR_OK || sample.seq < last_seq ||
+                    air_now_us() - sample.timestamp_us > AIR_CACHE_SIM_MAX_AGE_MS * 1000ULL) {
+                    printf("air: cache: reader %d got %d, sample %lu from %llu us\r\n", i, err,
+                           (unsigned long)sample.seq, (unsigned long long)sample.timestamp_us);
+                    fflush(stdout);
+                    _Exit(1);
+                }
+                
+                last_seq = sample.seq;
+            }
+        });
+    }
+}
+#endif
+#endif
+
+#ifdef AIR_CORO
+/**
+ * Coroutine driver API.
+ *
+ * Building with AIR_CORO defined (C++20, host only) adds air_co_* versions of
+ * the multi step sequences in which every bus transfer and delay is awaited.
+ * A single threaded executor runs any number of these sequences interleaved:
+ * while one waits for a delay the others make progress. Transfers are queued
+ * and awaited too, but the executor still runs each one to completion through
+ * the blocking air_bus_transfer, so nothing else runs during a transfer. Only
+ * delays overlap. Errors are returned as AIR_ERR_* codes instead of exiting.
+ *
+ *     g++ -std=c++20 -DAIR_CORO -o air_coro main.cpp && ./air_coro
+ */
+
+/**
+ * Coroutine returning an int, started when spawned on the executor or
+ * awaited by another coroutine.
+ */
+class air_co_task_t {
+public:
+    struct promise_type {
+        int result = AIR_OK;
+        std::coroutine_handle<> continuation;
+        
+        air_co_task_t get_return_object() {
+            return air_co_task_t(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        
+        /**
+         * Resume the awaiting coroutine, if any, when finished.
+         */
+        struct final_awaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+            
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                if (handle.promise().continuation) {
+                    return handle.promise().continuation;
+                }
+                
+                return std::noop_coroutine();
+            }
+            
+            void await_resume() noexcept {}
+        };
+        
+        final_awaiter final_suspend() noexcept {
+            return {};
+        }
+        
+        void return_value(int value) {
+            result = value;
+        }
+        
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+    
+    explicit air_co_task_t(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    
+    air_co_task_t(air_co_task_t &&other) : handle(other.handle) {
+        other.handle = nullptr;
+    }
+    
+    air_co_task_t(const air_co_task_t &) = delete;
+    
+    ~air_co_task_t() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+    
+    bool done() const {
+        return handle.done();
+    }
+    
+    int result() const {
+        return handle.promise().result;
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    
+    int await_resume() {
+        return handle.promise().result;
+    }
+    
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * Single threaded executor. Runs ready coroutines, then queued bus transfers
+ * one at a time with the blocking air_bus_transfer, then advances the virtual
+ * clock to the next delay once nothing else can run.
+ */
+class air_co_executor_t {
+public:
+    /**
+     * Bus transfer waiting to be run.
+     */
+    struct transfer_t {
+        int prio;
+        const char *write_buf;
+        int write_len;
+        char *read_buf;
+        int read_len;
+        int result;
+        std::coroutine_handle<> handle;
+    };
+    
+    /**
+     * Delay waiting to expire.
+     */
+    struct sleep_t {
+        uint64_t due_us;
+        std::coroutine_handle<> handle;
+    };
+    
+    /**
+     * Take ownership of a task and schedule it.
+     */
+    void spawn(air_co_task_t &&task) {
+        ready.push_back(task.handle);
+        tasks.push_back(std::move(task));
+    }
+    
+    void schedule(std::coroutine_handle<> handle) {
+        ready.push_back(handle);
+    }
+    
+    void submit(transfer_t *transfer) {
+        transfers.push_back(transfer);
+    }
+    
+    void sleep(uint64_t due_us, std::coroutine_handle<> handle) {
+        sleep_t entry = { due_us, handle };
+        sleeps.push_back(entry);
+    }
+    
+    /**
+     * Run until every spawned task has finished.
+     */
+    void run() {
+        while (true) {
+            if (!ready.empty()) {
+                std::coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                handle.resume();
+                continue;
+            }
+            
+            if (!transfers.empty()) {
+                transfer_t *transfer = transfers.front();
+                transfers.pop_front();
+                
+                transfer->result = air_bus_transfer(transfer->prio, air_addr, transfer->write_buf, transfer->write_len,
+                                                    transfer->read_buf, transfer->read_len);
+                ready.push_back(transfer->handle);
+                continue;
+            }
+            
+            if (!sleeps.empty()) {
+                size_t next = 0;
+                for (size_t i = 1; i < sleeps.size(); i++) {
+                    if (sleeps[i].due_us < sleeps[next].due_us) {
+                        next = i;
+                    }
+                }
+                
+                if (sleeps[next].due_us > air_sim.now_us) {
+                    air_sim_wait_us(sleeps[next].due_us - air_sim.now_us);
+                }
+                
+                ready.push_back(sleeps[next].handle);
+                sleeps.erase(sleeps.begin() + next);
+                continue;
+            }
+            
+            return;
+        }
+    }
+
+private:
+    std::deque<std::coroutine_handle<>> ready;
+    std::deque<transfer_t *> transfers;
+    std::vector<sleep_t> sleeps;
+    std::vector<air_co_task_t> tasks;
+};
+
+air_co_executor_t air_co_executor;
+
+/**
+ * Awaitable bus transfer, see air_bus_transfer.
+ * Returns: 0 on success, the I2C API result otherwise
+ */
+struct air_co_transfer {
+    air_co_executor_t::transfer_t transfer;
+    
+    air_co_transfer(int prio, const char *write_buf, int write_len, char *read_buf, int read_len) {
+        transfer.prio = prio;
+        transfer.write_buf = write_buf;
+        transfer.write_len = write_len;
+        transfer.read_buf = read_buf;
+        transfer.read_len = read_len;
+        transfer.result = 0;
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    
+    void await_suspend(std::coroutine_handle<> handle) {
+        transfer.handle = handle;
+        air_co_executor.submit(&transfer);
+    }
+    
+    int await_resume() {
+        return transfer.result;
+    }
+};
+
+/**
+ * Awaitable delay on the virtual clock.
+ */
+struct air_co_sleep_ms {
+    uint64_t due_us;
+    
+    explicit air_co_sleep_ms(int ms) : due_us(air_sim.now_us + ms * 1000ULL) {}
+    
+    bool await_ready() {
+        return due_us <= air_sim.now_us;
+    }
+    
+    void await_suspend(std::coroutine_handle<> handle) {
+        air_co_executor.sleep(due_us, handle);
+    }
+    
+    void await_resume() {}
+};
+
+/**
+ * Read the status register, see air_try_read_status.
+ */
+air_co_task_t air_co_read_status(air_status_t *air_status) {
+    char raw_status;
+    if (co_await air_co_transfer(AIR_BUS_PRIO_SAMPLE, &AIR_STATUS_REG, 1, &raw_status, 1) != 0) {
+        co_return AIR_ERR_BUS;
+    }
+    
+    air_decode_status(raw_status, air_status);
+    
+    co_return AIR_OK;
+}
+
+/**
+ * Check the sensor for an error, the non fatal equivalent of air_die.
+ * Returns: AIR_OK, AIR_ERR_SENSOR with the error ID in air_error_id, or
+ *          AIR_ERR_BUS
+ */
+air_co_task_t air_co_check_error(char *air_error_id) {
+    air_status_t air_status;
+    int err = co_await air_co_read_status(&air_status);
+    if (err != AIR_OK) {
+        co_return err;
+    }
+    
+    *air_error_id = 0;
+    if (!air_status.error) {
+        co_return AIR_OK;
+    }
+    
+    if (co_await air_co_transfer(AIR_BUS_PRIO_SAMPLE, &AIR_ERROR_ID_REG, 1, air_error_id, 1) != 0) {
+        co_return AIR_ERR_BUS;
+    }
+    
+    co_return AIR_ERR_SENSOR;
+}
+
+/**
+ * Boot the air sensor, see air_boot.
+ * Returns: AIR_OK, AIR_ERR_SENSOR if the sensor is not a CCS811 or has no
+ *          valid application, or AIR_ERR_BUS
+ */
+air_co_task_t air_co_boot() {
+    air_status_t air_status;
+    int err = co_await air_co_read_status(&air_status);
+    if (err != AIR_OK) {
+        co_return err;
+    }
+    
+    if (!air_info_valid) {
+        char raw[AIR_INFO_RAW_LEN];
+        int offset = 0;
+        
+        for (int i = 0; i < AIR_INFO_REGS; i++) {
+            if (co_await air_co_transfer(AIR_BUS_PRIO_CONFIG, &air_info_reg_addrs[i], 1, raw + offset,
+                                         air_info_reg_lens[i]) != 0) {
+                co_return AIR_ERR_BUS;
+            }
+            offset += air_info_reg_lens[i];
+        }
+        
+        err = air_store_info(raw);
+        if (err != AIR_OK) {
+            co_return err;
+        }
+    }
+    
+    if (air_status.fw_mode == AIR_STATUS_FW_MODE_APP) {
+        if (co_await air_co_transfer(AIR_BUS_PRIO_CONFIG, &AIR_MODE_REG, 1, &air_meas_mode, 1) != 0) {
+            co_return AIR_ERR_BUS;
+        }
+        
+        co_return AIR_OK;
+    }
+    
+    if (!air_status.app_valid) {
+        co_return AIR_ERR_SENSOR;
+    }
+    
+    if (co_await air_co_transfer(AIR_BUS_PRIO_CONFIG, &AIR_BOOT_APP_START_REG, 1, NULL, 0) != 0) {
+        co_return AIR_ERR_BUS;
+    }
+    
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    
+    co_return AIR_OK;
+}
+
+/**
+ * Set the measurement drive mode, see air_write_mode.
+ */
+air_co_task_t air_co_write_mode(char drive_mode) {
+    char meas_mode = air_mode_drive_mode_t::set(air_meas_mode, drive_mode);
+    char buf[2] = {
+        AIR_MODE_REG,
+        meas_mode,
+    };
+    
+    if (co_await air_co_transfer(AIR_BUS_PRIO_CONFIG, buf, 2, NULL, 0) != 0) {
+        co_return AIR_ERR_BUS;
+    }
+    
+    air_meas_mode = meas_mode;
+    
+    co_return AIR_OK;
+}
+
+/**
+ * Example: boot, configure and sample linearly while other coroutines run.
+ */
+air_co_task_t air_co_acquire(int samples) {
+    int err = co_await air_co_boot();
+    if (err == AIR_OK) {
+        err = co_await air_co_write_mode(AIR_MODE_1_SECOND);
+    }
+    
+    if (err != AIR_OK) {
+        printf("air: co: boot failed, err=%d\r\n", err);
+        co_return err;
+    }
+    
+    printf("air: co: booted and configured at %llu us\r\n", (unsigned long long)air_sim.now_us);
+    
+    for (int i = 0; i < samples; ) {
+        char air_error_id;
+        err = co_await air_co_check_error(&air_error_id);
+        if (err != AIR_OK) {
+            printf("air: co: error=%d error_id=%#x\r\n", err, air_error_id);
+            co_return err;
+        }
+        
+        char buf[5];
+        if (co_await air_co_transfer(AIR_BUS_PRIO_SAMPLE, &AIR_ALG_RESULT_DATA_REG, 1, buf, 5) != 0) {
+            co_return AIR_ERR_BUS;
+        }
+        
+        air_status_t air_status;
+        air_decode_status(buf[4], &air_status);
+        
+        if (air_status.data_ready) {
+            printf("air: co: tvoc=%d at %llu us\r\n", ((unsigned char)buf[2] << 8) | (unsigned char)buf[3],
+                   (unsigned long long)air_sim.now_us);
+            i++;
+        }
+        
+        co_await air_co_sleep_ms(500);
+    }
+    
+    co_return AIR_OK;
+}
+
+/**
+ * Example: unrelated work sharing the executor with acquisition.
+ */
+air_co_task_t air_co_heartbeat(int beats) {
+    for (int i = 0; i < beats; i++) {
+        printf("air: co: heartbeat %d at %llu us\r\n", i, (unsigned long long)air_sim.now_us);
+        co_await air_co_sleep_ms(1000);
+    }
+    
+    co_return AIR_OK;
+}
+#endif
+
+#ifdef AIR_BENCH
+/**
+ * Driver benchmark.
+ *
+ * Runs the acquisition loop against the simulator for each drive mode and
+ * acquisition strategy and prints the cost per sample as JSON:
+ *
+ *     g++ -O2 -pthread -DAIR_BENCH -o air_bench main.cpp && ./air_bench > bench.json
+ *
+ * CPU time is host time spent in the driver and simulator, the rest is taken
+ * from the simulated bus and virtual clock.
+ */
+
+/**
+ * Acquisition strategies.
+ * POLL: Poll STATUS, then read ALG_RESULT_DATA once data is ready, like main()
+ * INTERRUPT: Wait for nINT, then read ALG_RESULT_DATA
+ * BURST: Poll ALG_RESULT_DATA with STATUS included in the same read
+ */
+const int AIR_BENCH_STRATEGY_POLL = 0;
+const int AIR_BENCH_STRATEGY_INTERRUPT = 1;
+const int AIR_BENCH_STRATEGY_BURST = 2;
+const char *AIR_BENCH_STRATEGY_NAMES[3] = { "poll", "interrupt", "burst" };
+
+const int AIR_BENCH_SAMPLES = 1000;
+const int AIR_BENCH_POLL_MS = 100;
+
+/**
+ * Results of one benchmark run, totals over all samples.
+ */
+typedef struct {
+    int drive_mode;
+    int strategy;
+    int samples;
+    uint64_t transactions;
+    uint64_t bytes;
+    uint64_t bits;
+    uint64_t cpu_ns;
+    uint64_t latency_us;
+    uint64_t latency_max_us;
+} air_bench_result_t;
+
+uint64_t air_bench_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Acquire AIR_BENCH_SAMPLES samples with one drive mode and strategy.
+ */
+void air_bench_run(int drive_mode, int strategy, air_bench_result_t *result) {
+    memset(result, 0, sizeof(air_bench_result_t));
+    result->drive_mode = drive_mode;
+    result->strategy = strategy;
+    
+    air_sim_reset();
+    air_boot();
+    air_write_mode(drive_mode);
+    air_write_interrupt(strategy == AIR_BENCH_STRATEGY_INTERRUPT, 0);
+    
+    // Only count the acquisition loop
+    air_sim.stat_transactions = 0;
+    air_sim.stat_bytes = 0;
+    air_sim.stat_bits = 0;
+    
+    uint64_t cpu_start_ns = air_bench_cpu_ns();
+    
+    while (result->samples < AIR_BENCH_SAMPLES) {
+        air_status_t air_status;
+        air_alg_result_t air_alg_result;
+        
+        if (strategy == AIR_BENCH_STRATEGY_POLL) {
+            air_read_status(&air_status);
+            if (!air_status.data_ready) {
+                wait_ms(AIR_BENCH_POLL_MS);
+                continue;
+            }
+            
+            air_read_alg_result(&air_alg_result);
+        } else if (strategy == AIR_BENCH_STRATEGY_INTERRUPT) {
+            if (air_sim_wait_nint() != 0) {
+                die("air: bench: nINT never asserted");
+            }
+            
+            air_read_alg_result(&air_alg_result);
+        } else {
+            air_read_alg_result_status(&air_alg_result, &air_status);
+            if (!air_status.data_ready) {
+                wait_ms(AIR_BENCH_POLL_MS);
+                continue;
+            }
+        }
+        
+        uint64_t latency_us = air_sim.now_us - air_sim.sample_us;
+        
+        result->samples++;
+        result->latency_us += latency_us;
+        if (latency_us > result->latency_max_us) {
+            result->latency_max_us = latency_us;
+        }
+    }
+    
+    result->cpu_ns = air_bench_cpu_ns() - cpu_start_ns;
+    result->transactions = air_sim.stat_transactions;
+    result->bytes = air_sim.stat_bytes;
+    result->bits = air_sim.stat_bits;
+}
+
+void air_bench_print(const air_bench_result_t *result, const char *sep) {
+    double n = result->samples;
+    
+    printf("    {\"drive_mode\": %d, \"strategy\": \"%s\", \"samples\": %d, "
+           "\"transactions_per_sample\": %.3f, \"bytes_per_sample\": %.3f, "
+           "\"bus_us_per_sample_100khz\": %.1f, \"bus_us_per_sample_400khz\": %.1f, "
+           "\"cpu_ns_per_sample\": %.1f, \"latency_us_mean\": %.1f, \"latency_us_max\": %llu}%s\n",
+           result->drive_mode, AIR_BENCH_STRATEGY_NAMES[result->strategy], result->samples,
+           result->transactions / n, result->bytes / n,
+           result->bits * 1e6 / 100000 / n, result->bits * 1e6 / 400000 / n,
+           result->cpu_ns / n, result->latency_us / n, (unsigned long long)result->latency_max_us, sep);
+}
+
+/**
+ * Fault recovery scenarios. Each runs drive mode 1 with burst polling through
+ * air_poll_sample for AIR_BENCH_RECOVERY_SECONDS with one fault pattern
+ * injected after boot.
+ */
+const int AIR_BENCH_RECOVERY_SECONDS = 3600;
+
+typedef struct {
+    const char *name;
+    double nack_rate;
+    uint64_t stuck_period_us;
+    uint64_t stuck_len_us;
+    uint64_t heater_period_us;
+    uint64_t heater_len_us;
+} air_bench_scenario_t;
+
+const air_bench_scenario_t AIR_BENCH_SCENARIOS[] = {
+    { "none", 0, 0, 0, 0, 0 },
+    { "nack_1pct", 0.01, 0, 0, 0, 0 },
+    { "nack_10pct", 0.10, 0, 0, 0, 0 },
+    { "stuck_bus_5s_per_2min", 0, 120000000ULL, 5000000ULL, 0, 0 },
+    { "heater_fault_10s_per_5min", 0, 0, 0, 300000000ULL, 10000000ULL },
+};
+const int AIR_BENCH_SCENARIO_COUNT = sizeof(AIR_BENCH_SCENARIOS) / sizeof(AIR_BENCH_SCENARIOS[0]);
+
+/**
+ * Results of one recovery scenario.
+ */
+typedef struct {
+    int expected_samples;
+    int samples;
+    int faults;
+    uint64_t recovery_us;
+    uint64_t recovery_max_us;
+    air_retry_stats_t retry;
+    uint64_t transactions;
+    uint64_t bits;
+} air_bench_recovery_t;
+
+void air_bench_recovery_run(const air_bench_scenario_t *scenario, air_bench_recovery_t *result) {
+    memset(result, 0, sizeof(air_bench_recovery_t));
+    
+    air_sim_reset();
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    
+    air_sim.fault_nack_rate = scenario->nack_rate;
+    air_sim.fault_stuck_period_us = scenario->stuck_period_us;
+    air_sim.fault_stuck_len_us = scenario->stuck_len_us;
+    air_sim.fault_heater_period_us = scenario->heater_period_us;
+    air_sim.fault_heater_len_us = scenario->heater_len_us;
+    
+    air_sim.stat_transactions = 0;
+    air_sim.stat_bits = 0;
+    
+    uint64_t start_us = air_sim.now_us;
+    uint64_t end_us = start_us + AIR_BENCH_RECOVERY_SECONDS * 1000000ULL;
+    
+    // Virtual time the current fault started, 0 while healthy
+    uint64_t fault_us = 0;
+    
+    while (air_sim.now_us < end_us) {
+        air_alg_result_t air_alg_result;
+        int err = air_poll_sample(&air_alg_result, &AIR_RETRY_DEFAULT, &result->retry);
+        
+        if (err == AIR_OK) {
+            result->samples++;
+            
+            if (fault_us != 0) {
+                uint64_t recovery_us = air_sim.now_us - fault_us;
+                result->recovery_us += recovery_us;
+                if (recovery_us > result->recovery_max_us) {
+                    result->recovery_max_us = recovery_us;
+                }
+                fault_us = 0;
+            }
+        } else if (err != AIR_ERR_NOT_READY && fault_us == 0) {
+            result->faults++;
+            fault_us = air_sim.now_us;
+        }
+        
+        if (err != AIR_OK) {
+            wait_ms(AIR_BENCH_POLL_MS);
+        }
+    }
+    
+    result->expected_samples = (end_us - start_us) / AIR_SIM_DRIVE_MODE_PERIOD_US[(int)AIR_MODE_1_SECOND];
+    result->transactions = air_sim.stat_transactions;
+    result->bits = air_sim.stat_bits;
+}
+
+void air_bench_recovery_print(const air_bench_scenario_t *scenario, const air_bench_recovery_t *result, const char *sep) {
+    double n = result->samples > 0 ? result->samples : 1;
+    double faults = result->faults > 0 ? result->faults : 1;
+    
+    printf("    {\"scenario\": \"%s\", \"expected_samples\": %d, \"samples\": %d, \"lost_samples\": %d, "
+           "\"faults\": %d, \"recovery_ms_mean\": %.1f, \"recovery_ms_max\": %.1f, "
+           "\"retries\": %lu, \"bus_errors\": %lu, \"sensor_errors\": %lu, "
+           "\"transactions_per_sample\": %.3f, \"bus_us_per_sample_100khz\": %.1f}%s\n",
+           scenario->name, result->expected_samples, result->samples,
+           result->expected_samples - result->samples, result->faults,
+           result->recovery_us / faults / 1000, result->recovery_max_us / 1000.0,
+           (unsigned long)result->retry.retries, (unsigned long)result->retry.bus_errors,
+           (unsigned long)result->retry.sensor_errors,
+           result->transactions / n, result->bits * 1e6 / 100000 / n, sep);
+}
+
+/**
+ * Bus hang scenarios. Each polls drive mode 1 for AIR_BENCH_HANG_SECONDS
+ * while a hang is injected every AIR_BENCH_HANG_PERIOD_SECONDS: a slave left
+ * holding SDA low, or 5 s of clock stretching past the HAL's limit. A steady
+ * 1 ms stretch, under the timeout, shows the cost of slow transactions.
+ */
+const int AIR_BENCH_HANG_SECONDS = 3600;
+const int AIR_BENCH_HANG_PERIOD_SECONDS = 120;
+
+const int AIR_BENCH_HANG_SDA = 0;
+const int AIR_BENCH_HANG_STRETCH_ENDLESS = 1;
+const int AIR_BENCH_HANG_STRETCH_1MS = 2;
+const int AIR_BENCH_HANGS = 3;
+const char *AIR_BENCH_HANG_NAMES[AIR_BENCH_HANGS] = { "sda_held", "stretch_endless_5s", "stretch_1ms" };
+
+typedef struct {
+    int expected_samples;
+    int samples;
+    int injected;
+    air_i2c_stats_t i2c;
+} air_bench_hang_t;
+
+void air_bench_hang_run(int hang, air_bench_hang_t *result) {
+    memset(result, 0, sizeof(air_bench_hang_t));
+    
+    air_sim_reset();
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    
+    memset(&air_i2c_stats, 0, sizeof(air_i2c_stats_t));
+    
+    air_retry_stats_t retry;
+    memset(&retry, 0, sizeof(air_retry_stats_t));
+    
+    uint64_t period_us = AIR_BENCH_HANG_PERIOD_SECONDS * 1000000ULL;
+    uint64_t start_us = air_sim.now_us;
+    uint64_t end_us = start_us + AIR_BENCH_HANG_SECONDS * 1000000ULL;
+    uint64_t hang_us = start_us + period_us / 2;
+    
+    if (hang == AIR_BENCH_HANG_STRETCH_1MS) {
+        air_sim.fault_stretch_us = 1000;
+    }
+    
+    while (air_sim.now_us < end_us) {
+        if (hang == AIR_BENCH_HANG_SDA && air_sim.now_us >= hang_us) {
+            air_sim.fault_sda_held = 1;
+            result->injected++;
+            hang_us += period_us;
+        } else if (hang == AIR_BENCH_HANG_STRETCH_ENDLESS) {
+            bool stretching = air_sim.now_us >= hang_us && air_sim.now_us < hang_us + 5000000ULL;
+            if (stretching && air_sim.fault_stretch_us == 0) {
+                result->injected++;
+            }
+            air_sim.fault_stretch_us = stretching ? AIR_SIM_I2C_SPIN_US : 0;
+            
+            if (air_sim.now_us >= hang_us + 5000000ULL) {
+                hang_us += period_us;
+            }
+        }
+        
+        air_alg_result_t air_alg_result;
+        int err = air_poll_sample(&air_alg_result, &AIR_RETRY_DEFAULT, &retry);
+        if (err == AIR_OK) {
+            result->samples++;
+        } else {
+            wait_ms(AIR_BENCH_POLL_MS);
+        }
+    }
+    
+    result->expected_samples = (end_us - start_us) / AIR_SIM_DRIVE_MODE_PERIOD_US[(int)AIR_MODE_1_SECOND];
+    result->i2c = air_i2c_stats;
+}
+
+void air_bench_hang_print(int hang, const air_bench_hang_t *result, const char *sep) {
+    double recoveries = result->i2c.recoveries > 0 ? result->i2c.recoveries : 1;
+    
+    printf("    {\"scenario\": \"%s\", \"injected\": %d, \"expected_samples\": %d, \"samples\": %d, "
+           "\"lost_samples\": %d, \"timeouts\": %lu, \"recoveries\": %lu, \"recover_us_mean\": %.1f, "
+           "\"recover_us_max\": %llu, \"transaction_us_max\": %llu}%s\n",
+           AIR_BENCH_HANG_NAMES[hang], result->injected, result->expected_samples, result->samples,
+           result->expected_samples - result->samples, (unsigned long)result->i2c.timeouts,
+           (unsigned long)result->i2c.recoveries, result->i2c.recover_us / recoveries,
+           (unsigned long long)result->i2c.recover_max_us, (unsigned long long)result->i2c.transaction_max_us, sep);
+}
+
+/**
+ * Supervisor scenarios. Each runs drive mode 1 under air_supervise for
+ * AIR_BENCH_SUPERVISOR_SECONDS, injecting one kind of fault every
+ * AIR_BENCH_SUPERVISOR_FAULT_SECONDS: a sensor error lasting 5 s which clears
+ * itself, a hung application only a software reset clears, and a wedged MCU
+ * I2C peripheral only an MCU reset clears.
+ */
+const int AIR_BENCH_SUPERVISOR_SECONDS = 3600;
+const int AIR_BENCH_SUPERVISOR_FAULT_SECONDS = 300;
+
+const int AIR_BENCH_SUPERVISOR_ERROR = 0;
+const int AIR_BENCH_SUPERVISOR_HANG = 1;
+const int AIR_BENCH_SUPERVISOR_WEDGE = 2;
+const int AIR_BENCH_SUPERVISOR_FAULTS = 3;
+const char *AIR_BENCH_SUPERVISOR_NAMES[AIR_BENCH_SUPERVISOR_FAULTS] = { "sensor_error_5s", "app_hang", "i2c_wedged" };
+
+typedef struct {
+    int expected_samples;
+    int samples;
+    int injected;
+    air_supervisor_t supervisor;
+} air_bench_supervisor_t;
+
+void air_bench_supervisor_run(int fault, air_bench_supervisor_t *result) {
+    memset(result, 0, sizeof(air_bench_supervisor_t));
+    
+    air_sim_reset();
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    air_supervisor_start(&result->supervisor, &AIR_SUPERVISOR_DEFAULT, air_meas_mode);
+    
+    if (fault == AIR_BENCH_SUPERVISOR_ERROR) {
+        air_sim.fault_heater_period_us = AIR_BENCH_SUPERVISOR_FAULT_SECONDS * 1000000ULL;
+        air_sim.fault_heater_len_us = 5000000ULL;
+    }
+    
+    air_retry_stats_t retry;
+    memset(&retry, 0, sizeof(air_retry_stats_t));
+    
+    uint64_t start_us = air_sim.now_us;
+    uint64_t end_us = start_us + AIR_BENCH_SUPERVISOR_SECONDS * 1000000ULL;
+    uint64_t fault_us = start_us + AIR_BENCH_SUPERVISOR_FAULT_SECONDS * 1000000ULL / 2;
+    
+    while (air_sim.now_us < end_us) {
+        if (fault != AIR_BENCH_SUPERVISOR_ERROR && air_sim.now_us >= fault_us) {
+            if (fault == AIR_BENCH_SUPERVISOR_HANG) {
+                air_sim.fault_hang = 1;
+            } else {
+                air_sim.fault_i2c_wedged = 1;
+            }
+            
+            result->injected++;
+            fault_us += AIR_BENCH_SUPERVISOR_FAULT_SECONDS * 1000000ULL;
+        }
+        
+        air_alg_result_t air_alg_result;
+        int err = air_poll_sample(&air_alg_result, &AIR_RETRY_DEFAULT, &retry);
+        if (err == AIR_OK) {
+            result->samples++;
+        }
+        
+        air_supervise(&result->supervisor, &AIR_SUPERVISOR_DEFAULT, err);
+        
+        if (err != AIR_OK) {
+            wait_ms(AIR_BENCH_POLL_MS);
+        }
+    }
+    
+    if (fault == AIR_BENCH_SUPERVISOR_ERROR) {
+        result->injected = AIR_BENCH_SUPERVISOR_SECONDS / AIR_BENCH_SUPERVISOR_FAULT_SECONDS;
+    }
+    
+    result->expected_samples = (end_us - start_us) / AIR_SIM_DRIVE_MODE_PERIOD_US[(int)AIR_MODE_1_SECOND];
+}
+
+void air_bench_supervisor_print(int fault, const air_bench_supervisor_t *result, const char *sep) {
+    const air_supervisor_t *supervisor = &result->supervisor;
+    
+    printf("    {\"scenario\": \"%s\", \"injected\": %d, \"faults\": %lu, \"expected_samples\": %d, "
+           "\"samples\": %d, \"lost_samples\": %d, \"mcu_resets\": %d, \"levels\": [\n",
+           AIR_BENCH_SUPERVISOR_NAMES[fault], result->injected, (unsigned long)supervisor->faults,
+           result->expected_samples, result->samples, result->expected_samples - result->samples,
+           air_sim.mcu_resets);
+    
+    for (int i = AIR_SUPERVISOR_ERROR_ID; i < AIR_SUPERVISOR_LEVELS; i++) {
+        const air_supervisor_level_t *level = &supervisor->levels[i];
+        double recoveries = level->recoveries > 0 ? level->recoveries : 1;
+        
+        printf("      {\"level\": \"%s\", \"attempts\": %lu, \"recoveries\": %lu, "
+               "\"recover_ms_mean\": %.1f, \"recover_ms_max\": %.1f}%s\n",
+               AIR_SUPERVISOR_LEVEL_NAMES[i], (unsigned long)level->attempts, (unsigned long)level->recoveries,
+               level->recover_us / recoveries / 1000, level->recover_max_us / 1000.0,
+               i == AIR_SUPERVISOR_LEVELS - 1 ? "" : ",");
+    }
+    
+    printf("    ]}%s\n", sep);
+}
+
+/**
+ * Hot plug run. The sensor is plugged in AIR_BENCH_PLUG_FIRST_SECONDS after
+ * start, then unplugged for AIR_BENCH_UNPLUG_SECONDS every
+ * AIR_BENCH_PLUG_PERIOD_SECONDS, coming back at the other address each
+ * time. Polls drive mode 1 under air_supervise for AIR_BENCH_PLUG_SECONDS.
+ */
+const int AIR_BENCH_PLUG_SECONDS = 3600;
+const int AIR_BENCH_PLUG_FIRST_SECONDS = 30;
+const int AIR_BENCH_PLUG_PERIOD_SECONDS = 600;
+const int AIR_BENCH_UNPLUG_SECONDS = 60;
+
+typedef struct {
+    int plugs;
+    int unplugs;
+    int samples;
+    
+    /**
+     * Samples due while a sensor was plugged in.
+     */
+    int expected_samples;
+    
+    /**
+     * Unplugging to removal reported, plugging in to the first sample.
+     */
+    uint64_t detect_us;
+    uint64_t detect_max_us;
+    uint64_t setup_us;
+    uint64_t setup_max_us;
+    
+    uint64_t transactions_absent;
+    uint64_t absent_us;
+    
+    air_supervisor_t supervisor;
+} air_bench_plug_t;
+
+void air_bench_plug_run(air_bench_plug_t *result) {
+    memset(result, 0, sizeof(air_bench_plug_t));
+    
+    air_sim_reset();
+    air_sim_plug(0);
+    air_info_valid = 0;
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    air_addr = AIR_ADDR;
+    
+    air_supervisor_start(&result->supervisor, &AIR_SUPERVISOR_DEFAULT,
+                         air_mode_drive_mode_t::set(AIR_MODE_RESET_VALUE, AIR_MODE_1_SECOND));
+    
+    air_retry_stats_t retry;
+    memset(&retry, 0, sizeof(air_retry_stats_t));
+    
+    uint64_t start_us = air_sim.now_us;
+    uint64_t end_us = start_us + AIR_BENCH_PLUG_SECONDS * 1000000ULL;
+    uint64_t plug_us = start_us + AIR_BENCH_PLUG_FIRST_SECONDS * 1000000ULL;
+    uint64_t unplug_us = start_us + AIR_BENCH_PLUG_PERIOD_SECONDS * 1000000ULL / 2;
+    
+    // Virtual time of the last plug and unplug still waiting to be noticed
+    uint64_t plugged_us = 0;
+    uint64_t unplugged_us = start_us;
+    bool plugged = false;
+    bool waiting_sample = false;
+    bool waiting_removal = false;
+    int addr = 0x5A;
+    
+    uint64_t transactions_unplugged = air_sim.stat_transactions;
+    
+    while (air_sim.now_us < end_us) {
+        if (!plugged && air_sim.now_us >= plug_us) {
+            result->absent_us += air_sim.now_us - unplugged_us;
+            result->transactions_absent += air_sim.stat_transactions - transactions_unplugged;
+            
+            air_sim_plug(addr);
+            addr = addr == 0x5A ? 0x5B : 0x5A;
+            plugged = true;
+            plugged_us = air_sim.now_us;
+            waiting_sample = true;
+            result->plugs++;
+        } else if (plugged && air_sim.now_us >= unplug_us) {
+            result->expected_samples += (air_sim.now_us - plugged_us) / AIR_SIM_DRIVE_MODE_PERIOD_US[(int)AIR_MODE_1_SECOND];
+            
+            air_sim_plug(0);
+            plugged = false;
+            unplugged_us = air_sim.now_us;
+            transactions_unplugged = air_sim.stat_transactions;
+            waiting_removal = true;
+            result->unplugs++;
+            
+            plug_us = unplug_us + AIR_BENCH_UNPLUG_SECONDS * 1000000ULL;
+            unplug_us += AIR_BENCH_PLUG_PERIOD_SECONDS * 1000000ULL;
+        }
+        
+        int err = AIR_ERR_ABSENT;
+        if (result->supervisor.present) {
+            air_alg_result_t air_alg_result;
+            err = air_poll_sample(&air_alg_result, &AIR_RETRY_DEFAULT, &retry);
+        }
+        
+        if (err == AIR_OK) {
+            result->samples++;
+            
+            if (waiting_sample) {
+                uint64_t setup_us = air_sim.now_us - plugged_us;
+                result->setup_us += setup_us;
+                if (setup_us > result->setup_max_us) {
+                    result->setup_max_us = setup_us;
+                }
+                waiting_sample = false;
+            }
+        }
+        
+        int action = air_supervise(&result->supervisor, &AIR_SUPERVISOR_DEFAULT, err);
+        if (action == AIR_SUPERVISOR_REMOVED && waiting_removal) {
+            uint64_t detect_us = air_sim.now_us - unplugged_us;
+            result->detect_us += detect_us;
+            if (detect_us > result->detect_max_us) {
+                result->detect_max_us = detect_us;
+            }
+            waiting_removal = false;
+        }
+        
+        if (err != AIR_OK) {
+            wait_ms(AIR_BENCH_POLL_MS);
+        }
+    }
+    
+    if (plugged) {
+        result->expected_samples += (end_us - plugged_us) / AIR_SIM_DRIVE_MODE_PERIOD_US[(int)AIR_MODE_1_SECOND];
+    }
+    
+    // Later runs use a sensor at the default address
+    air_addr = AIR_ADDR;
+}
+
+void air_bench_plug_print(const air_bench_plug_t *result) {
+    const air_supervisor_t *supervisor = &result->supervisor;
+    double plugs = result->plugs > 0 ? result->plugs : 1;
+    double unplugs = result->unplugs > 0 ? result->unplugs : 1;
+    
+    uint32_t attempts = 0;
+    for (int i = AIR_SUPERVISOR_ERROR_ID; i < AIR_SUPERVISOR_LEVELS; i++) {
+        attempts += supervisor->levels[i].attempts;
+    }
+    
+    printf("  \"hotplug\": {\"seconds\": %d, \"plugs\": %d, \"unplugs\": %d, \"appearances\": %lu, "
+           "\"removals\": %lu, \"expected_samples\": %d, \"samples\": %d, \"lost_samples\": %d, "
+           "\"detect_ms_mean\": %.1f, \"detect_ms_max\": %.1f, \"setup_ms_mean\": %.1f, \"setup_ms_max\": %.1f, "
+           "\"probe_transactions_per_s_absent\": %.2f, \"recovery_attempts\": %lu, \"mcu_resets\": %d}",
+           AIR_BENCH_PLUG_SECONDS, result->plugs, result->unplugs, (unsigned long)supervisor->appearances,
+           (unsigned long)supervisor->removals, result->expected_samples, result->samples,
+           result->expected_samples - result->samples,
+           result->detect_us / unplugs / 1000, result->detect_max_us / 1000.0,
+           result->setup_us / plugs / 1000, result->setup_max_us / 1000.0,
+           result->absent_us > 0 ? result->transactions_absent * 1e6 / result->absent_us : 0.0,
+           (unsigned long)attempts, air_sim.mcu_resets);
+}
+
+/**
+ * Restart runs. The sensor is set up and run in drive mode 1 for
+ * AIR_BENCH_RESTART_SECONDS, long enough for a baseline to be retained, then
+ * the MCU is reset and started again as main does until the first sample:
+ * with retained RAM lost to a power cycle, with it intact, and with it intact
+ * but the sensor restarted too, as by a brown out. The last warm run orders
+ * each sample as AIR_RTOS does, the acquisition thread saving the sensor
+ * state before the main thread filters the report, and resets between the
+ * filter and the next sample.
+ */
+const int AIR_BENCH_RESTART_SECONDS = 1500;
+
+const int AIR_BENCH_RESTART_COLD = 0;
+const int AIR_BENCH_RESTART_WARM = 1;
+const int AIR_BENCH_RESTART_SENSOR_RESET = 2;
+const int AIR_BENCH_RESTART_RTOS_WARM = 3;
+const int AIR_BENCH_RESTARTS = 4;
+const char *AIR_BENCH_RESTART_NAMES[AIR_BENCH_RESTARTS] = { "cold", "warm", "sensor_reset", "rtos_warm" };
+
+typedef struct {
+    bool resumed;
+    
+    /**
+     * From the reset to the sensor being set up, and to the first sample.
+     */
+    uint64_t setup_transactions;
+    uint64_t first_sample_us;
+    
+    /**
+     * If the first sample after the reset was reported again.
+     */
+    bool first_reported;
+    
+    bool baseline_restored;
+} air_bench_restart_t;
+
+/**
+ * Poll for a sample and pass it through the retained report filter, as main
+ * does, in the AIR_RTOS order if rtos.
+ * Returns: If it was reported
+ */
+bool air_bench_restart_sample(bool rtos) {
+    air_retry_stats_t retry;
+    memset(&retry, 0, sizeof(air_retry_stats_t));
+    
+    air_sample_t sample;
+    while (air_poll_sample(&sample.result, &AIR_RETRY_DEFAULT, &retry) != AIR_OK) {
+        wait_ms(AIR_BENCH_POLL_MS);
+    }
+    
+    sample.timestamp_us = air_now_us();
+    sample.seq = air_retained.report.stats.samples;
+    
+    if (rtos) {
+        air_retain_sample();
+        return air_retain_report(&sample);
+    }
+    
+    bool reported = air_report_filter(&air_retained.report, &AIR_REPORT_DEFAULT, &sample);
+    air_retain_sample();
+    
+    return reported;
+}
+
+/**
+ * Set the sensor up after an MCU reset as main does, less the firmware update.
+ * Returns: If it was resumed
+ */
+bool air_bench_restart_start(char meas_mode) {
+    bool resumed = air_retain_load() && air_try_resume() == AIR_OK;
+    
+    if (!resumed && air_probe() == AIR_OK) {
+        air_boot();
+        air_write_meas_mode(meas_mode);
+        air_retain_started();
+    }
+    air_retain_save();
+    
+    return resumed;
+}
+
+void air_bench_restart_run(int restart, air_bench_restart_t *result) {
+    memset(result, 0, sizeof(air_bench_restart_t));
+    
+    air_sim_reset();
+    air_info_valid = 0;
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    air_addr = AIR_ADDR;
+    memset(&air_retained, 0, sizeof(air_retained_t));
+    
+    const char meas_mode = air_mode_drive_mode_t::set(AIR_MODE_RESET_VALUE, AIR_MODE_1_SECOND);
+    air_bench_restart_start(meas_mode);
+    
+    bool rtos = restart == AIR_BENCH_RESTART_RTOS_WARM;
+    uint64_t end_us = air_sim.now_us + AIR_BENCH_RESTART_SECONDS * 1000000ULL;
+    while (air_sim.now_us < end_us) {
+        air_bench_restart_sample(rtos);
+    }
+    
+    air_watchdog_reset();
+    if (restart == AIR_BENCH_RESTART_COLD) {
+        // RAM holds anything after power up
+        memset(&air_retained, 0xA5, sizeof(air_retained_t));
+    } else if (restart == AIR_BENCH_RESTART_SENSOR_RESET) {
+        air_sim_plug(air_sim.addr);
+    }
+    
+    uint64_t reset_us = air_sim.now_us;
+    uint64_t transactions = air_sim.stat_transactions;
+    
+    result->resumed = air_bench_restart_start(meas_mode);
+    result->setup_transactions = air_sim.stat_transactions - transactions;
+    result->first_reported = air_bench_restart_sample(rtos);
+    result->first_sample_us = air_sim.now_us - reset_us;
+    result->baseline_restored = air_sim.baseline_us >= reset_us;
+    
+    // Later runs start cold
+    memset(&air_retained, 0, sizeof(air_retained_t));
+}
+
+void air_bench_restart_print(int restart, const air_bench_restart_t *result, const char *sep) {
+    printf("    {\"scenario\": \"%s\", \"resumed\": %s, \"setup_transactions\": %llu, \"first_sample_ms\": %.1f, "
+           "\"first_reported\": %s, \"baseline_restored\": %s}%s\n",
+           AIR_BENCH_RESTART_NAMES[restart], result->resumed ? "true" : "false",
+           (unsigned long long)result->setup_transactions, result->first_sample_us / 1000.0,
+           result->first_reported ? "true" : "false", result->baseline_restored ? "true" : "false", sep);
+}
+
+/**
+ * Firmware update run. A generated AIR_BENCH_FW_IMAGE_LEN byte image, not a
+ * whole number of chunks, is streamed from memory through air_fw_update onto
+ * a sensor running its application. The source hands out at most
+ * AIR_BENCH_FW_READ_MAX bytes per call, so chunks are put together from
+ * several reads. The simulated bootloader drops commands written while it is
+ * busy, so the run fails if any chunk is written inside the 50 ms after the
+ * previous one, or if the programmed flash differs from the image.
+ */
+const int AIR_BENCH_FW_IMAGE_LEN = 5117;
+const int AIR_BENCH_FW_READ_MAX = 3;
+
+char air_bench_fw_image[AIR_BENCH_FW_IMAGE_LEN];
+
+typedef struct {
+    const char *data;
+    int len;
+    int offset;
+} air_bench_fw_source_t;
+
+/**
+ * air_fw_read_t over an air_bench_fw_source_t, passed as ctx.
+ */
+int air_bench_fw_read(void *ctx, char *buf, int len) {
+    air_bench_fw_source_t *source = (air_bench_fw_source_t *)ctx;
+    
+    int n = source->len - source->offset;
+    if (n > len) {
+        n = len;
+    }
+    if (n > AIR_BENCH_FW_READ_MAX) {
+        n = AIR_BENCH_FW_READ_MAX;
+    }
+    
+    memcpy(buf, &source->data[source->offset], n);
+    source->offset += n;
+    
+    return n;
+}
+
+typedef struct {
+    air_fw_update_stats_t stats;
+    int expected_chunks;
+    
+    /**
+     * Bytes the bootloader programmed, and commands it dropped as busy.
+     */
+    int programmed_bytes;
+    int busy_writes;
+    
+    /**
+     * If the programmed flash holds the image padded with 0xFF.
+     */
+    bool data_match;
+    
+    bool app_valid;
+    bool booted;
+} air_bench_fw_t;
+
+void air_bench_fw_run(air_bench_fw_t *result) {
+    memset(result, 0, sizeof(air_bench_fw_t));
+    
+    air_sim_reset();
+    air_info_valid = 0;
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    air_addr = AIR_ADDR;
+    
+    for (int i = 0; i < AIR_BENCH_FW_IMAGE_LEN; i++) {
+        air_bench_fw_image[i] = (char)(air_sim_rand() * 256);
+    }
+    
+    // Update from a running application, as main() finds the sensor
+    air_boot();
+    
+    air_bench_fw_source_t source = { air_bench_fw_image, AIR_BENCH_FW_IMAGE_LEN, 0 };
+    air_fw_update(air_bench_fw_read, &source, &result->stats);
+    
+    result->expected_chunks = (AIR_BENCH_FW_IMAGE_LEN + AIR_BOOT_APP_DATA_LEN - 1) / AIR_BOOT_APP_DATA_LEN;
+    result->programmed_bytes = air_sim.app_bytes;
+    result->busy_writes = air_sim.boot_busy_writes;
+    
+    result->data_match = air_sim.app_bytes == result->expected_chunks * AIR_BOOT_APP_DATA_LEN &&
+                         memcmp(air_sim.app, air_bench_fw_image, AIR_BENCH_FW_IMAGE_LEN) == 0;
+    for (int i = AIR_BENCH_FW_IMAGE_LEN; result->data_match && i < air_sim.app_bytes; i++) {
+        result->data_match = air_sim.app[i] == (char)0xFF;
+    }
+    
+    air_status_t air_status;
+    air_read_status(&air_status);
+    result->app_valid = air_status.app_valid;
+    result->booted = air_try_boot() == AIR_OK && air_sim.fw_mode == AIR_STATUS_FW_MODE_APP;
+    
+    if (result->stats.chunks != result->expected_chunks ||
+        result->stats.bytes != result->expected_chunks * AIR_BOOT_APP_DATA_LEN) {
+        die("air: bench: fw_update: wrote %d chunks, %d bytes, expected %d chunks", result->stats.chunks,
+            result->stats.bytes, result->expected_chunks);
+    }
+    if (result->busy_writes != 0) {
+        die("air: bench: fw_update: %d commands written while the bootloader was busy", result->busy_writes);
+    }
+    if (!result->data_match || !result->app_valid || !result->booted) {
+        die("air: bench: fw_update: programmed image does not match or does not start");
+    }
+}
+
+void air_bench_fw_print(const air_bench_fw_t *result) {
+    printf("  \"fw_update\": {\"image_bytes\": %d, \"chunks\": %d, \"expected_chunks\": %d, \"bytes\": %d, "
+           "\"programmed_bytes\": %d, \"busy_writes\": %d, \"data_match\": %s, \"app_valid\": %s, "
+           "\"booted\": %s, \"erase_ms\": %d, \"data_ms\": %d, \"verify_ms\": %d, \"total_ms\": %d}",
+           AIR_BENCH_FW_IMAGE_LEN, result->stats.chunks, result->expected_chunks, result->stats.bytes,
+           result->programmed_bytes, result->busy_writes, result->data_match ? "true" : "false",
+           result->app_valid ? "true" : "false", result->booted ? "true" : "false", result->stats.erase_ms,
+           result->stats.data_ms, result->stats.verify_ms, result->stats.total_ms);
+}
+
+/**
+ * Cache run. Without acquisition, requests ask air_cache_read for a sample no
+ * older than AIR_BENCH_CACHE_MAX_AGE_MS every AIR_BENCH_CACHE_REQUEST_MS from
+ * just after the sensor is set up in drive mode 1. The run fails if a request
+ * gets a sample before the sensor made one, or the same sample number twice
+ * from the bus.
+ */
+const int AIR_BENCH_CACHE_SECONDS = 600;
+const int AIR_BENCH_CACHE_REQUEST_MS = 300;
+const uint32_t AIR_BENCH_CACHE_MAX_AGE_MS = 2000;
+
+typedef struct {
+    air_cache_stats_t stats;
+    
+    /**
+     * Requests made before the sensor had a sample, and samples it made.
+     */
+    int not_ready;
+    uint64_t sensor_samples;
+} air_bench_cache_t;
+
+void air_bench_cache_run(air_bench_cache_t *result) {
+    memset(result, 0, sizeof(air_bench_cache_t));
+    
+    air_sim_reset();
+    air_info_valid = 0;
+    air_meas_mode = AIR_MODE_RESET_VALUE;
+    air_addr = AIR_ADDR;
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    
+    memset(&air_cache_stats, 0, sizeof(air_cache_stats_t));
+    air_cache_valid = false;
+    
+    uint32_t next_seq = 0;
+    uint64_t end_us = air_sim.now_us + AIR_BENCH_CACHE_SECONDS * 1000000ULL;
+    while (air_sim.now_us < end_us) {
+        uint32_t misses = air_cache_stats.misses;
+        
+        air_sample_t sample;
+        int err = air_cache_read(&sample, AIR_BENCH_CACHE_MAX_AGE_MS);
+        if (err == AIR_ERR_NOT_READY && air_sim.samples == 0) {
+            result->not_ready++;
+        } else if (err != AIR_OK) {
+            die("air: bench: cache: request failed with %d", err);
+        } else if (air_cache_stats.misses != misses && sample.seq != next_seq++) {
+            die("air: bench: cache: read sample %lu twice", (unsigned long)sample.seq);
+        }
+        
+        wait_ms(AIR_BENCH_CACHE_REQUEST_MS);
+    }
+    
+    result->stats = air_cache_stats;
+    result->sensor_samples = air_sim.samples;
+}
+
+void air_bench_cache_print(const air_bench_cache_t *result) {
+    printf("  \"cache\": {\"seconds\": %d, \"request_ms\": %d, \"max_age_ms\": %lu, \"hits\": %lu, "
+           "\"misses\": %lu, \"shared\": %lu, \"errors\": %lu, \"not_ready\": %d, \"sensor_samples\": %llu}",
+           AIR_BENCH_CACHE_SECONDS, AIR_BENCH_CACHE_REQUEST_MS, (unsigned long)AIR_BENCH_CACHE_MAX_AGE_MS,
+           (unsigned long)result->stats.hits, (unsigned long)result->stats.misses,
+           (unsigned long)result->stats.shared, (unsigned long)result->stats.errors, result->not_ready,
+           (unsigned long long)result->sensor_samples);
+}
+
+/**
+ * Pipeline runs. One product configuration, the range filter then the mean
+ * of every AIR_BENCH_PIPELINE_WINDOW samples into a sink, is put together at
+ * compile time as an air_pipeline_t and at run time from an
+ * air_bench_rt_config_t, with every stage branching on the configuration and
+ * the source and sink called through pointers, as a runtime configured build
+ * would. Both are fed the same recorded samples from memory, so only the
+ * pipeline is timed. The step functions are kept out of line so their code
+ * size can be read with nm.
+ */
+const int AIR_BENCH_PIPELINE_STEPS = 20000000;
+const int AIR_BENCH_PIPELINE_WINDOW = 10;
+const int AIR_BENCH_PIPELINE_RECORDED = 1024;
+
+air_sample_t air_bench_pipeline_recorded[AIR_BENCH_PIPELINE_RECORDED];
+
+uint32_t air_bench_pipeline_outputs;
+uint64_t air_bench_pipeline_sum;
+
+void air_bench_pipeline_sink(const air_sample_t *sample) {
+    air_bench_pipeline_outputs++;
+    air_bench_pipeline_sum += sample->result.eco2 + sample->result.tvoc;
+}
+
+/**
+ * Source replaying air_bench_pipeline_recorded.
+ */
+class air_bench_replay_source_t {
+public:
+    air_bench_replay_source_t() : next(0) {}
+    
+    int read(air_sample_t *sample) {
+        *sample = air_bench_pipeline_recorded[next++ % AIR_BENCH_PIPELINE_RECORDED];
+        return AIR_OK;
+    }
+
+private:
+    uint32_t next;
+};
+
+typedef air_pipeline_t<air_bench_replay_source_t,
+                       air_filter_range_t,
+                       air_aggregate_mean_t<AIR_BENCH_PIPELINE_WINDOW>,
+                       air_sink_call_t<air_bench_pipeline_sink> > air_bench_static_pipeline_t;
+
+/**
+ * Runtime pipeline configuration, a superset of the compile-time stages.
+ */
+typedef struct {
+    int (*read)(void *ctx, air_sample_t *sample);
+    void *ctx;
+    
+    bool range_filter;
+    bool deadband_filter;
+    air_report_policy_t deadband;
+    
+    /**
+     * Samples averaged per output, 1 for none.
+     */
+    int window;
+    
+    void (*sink)(const air_sample_t *sample);
+} air_bench_rt_config_t;
+
+typedef struct {
+    const air_bench_rt_config_t *config;
+    air_report_t report;
+    uint32_t range_dropped;
+    int count;
+    uint32_t eco2_sum;
+    uint32_t tvoc_sum;
+} air_bench_rt_pipeline_t;
+
+int air_bench_replay_read(void *ctx, air_sample_t *sample) {
+    return ((air_bench_replay_source_t *)ctx)->read(sample);
+}
+
+__attribute__((noinline, noclone))
+int air_bench_rt_step(air_bench_rt_pipeline_t *pipeline) {
+    const air_bench_rt_config_t *config = pipeline->config;
+    air_sample_t sample;
+    
+    int err = config->read(config->ctx, &sample);
+    if (err != AIR_OK) {
+        return err;
+    }
+    
+    if (config->range_filter &&
+        (sample.result.eco2 < 400 || sample.result.eco2 > 8192 || sample.result.tvoc > 1187)) {
+        pipeline->range_dropped++;
+        return AIR_OK;
+    }
+    
+    if (config->deadband_filter && !air_report_filter(&pipeline->report, &config->deadband, &sample)) {
+        return AIR_OK;
+    }
+    
+    if (config->window > 1) {
+        pipeline->eco2_sum += sample.result.eco2;
+        pipeline->tvoc_sum += sample.result.tvoc;
+    
+        if (++pipeline->count < config->window) {
+            return AIR_OK;
+        }
+    
+        sample.result.eco2 = (pipeline->eco2_sum + config->window / 2) / config->window;
+        sample.result.tvoc = (pipeline->tvoc_sum + config->window / 2) / config->window;
+    
+        pipeline->count = 0;
+        pipeline->eco2_sum = 0;
+        pipeline->tvoc_sum = 0;
+    }
+    
+    config->sink(&sample);
+    
+    return AIR_OK;
+}
+
+__attribute__((noinline, noclone))
+int air_bench_static_step(air_bench_static_pipeline_t *pipeline) {
+    return pipeline->step();
+}
+
+/**
+ * The product pipeline of the air_pipeline_t documentation, against the
+ * sensor, only built for its code size.
+ */
+typedef air_pipeline_t<air_source_t<AIR_MODE_1_SECOND, true>,
+                       air_filter_chain_t<air_filter_range_t, air_filter_deadband_t<10, 2, 60000> >,
+                       air_aggregate_none_t,
+                       air_sink_tee_t<air_sink_out_t, air_sink_history_t> > air_bench_product_pipeline_t;
+
+__attribute__((noinline, noclone))
+int air_bench_product_step(air_bench_product_pipeline_t *pipeline) {
+    return pipeline->step();
+}
+
+typedef struct {
+    double ns_per_step;
+    uint32_t outputs;
+    uint64_t sum;
+} air_bench_pipeline_t;
+
+void air_bench_pipeline_run(bool runtime, air_bench_pipeline_t *result) {
+    // Recorded samples, one in 64 out of range
+    for (int i = 0; i < AIR_BENCH_PIPELINE_RECORDED; i++) {
+        air_sample_t *sample = &air_bench_pipeline_recorded[i];
+        sample->result.eco2 = i % 64 == 0 ? 0 : air_sim_default_eco2(i * 1000000ULL);
+        sample->result.tvoc = air_sim_default_tvoc(i * 1000000ULL);
+        sample->timestamp_us = i * 1000000ULL;
+        sample->seq = i;
+    }
+    
+    air_bench_pipeline_outputs = 0;
+    air_bench_pipeline_sum = 0;
+    
+    uint64_t cpu_start_ns = air_bench_cpu_ns();
+    
+    if (runtime) {
+        air_bench_replay_source_t source;
+        air_bench_rt_config_t config = {
+            air_bench_replay_read, &source, true, false, AIR_REPORT_DEFAULT, AIR_BENCH_PIPELINE_WINDOW,
+            air_bench_pipeline_sink,
+        };
     
-    char buf[2] = {
-        AIR_MODE_REG,
-        write_measurement_mode,
-    };
+        air_bench_rt_pipeline_t pipeline;
+        memset(&pipeline, 0, sizeof(air_bench_rt_pipeline_t));
+        pipeline.config = &config;
+    
+        for (int i = 0; i < AIR_BENCH_PIPELINE_STEPS; i++) {
+            air_bench_rt_step(&pipeline);
+        }
+    } else {
+        air_bench_static_pipeline_t pipeline;
+    
+        for (int i = 0; i < AIR_BENCH_PIPELINE_STEPS; i++) {
+            air_bench_static_step(&pipeline);
+        }
+    }
     
-    if (i2c.write(AIR_ADDR, buf, 2) != 0) {
-        die("air: write_mode: failed to write mode %d", drive_mode);
+    result->ns_per_step = (double)(air_bench_cpu_ns() - cpu_start_ns) / AIR_BENCH_PIPELINE_STEPS;
+    result->outputs = air_bench_pipeline_outputs;
+    result->sum = air_bench_pipeline_sum;
+}
+
+void air_bench_pipeline_print() {
+    air_bench_pipeline_t results[2];
+    air_bench_pipeline_run(false, &results[0]);
+    air_bench_pipeline_run(true, &results[1]);
+    
+    printf("  \"pipeline\": {\"steps\": %d, \"window\": %d, \"compile_time_ns_per_step\": %.2f, "
+           "\"runtime_ns_per_step\": %.2f, \"compile_time_bytes\": %d, \"runtime_bytes\": %d, "
+           "\"outputs\": %lu, \"outputs_match\": %s}",
+           AIR_BENCH_PIPELINE_STEPS, AIR_BENCH_PIPELINE_WINDOW, results[0].ns_per_step, results[1].ns_per_step,
+           (int)sizeof(air_bench_static_pipeline_t),
+           (int)(sizeof(air_bench_rt_pipeline_t) + sizeof(air_bench_rt_config_t)),
+           (unsigned long)results[0].outputs,
+           results[0].outputs == results[1].outputs && results[0].sum == results[1].sum ? "true" : "false");
+    
+    // Keep the product pipeline built
+    if (results[0].outputs == 0) {
+        air_bench_product_pipeline_t product;
+        air_bench_product_step(&product);
     }
 }
 
 /**
- * Air sensor algorithm result data.
+ * Latest sample contention benchmark.
+ *
+ * One writer publishes samples back to back while reader threads snapshot the
+ * latest sample for AIR_BENCH_LATEST_MS of wall time, once through air_latest_t
+ * and once through a mutex guarded copy. Samples carry redundant fields so
+ * readers can count torn snapshots.
+ */
+const int AIR_BENCH_LATEST_MS = 200;
+const int AIR_BENCH_LATEST_READERS[] = { 1, 2, 4, 8 };
+const int AIR_BENCH_LATEST_READER_COUNTS = sizeof(AIR_BENCH_LATEST_READERS) / sizeof(AIR_BENCH_LATEST_READERS[0]);
+
+const int AIR_BENCH_LATEST_SEQLOCK = 0;
+const int AIR_BENCH_LATEST_MUTEX = 1;
+const char *AIR_BENCH_LATEST_NAMES[2] = { "seqlock", "mutex" };
+
+typedef struct {
+    int method;
+    int readers;
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t torn;
+    uint32_t retries;
+} air_bench_latest_t;
+
+void air_bench_latest_sample(uint32_t seq, air_sample_t *sample) {
+    sample->seq = seq;
+    sample->result.eco2 = (uint16_t)seq;
+    sample->result.tvoc = (uint16_t)~seq;
+    sample->timestamp_us = (uint64_t)seq * 1000;
+}
+
+bool air_bench_latest_consistent(const air_sample_t *sample) {
+    return sample->result.eco2 == (uint16_t)sample->seq &&
+           sample->result.tvoc == (uint16_t)~sample->seq &&
+           sample->timestamp_us == (uint64_t)sample->seq * 1000;
+}
+
+void air_bench_latest_run(int method, int readers, air_bench_latest_t *result) {
+    air_latest_t latest;
+    std::mutex lock;
+    air_sample_t guarded;
+    air_bench_latest_sample(0, &guarded);
+    
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint64_t> torn(0);
+    uint64_t writes = 0;
+    
+    std::thread writer([&]() {
+        air_sample_t sample;
+        
+        for (uint32_t seq = 1; !stop.load(std::memory_order_relaxed); seq++) {
+            air_bench_latest_sample(seq, &sample);
+            
+            if (method == AIR_BENCH_LATEST_SEQLOCK) {
+                latest.publish(&sample);
+            } else {
+                std::lock_guard<std::mutex> guard(lock);
+                guarded = sample;
+            }
+            
+            writes++;
+        }
+    });
+    
+    std::thread *threads[8];
+    for (int i = 0; i < readers; i++) {
+        threads[i] = new std::thread([&]() {
+            air_sample_t sample;
+            uint64_t n = 0;
+            uint64_t bad = 0;
+            
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (method == AIR_BENCH_LATEST_SEQLOCK) {
+                    if (!latest.read(&sample)) {
+                        continue;
+                    }
+                } else {
+                    std::lock_guard<std::mutex> guard(lock);
+                    sample = guarded;
+                }
+                
+                n++;
+                if (!air_bench_latest_consistent(&sample)) {
+                    bad++;
+                }
+            }
+            
+            reads += n;
+            torn += bad;
+        });
+    }
+    
+    std::this_thread::sleep_for(std::chrono::milliseconds(AIR_BENCH_LATEST_MS));
+    stop = true;
+    
+    writer.join();
+    for (int i = 0; i < readers; i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    
+    result->method = method;
+    result->readers = readers;
+    result->writes = writes;
+    result->reads = reads;
+    result->torn = torn;
+    result->retries = latest.read_retries();
+}
+
+void air_bench_latest_print(const air_bench_latest_t *result, const char *sep) {
+    double seconds = AIR_BENCH_LATEST_MS / 1000.0;
+    double reads = result->reads > 0 ? result->reads : 1;
+    
+    printf("    {\"method\": \"%s\", \"readers\": %d, \"writes_per_sec\": %.0f, "
+           "\"reads_per_sec\": %.0f, \"reads_per_sec_per_reader\": %.0f, "
+           "\"retries_per_read\": %.4f, \"torn_reads\": %llu}%s\n",
+           AIR_BENCH_LATEST_NAMES[result->method], result->readers, result->writes / seconds,
+           result->reads / seconds, result->reads / seconds / result->readers,
+           result->retries / reads, (unsigned long long)result->torn, sep);
+}
+
+/**
+ * History benchmark.
+ *
+ * Appends AIR_BENCH_HISTORY_SECONDS of 1 Hz samples read on nINT from the
+ * simulator, once with its default smooth waveforms and once with sensor like
+ * noise on top. Checks every retained sample reads back and reports bytes per
+ * sample and the span that fits.
  */
+const int AIR_BENCH_HISTORY_SECONDS = 86400;
+
+uint16_t air_bench_noisy_eco2(uint64_t now_us) {
+    return air_sim_default_eco2(now_us) + (int)(air_sim_rand() * 7) - 3;
+}
+
+uint16_t air_bench_noisy_tvoc(uint64_t now_us) {
+    return air_sim_default_tvoc(now_us) + (int)(air_sim_rand() * 3) - 1;
+}
+
+typedef struct {
+    const char *name;
+    air_sim_waveform_t eco2;
+    air_sim_waveform_t tvoc;
+} air_bench_waveform_t;
+
+const air_bench_waveform_t AIR_BENCH_WAVEFORMS[] = {
+    { "smooth", air_sim_default_eco2, air_sim_default_tvoc },
+    { "noisy", air_bench_noisy_eco2, air_bench_noisy_tvoc },
+};
+const int AIR_BENCH_WAVEFORM_COUNT = sizeof(AIR_BENCH_WAVEFORMS) / sizeof(AIR_BENCH_WAVEFORMS[0]);
+
 typedef struct {
+    uint32_t appended;
+    air_history_stats_t stats;
+    
     /**
-     * Equivalent calculated carbon-dioxide (eCO2) in ppm from 400 to 8192.
+     * Retained samples which did not read back as appended.
      */
-    uint16_t eco2;
+    uint32_t mismatches;
+    
+    uint64_t append_ns;
+    uint64_t read_ns;
+} air_bench_history_t;
+
+void air_bench_history_run(const air_bench_waveform_t *waveform, air_bench_history_t *result) {
+    memset(result, 0, sizeof(air_bench_history_t));
+    
+    air_sim_reset();
+    air_sim.eco2_waveform = waveform->eco2;
+    air_sim.tvoc_waveform = waveform->tvoc;
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    air_write_interrupt(true, 0);
+    
+    air_history_clear();
+    
+    air_sample_t *samples = (air_sample_t *)malloc(AIR_BENCH_HISTORY_SECONDS * sizeof(air_sample_t));
+    
+    for (int i = 0; i < AIR_BENCH_HISTORY_SECONDS; i++) {
+        if (air_sim_wait_nint() != 0) {
+            die("air: bench: nINT never asserted");
+        }
+        
+        air_read_alg_result(&samples[i].result);
+        samples[i].timestamp_us = air_now_us();
+        samples[i].seq = i;
+        
+        uint64_t start_ns = air_bench_cpu_ns();
+        air_history_append(&samples[i]);
+        result->append_ns += air_bench_cpu_ns() - start_ns;
+    }
+    
+    result->appended = AIR_BENCH_HISTORY_SECONDS;
+    air_history_stats(&result->stats);
+    
+    uint64_t start_ns = air_bench_cpu_ns();
+    
+    air_history_iter_t iter;
+    air_sample_t sample;
+    uint32_t expected = result->stats.evicted;
+    
+    air_history_begin(&iter, 0, UINT64_MAX);
+    while (air_history_next(&iter, &sample)) {
+        const air_sample_t *appended = &samples[expected++];
+        
+        if (sample.seq != appended->seq || sample.result.eco2 != appended->result.eco2 ||
+            sample.result.tvoc != appended->result.tvoc || appended->timestamp_us - sample.timestamp_us >= 1000) {
+            result->mismatches++;
+        }
+    }
+    
+    result->read_ns = air_bench_cpu_ns() - start_ns;
+    result->mismatches += AIR_BENCH_HISTORY_SECONDS - expected;
+    
+    free(samples);
+}
+
+void air_bench_history_print(const air_bench_waveform_t *waveform, const air_bench_history_t *result, const char *sep) {
+    const air_history_stats_t *stats = &result->stats;
+    double n = stats->samples > 0 ? stats->samples : 1;
+    
+    printf("    {\"waveform\": \"%s\", \"appended\": %lu, \"retained\": %lu, \"retained_hours\": %.2f, "
+           "\"ram_bytes\": %d, \"bytes\": %lu, \"bytes_per_sample\": %.3f, \"raw_bytes_per_sample\": %d, "
+           "\"append_ns_per_sample\": %.1f, \"read_ns_per_sample\": %.1f, \"mismatches\": %lu}%s\n",
+           waveform->name, (unsigned long)result->appended, (unsigned long)stats->samples,
+           (stats->last_us - stats->first_us) / 3600e6, AIR_HISTORY_BLOCKS * AIR_HISTORY_BLOCK_BYTES,
+           (unsigned long)stats->bytes, stats->bytes / n, (int)(sizeof(air_alg_result_t) + sizeof(uint32_t)),
+           result->append_ns / (double)result->appended, result->read_ns / n,
+           (unsigned long)result->mismatches, sep);
+}
+
+/**
+ * Reporting benchmark. Filters an hour of 1 Hz samples read on nINT through
+ * AIR_REPORT_DEFAULT for each waveform and reports how many were suppressed.
+ */
+const int AIR_BENCH_REPORT_SECONDS = 3600;
+
+void air_bench_report_print(const air_bench_waveform_t *waveform, const char *sep) {
+    air_sim_reset();
+    air_sim.eco2_waveform = waveform->eco2;
+    air_sim.tvoc_waveform = waveform->tvoc;
+    air_boot();
+    air_write_mode(AIR_MODE_1_SECOND);
+    air_write_interrupt(true, 0);
+    
+    air_report_t report;
+    memset(&report, 0, sizeof(air_report_t));
+    
+    for (int i = 0; i < AIR_BENCH_REPORT_SECONDS; i++) {
+        if (air_sim_wait_nint() != 0) {
+            die("air: bench: nINT never asserted");
+        }
+        
+        air_sample_t sample;
+        air_read_alg_result(&sample.result);
+        sample.timestamp_us = air_now_us();
+        sample.seq = i;
+        
+        air_report_filter(&report, &AIR_REPORT_DEFAULT, &sample);
+    }
+    
+    const air_report_stats_t *stats = &report.stats;
+    
+    printf("    {\"waveform\": \"%s\", \"eco2_deadband\": %d, \"tvoc_deadband\": %d, \"heartbeat_ms\": %lu, "
+           "\"samples\": %lu, \"reported\": %lu, \"heartbeats\": %lu, \"suppressed\": %lu, "
+           "\"suppressed_pct\": %.1f}%s\n",
+           waveform->name, AIR_REPORT_DEFAULT.eco2_deadband, AIR_REPORT_DEFAULT.tvoc_deadband,
+           (unsigned long)AIR_REPORT_DEFAULT.heartbeat_ms, (unsigned long)stats->samples,
+           (unsigned long)stats->reported, (unsigned long)stats->heartbeats, (unsigned long)stats->suppressed,
+           100.0 * stats->suppressed / stats->samples, sep);
+}
+
+/**
+ * Flash log benchmark.
+ *
+ * Appends AIR_BENCH_LOG_RECORDS records, syncing every 1, 4 and 16 records,
+ * and reports flash bytes programmed per record byte, sector erases and their
+ * spread over the log sectors.
+ *
+ * Then keeps appending, syncing every 4 records, while the power is cut in a
+ * random program or erase AIR_BENCH_LOG_CUTS times. After each cut the log is
+ * mounted again and checked: records must be intact, in order and without
+ * gaps, and every record programmed before the cut must still be there unless
+ * its sector was rotated out. Records kept are counted once the log is full.
+ */
+const int AIR_BENCH_LOG_RECORDS = 20000;
+const int AIR_BENCH_LOG_SYNCS[] = { 1, 4, 16 };
+const int AIR_BENCH_LOG_SYNC_COUNT = sizeof(AIR_BENCH_LOG_SYNCS) / sizeof(AIR_BENCH_LOG_SYNCS[0]);
+const int AIR_BENCH_LOG_CUT_SYNC = 4;
+const int AIR_BENCH_LOG_CUTS = 500;
+
+/**
+ * Sample stored as record seq, so a read back record can be checked.
+ */
+void air_bench_log_sample(uint32_t seq, air_sample_t *sample) {
+    sample->seq = seq;
+    sample->timestamp_us = seq * 1000000ULL;
+    sample->result.eco2 = 400 + seq % 1000;
+    sample->result.tvoc = (seq * 7) & 0x3FF;
+}
+
+bool air_bench_log_check(const air_sample_t *sample) {
+    air_sample_t expected;
+    air_bench_log_sample(sample->seq, &expected);
+    
+    return sample->timestamp_us == expected.timestamp_us && sample->result.eco2 == expected.result.eco2 &&
+           sample->result.tvoc == expected.result.tvoc;
+}
+
+void air_bench_log_print_writes(int sync) {
+    air_sim_reset();
+    air_sim_flash_wipe();
+    if (air_log_mount() != AIR_OK) {
+        die("air: bench: log mount failed");
+    }
+    
+    for (int i = 0; i < AIR_BENCH_LOG_RECORDS; i++) {
+        air_sample_t sample;
+        air_bench_log_sample(air_log_next_seq, &sample);
+        
+        int err = air_log_append(&sample);
+        if (err == AIR_OK && (i + 1) % sync == 0) {
+            err = air_log_sync();
+        }
+        if (err != AIR_OK) {
+            die("air: bench: log append failed");
+        }
+    }
+    
+    uint32_t erase_min;
+    uint32_t erase_max;
+    air_log_erase_counts(&erase_min, &erase_max);
+    
+    printf("    {\"sync_records\": %d, \"records\": %d, \"pages\": %lu, \"programmed_bytes_per_record\": %.1f, "
+           "\"write_amplification\": %.2f, \"sector_erases\": %lu, \"sector_erase_count_min\": %lu, "
+           "\"sector_erase_count_max\": %lu}",
+           sync, AIR_BENCH_LOG_RECORDS, (unsigned long)air_sim_flash.programs,
+           (double)air_sim_flash.programmed_bytes / AIR_BENCH_LOG_RECORDS,
+           (double)air_sim_flash.programmed_bytes / AIR_BENCH_LOG_RECORDS / AIR_LOG_RECORD_BYTES,
+           (unsigned long)air_sim_flash.erases, (unsigned long)erase_min, (unsigned long)erase_max);
+}
+
+void air_bench_log_print_cuts() {
+    air_sim_reset();
+    air_sim_flash_wipe();
+    if (air_log_mount() != AIR_OK) {
+        die("air: bench: log mount failed");
+    }
+    
+    uint32_t unsynced = 0;
+    uint32_t torn_max = 0;
+    uint32_t retained_min = 0xFFFFFFFF;
+    uint32_t lost_durable = 0;
+    uint32_t corrupt = 0;
+    uint32_t gaps = 0;
+    
+    for (int cut = 0; cut < AIR_BENCH_LOG_CUTS; cut++) {
+        air_sim_flash.cut_countdown = 1 + (int)(air_sim_rand() * 40);
+        
+        while (true) {
+            air_sample_t sample;
+            air_bench_log_sample(air_log_next_seq, &sample);
+            
+            int err = air_log_append(&sample);
+            if (err == AIR_OK && air_log_next_seq % AIR_BENCH_LOG_CUT_SYNC == 0) {
+                err = air_log_sync();
+            }
+            if (err != AIR_OK) {
+                break;
+            }
+        }
+        
+        uint32_t durable_seq = air_log_stats.durable_seq;
+        uint32_t appended_seq = air_log_next_seq;
+        
+        air_sim_flash_power_cycle();
+        if (air_log_mount() != AIR_OK) {
+            die("air: bench: log mount after power cut failed");
+        }
+        
+        if (air_log_stats.torn > torn_max) {
+            torn_max = air_log_stats.torn;
+        }
+        
+        air_log_iter_t iter;
+        air_sample_t sample;
+        uint32_t retained = 0;
+        uint32_t next_seq = 0;
+        
+        air_log_begin(&iter, 0);
+        while (air_log_next(&iter, &sample)) {
+            if (!air_bench_log_check(&sample)) {
+                corrupt++;
+            }
+            if (retained > 0 && sample.seq != next_seq) {
+                gaps++;
+            }
+            
+            retained++;
+            next_seq = sample.seq + 1;
+        }
+        
+        unsynced += appended_seq - next_seq;
+        
+        // Only once every sector has been used
+        if (air_log_headers[air_log_active].seq > AIR_LOG_SECTORS && retained < retained_min) {
+            retained_min = retained;
+        }
+        if (next_seq < durable_seq) {
+            lost_durable += durable_seq - next_seq;
+        }
+    }
+    
+    printf("  \"log_cuts\": {\"cuts\": %d, \"sync_records\": %d, \"unsynced_records_lost_mean\": %.2f, "
+           "\"torn_records_max\": %lu, \"retained_records_min_full\": %lu, \"lost_durable_records\": %lu, "
+           "\"corrupt_records\": %lu, \"gaps\": %lu}",
+           AIR_BENCH_LOG_CUTS, AIR_BENCH_LOG_CUT_SYNC, (double)unsynced / AIR_BENCH_LOG_CUTS,
+           (unsigned long)torn_max, (unsigned long)retained_min, (unsigned long)lost_durable,
+           (unsigned long)corrupt, (unsigned long)gaps);
+}
+
+/**
+ * Telemetry decoder benchmark.
+ *
+ * Encodes AIR_BENCH_TLM_FRAMES frames, mostly samples with a status, event
+ * or error now and then, and decodes them in AIR_BENCH_TLM_CHUNK byte chunks
+ * as they would arrive from a serial port. The same samples as text lines are
+ * parsed with sscanf for comparison. A second pass corrupts a byte in 1% of
+ * the frames and checks they are all caught.
+ */
+const int AIR_BENCH_TLM_FRAMES = 1000000;
+const int AIR_BENCH_TLM_CHUNK = 4096;
+const int AIR_BENCH_TLM_CORRUPT_EVERY = 100;
+
+typedef struct {
+    uint32_t samples;
+    uint32_t others;
     
     /**
-     * Total volume of carbon (TVOC) in ppb from 0 1187.
+     * Samples whose values do not match their sequence number.
      */
-    uint16_t tvoc;
-} air_alg_result_t;
+    uint32_t bad;
+} air_bench_tlm_count_t;
 
-void air_read_alg_result(air_alg_result_t *air_alg_result) {
-    // Read register
-    if (i2c.write(AIR_ADDR, &AIR_ALG_RESULT_DATA_REG, 1) != 0) {
-        die("air: read_alg_result: failed to select alg result data register");
+void air_bench_tlm_sample(uint32_t seq, air_sample_t *sample) {
+    sample->seq = seq;
+    sample->timestamp_us = seq * 1000000ULL;
+    sample->result.eco2 = 400 + seq % 1000;
+    sample->result.tvoc = seq % 500;
+}
+
+void air_bench_tlm_handle(void *ctx, const air_tlm_frame_t *frame) {
+    air_bench_tlm_count_t *count = (air_bench_tlm_count_t *)ctx;
+    
+    if (frame->type != AIR_TLM_SAMPLE) {
+        count->others++;
+        return;
     }
     
-    char buf[4];
-    if (i2c.read(AIR_ADDR, buf, 4) != 0) {
-        die("air: read_alg_result: failed to read alg result data register");
+    air_sample_t expected;
+    air_bench_tlm_sample(air_tlm_get_u32(&frame->body[0]), &expected);
+    
+    count->samples++;
+    if (frame->body_len != 8 || air_tlm_get_u16(&frame->body[4]) != expected.result.eco2 ||
+        air_tlm_get_u16(&frame->body[6]) != expected.result.tvoc ||
+        frame->timestamp_ms != expected.timestamp_us / 1000) {
+        count->bad++;
+    }
+}
+
+/**
+ * Decode a stream in chunks.
+ * Returns: CPU time in ns
+ */
+uint64_t air_bench_tlm_decode(uint8_t *stream, int len, air_tlm_decoder_t *decoder, air_bench_tlm_count_t *count) {
+    memset(decoder, 0, sizeof(air_tlm_decoder_t));
+    memset(count, 0, sizeof(air_bench_tlm_count_t));
+    
+    uint64_t start_ns = air_bench_cpu_ns();
+    
+    for (int offset = 0; offset < len; offset += AIR_BENCH_TLM_CHUNK) {
+        int n = len - offset < AIR_BENCH_TLM_CHUNK ? len - offset : AIR_BENCH_TLM_CHUNK;
+        air_tlm_decode(decoder, &stream[offset], n, air_bench_tlm_handle, count);
     }
     
-    // Unpack into air_alg_result_data_t
-    air_alg_result->eco2 = (buf[0] << 8) | buf[1];
-    air_alg_result->tvoc = (buf[2] << 8) | buf[3];
+    return air_bench_cpu_ns() - start_ns;
 }
 
-int main() {
+void air_bench_tlm_print() {
+    uint8_t *stream = (uint8_t *)malloc((size_t)AIR_BENCH_TLM_FRAMES * AIR_TLM_FRAME_MAX);
+    uint8_t *copy = (uint8_t *)malloc((size_t)AIR_BENCH_TLM_FRAMES * AIR_TLM_FRAME_MAX);
+    char *text = (char *)malloc((size_t)AIR_BENCH_TLM_FRAMES * 32);
+    int len = 0;
+    int text_len = 0;
+    int samples = 0;
+    
     air_status_t air_status;
+    memset(&air_status, 0, sizeof(air_status_t));
+    air_info_t info;
+    memset(&info, 0, sizeof(air_info_t));
     
-    // Boot air sensor
-    printf("air: booting\r\n");
-    air_boot();
-    air_die();
-    printf("air: booted\r\n");
+    for (int i = 0; i < AIR_BENCH_TLM_FRAMES; i++) {
+        if (i % 1000 == 999) {
+            len += air_tlm_encode_status(&stream[len], i * 1000, &air_status, &info);
+        } else if (i % 1000 == 500) {
+            uint8_t body[5] = { AIR_TLM_EVENT_NO_SAMPLE, 0x88, 0x13, 0, 0 };
+            len += air_tlm_encode(&stream[len], AIR_TLM_EVENT, i * 1000, body, sizeof(body));
+        } else if (i % 10000 == 250) {
+            const char *error = "\x10" "air: error: the heater's current was not in range";
+            len += air_tlm_encode(&stream[len], AIR_TLM_ERROR, i * 1000, (const uint8_t *)error, 1 + AIR_TLM_TEXT_MAX);
+        } else {
+            air_sample_t sample;
+            air_bench_tlm_sample(i, &sample);
+            len += air_tlm_encode_sample(&stream[len], &sample);
+            text_len += sprintf(&text[text_len], "air: eco2=%d tvoc=%d\r\n", sample.result.eco2,
+                                sample.result.tvoc);
+            samples++;
+        }
+    }
     
-    // Set measurement drive mode
-    printf("air: setting measurement mode\r\n");
-    air_write_mode(AIR_MODE_1_SECOND);
-    air_die();
-    printf("air: set measurement mode\r\n");
+    air_tlm_decoder_t decoder;
+    air_bench_tlm_count_t count;
+    
+    memcpy(copy, stream, len);
+    uint64_t decode_ns = air_bench_tlm_decode(copy, len, &decoder, &count);
+    
+    // Text baseline, the line parsing a gateway does today
+    uint64_t start_ns = air_bench_cpu_ns();
+    int text_samples = 0;
+    for (char *line = text; line < text + text_len; ) {
+        char *end = (char *)memchr(line, '\n', text + text_len - line);
+        *end = '\0';
+        
+        int eco2, tvoc;
+        if (sscanf(line, "air: eco2=%d tvoc=%d", &eco2, &tvoc) == 2) {
+            text_samples++;
+        }
+        line = end + 1;
+    }
+    uint64_t text_ns = air_bench_cpu_ns() - start_ns;
+    
+    printf("  \"telemetry\": {\"frames\": %d, \"bytes\": %d, \"sample_frame_bytes\": %d, \"chunk_bytes\": %d, "
+           "\"decoded\": %lu, \"samples\": %lu, \"bad_samples\": %lu, \"crc_errors\": %lu, "
+           "\"framing_errors\": %lu, \"frames_per_sec\": %.0f, \"mbytes_per_sec\": %.1f, "
+           "\"text_sample_line_bytes\": %.1f, \"text_samples\": %d, \"text_lines_per_sec\": %.0f,\n",
+           AIR_BENCH_TLM_FRAMES, len, AIR_TLM_HEADER_BYTES + 8 + 2 + 2, AIR_BENCH_TLM_CHUNK,
+           (unsigned long)decoder.frames, (unsigned long)count.samples, (unsigned long)count.bad,
+           (unsigned long)decoder.crc_errors, (unsigned long)decoder.framing_errors,
+           decoder.frames * 1e9 / decode_ns, len * 1e3 / decode_ns,
+           (double)text_len / samples, text_samples, text_samples * 1e9 / text_ns);
+    
+    // Corrupt one byte of every AIR_BENCH_TLM_CORRUPT_EVERY frames
+    memcpy(copy, stream, len);
+    int corrupted = 0;
+    int frame = 0;
+    for (int i = 0, start = 0; i < len; i++) {
+        if (stream[i] != 0) {
+            continue;
+        }
+        
+        if (frame++ % AIR_BENCH_TLM_CORRUPT_EVERY == 0) {
+            int at = start + (int)(air_sim_rand() * (i - start));
+            copy[at] ^= 1 + (int)(air_sim_rand() * 255);
+            corrupted++;
+        }
+        start = i + 1;
+    }
+    
+    air_bench_tlm_decode(copy, len, &decoder, &count);
+    
+    printf("    \"corrupted\": %d, \"corrupted_decoded\": %lu, \"corrupted_bad_samples\": %lu, "
+           "\"corrupted_crc_errors\": %lu, \"corrupted_framing_errors\": %lu}\n",
+           corrupted, (unsigned long)decoder.frames, (unsigned long)count.bad,
+           (unsigned long)decoder.crc_errors, (unsigned long)decoder.framing_errors);
+    
+    free(stream);
+    free(copy);
+    free(text);
+}
+
+int main() {
+    printf("{\n  \"samples_per_run\": %d,\n  \"poll_ms\": %d,\n  \"runs\": [\n",
+           AIR_BENCH_SAMPLES, AIR_BENCH_POLL_MS);
+    
+    for (int drive_mode = 1; drive_mode <= 3; drive_mode++) {
+        for (int strategy = 0; strategy < 3; strategy++) {
+            air_bench_result_t result;
+            air_bench_run(drive_mode, strategy, &result);
+            
+            bool last = drive_mode == 3 && strategy == 2;
+            air_bench_print(&result, last ? "" : ",");
+        }
+    }
+    
+    printf("  ],\n  \"recovery_seconds\": %d,\n  \"recovery\": [\n", AIR_BENCH_RECOVERY_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_SCENARIO_COUNT; i++) {
+        air_bench_recovery_t result;
+        air_bench_recovery_run(&AIR_BENCH_SCENARIOS[i], &result);
+        air_bench_recovery_print(&AIR_BENCH_SCENARIOS[i], &result, i == AIR_BENCH_SCENARIO_COUNT - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n  \"hang_seconds\": %d,\n  \"hang\": [\n", AIR_BENCH_HANG_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_HANGS; i++) {
+        air_bench_hang_t result;
+        air_bench_hang_run(i, &result);
+        air_bench_hang_print(i, &result, i == AIR_BENCH_HANGS - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n  \"supervisor_seconds\": %d,\n  \"supervisor\": [\n", AIR_BENCH_SUPERVISOR_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_SUPERVISOR_FAULTS; i++) {
+        air_bench_supervisor_t result;
+        air_bench_supervisor_run(i, &result);
+        air_bench_supervisor_print(i, &result, i == AIR_BENCH_SUPERVISOR_FAULTS - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n");
+    
+    air_bench_plug_t plug;
+    air_bench_plug_run(&plug);
+    air_bench_plug_print(&plug);
+    
+    printf(",\n  \"restart_seconds\": %d,\n  \"restart\": [\n", AIR_BENCH_RESTART_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_RESTARTS; i++) {
+        air_bench_restart_t result;
+        air_bench_restart_run(i, &result);
+        air_bench_restart_print(i, &result, i == AIR_BENCH_RESTARTS - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n");
+    
+    air_bench_fw_t fw;
+    air_bench_fw_run(&fw);
+    air_bench_fw_print(&fw);
+    
+    printf(",\n");
+    air_bench_cache_t cache;
+    air_bench_cache_run(&cache);
+    air_bench_cache_print(&cache);
+    
+    printf(",\n");
+    air_bench_pipeline_print();
+    
+    printf(",\n  \"history_seconds\": %d,\n  \"history\": [\n", AIR_BENCH_HISTORY_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_WAVEFORM_COUNT; i++) {
+        air_bench_history_t result;
+        air_bench_history_run(&AIR_BENCH_WAVEFORMS[i], &result);
+        air_bench_history_print(&AIR_BENCH_WAVEFORMS[i], &result, i == AIR_BENCH_WAVEFORM_COUNT - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n  \"report_seconds\": %d,\n  \"report\": [\n", AIR_BENCH_REPORT_SECONDS);
+    
+    for (int i = 0; i < AIR_BENCH_WAVEFORM_COUNT; i++) {
+        air_bench_report_print(&AIR_BENCH_WAVEFORMS[i], i == AIR_BENCH_WAVEFORM_COUNT - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n  \"latest_ms\": %d,\n  \"latest\": [\n", AIR_BENCH_LATEST_MS);
+    
+    for (int method = 0; method < 2; method++) {
+        for (int i = 0; i < AIR_BENCH_LATEST_READER_COUNTS; i++) {
+            air_bench_latest_t result;
+            air_bench_latest_run(method, AIR_BENCH_LATEST_READERS[i], &result);
+            
+            bool last = method == 1 && i == AIR_BENCH_LATEST_READER_COUNTS - 1;
+            air_bench_latest_print(&result, last ? "" : ",");
+        }
+    }
+    
+    printf("  ],\n  \"log_writes\": [\n");
+    
+    for (int i = 0; i < AIR_BENCH_LOG_SYNC_COUNT; i++) {
+        air_bench_log_print_writes(AIR_BENCH_LOG_SYNCS[i]);
+        printf("%s\n", i == AIR_BENCH_LOG_SYNC_COUNT - 1 ? "" : ",");
+    }
+    
+    printf("  ],\n");
+    air_bench_log_print_cuts();
+    printf(",\n");
+    air_bench_tlm_print();
+    printf("}\n");
+    
+    return 0;
+}
+#elif defined(AIR_CORO)
+int main() {
+    air_co_executor.spawn(air_co_acquire(5));
+    air_co_executor.spawn(air_co_heartbeat(5));
+    air_co_executor.run();
+    
+    return 0;
+}
+#else
+int main() {
+    if (air_watchdog_caused_reset()) {
+        air_out_event(AIR_TLM_EVENT_WATCHDOG_RESET, 0, "air: restarted by the watchdog\r\n");
+    }
+    
+    // Sensor set up by the supervisor whenever one is plugged in
+    const char meas_mode = air_mode_drive_mode_t::set(AIR_MODE_RESET_VALUE, AIR_MODE_1_SECOND);
+    
+    // After a warm reset carry on with the sensor as it was left
+    if (air_retain_load() && air_try_resume() == AIR_OK) {
+        air_out_event(AIR_TLM_EVENT_RESUMED, air_retained.warm_restarts,
+                      "air: resumed after warm restart %lu\r\n", (unsigned long)air_retained.warm_restarts);
+    } else if (air_probe() == AIR_OK) {
+        // Update air sensor firmware if an image was copied onto the mbed drive
+        FILE *fw_file = fopen(AIR_FW_UPDATE_PATH, "rb");
+        if (fw_file != NULL) {
+            air_out_text("air: updating firmware\r\n");
+            
+            air_fw_update_stats_t fw_stats;
+            air_fw_update(air_fw_read_file, fw_file, &fw_stats);
+            
+            fclose(fw_file);
+            remove(AIR_FW_UPDATE_PATH);
+            
+            air_out_event(AIR_TLM_EVENT_FW_UPDATED, fw_stats.bytes,
+                          "air: updated firmware, %d bytes in %d ms (erase=%d ms, data=%d ms, verify=%d ms)\r\n",
+                          fw_stats.bytes, fw_stats.total_ms, fw_stats.erase_ms, fw_stats.data_ms, fw_stats.verify_ms);
+        }
+        
+        // Boot air sensor
+        air_out_event(AIR_TLM_EVENT_BOOTING, 0, "air: booting\r\n");
+        air_boot();
+        air_die();
+        
+        air_out_info(air_info());
+        
+        // Set measurement drive mode
+        air_out_text("air: setting measurement mode\r\n");
+        air_write_meas_mode(meas_mode);
+        air_die();
+        air_retain_started();
+        air_out_event(AIR_TLM_EVENT_MODE_SET, AIR_MODE_1_SECOND, "air: set measurement mode\r\n");
+    } else {
+        air_out_event(AIR_TLM_EVENT_REMOVED, 0, "air: no sensor, waiting for one\r\n");
+    }
+    air_retain_save();
+    
+#ifdef AIR_LOG
+    // Carry on the sample log from before the last reset
+    if (air_log_mount() != AIR_OK) {
+        die("air: log: failed to mount");
+    }
+#ifndef AIR_TELEMETRY
+    air_log_dump();
+#endif
+#endif
+    
+#ifdef AIR_RTOS
+    // Acquire from the sensor's nINT output in its own thread, print here
+    air_acq_mail_t air_mail;
+    air_acq_subscribe(&air_mail);
+    air_acq_start(true, 0, meas_mode);
+#ifdef AIR_SIM
+    air_cache_sim_start();
+#endif
+    
+    while (1) {
+        air_raw_sample_t *slot;
+        if (!air_mail.get(&slot, 5000)) {
+            air_out_event(AIR_TLM_EVENT_NO_SAMPLE, 5000, "air: no sample for 5 s\r\n");
+            continue;
+        }
+        
+        // Kept by the history and the log, so unpacked once
+        air_sample_t sample;
+        air_raw_sample_decode(slot, &sample);
+        air_acq_pool.release(slot);
+        
+        // The acquisition thread saves the sensor state, the report is
+        // saved here
+        if (air_retain_report(&sample)) {
+            air_out_sample(&sample);
+        }
+        air_history_append(&sample);
+#ifdef AIR_LOG
+        air_log_append(&sample);
+#endif
+        
+#ifndef AIR_TELEMETRY
+        if (sample.seq % 60 == 59) {
+            air_acq_dump();
+            air_bus_dump();
+            air_i2c_dump();
+            air_history_dump();
+            air_cache_dump();
+            // Report filter state survives warm restarts
+            air_report_dump(&air_retained.report);
+#ifdef AIR_LOG
+            air_log_dump();
+#endif
+        }
+#endif
+    }
+#else
+    // Report filter state survives warm restarts
+    air_report_t *report = &air_retained.report;
+    
+    // Recover from sensor faults and unplugging instead of exiting
+    air_supervisor_t supervisor;
+    air_supervisor_start(&supervisor, &AIR_SUPERVISOR_DEFAULT, meas_mode);
+    
+    air_retry_stats_t retry_stats;
+    memset(&retry_stats, 0, sizeof(air_retry_stats_t));
     
     while (1) {
+        air_sample_t sample;
+        int err = AIR_ERR_ABSENT;
+        
         // Poll until new sample is ready
-        air_read_status(&air_status);
+        if (supervisor.present) {
+            err = air_poll_sample(&sample.result, &AIR_RETRY_DEFAULT, &retry_stats);
+        }
         
-        do {
-            // Read status
-            printf("air: polling status until data ready\r\n");
-            air_read_status(&air_status);
-            air_die();
+        int action = air_supervise(&supervisor, &AIR_SUPERVISOR_DEFAULT, err);
+        if (action == AIR_SUPERVISOR_REMOVED) {
+            air_out_event(AIR_TLM_EVENT_REMOVED, 0, "air: sensor removed\r\n");
+        } else if (action == AIR_SUPERVISOR_APPEARED) {
+            air_out_event(AIR_TLM_EVENT_APPEARED, air_addr >> 1, "air: sensor appeared at %#x\r\n", air_addr >> 1);
+            air_out_info(air_info());
+        } else if (action != AIR_SUPERVISOR_HEALTHY) {
+            air_out_event(AIR_TLM_EVENT_RECOVERY, action, "air: supervisor: %s\r\n",
+                          AIR_SUPERVISOR_LEVEL_NAMES[action]);
+        }
+        
+        if (err != AIR_OK) {
             wait(0.5);
-        } while (!air_status.data_ready);
-    
-        printf("air: data ready\r\n");
+            continue;
+        }
         
-        air_alg_result_t air_alg_result;
-        air_read_alg_result(&air_alg_result);
+        sample.timestamp_us = air_now_us();
+        sample.seq = report->stats.samples;
+        
+        // Only print changes past the deadbands
+        if (air_report_filter(report, &AIR_REPORT_DEFAULT, &sample)) {
+            air_out_sample(&sample);
+        }
+        air_retain_sample();
         
-        printf("air: tvoc=%d\r\n", air_alg_result.tvoc);
+#ifndef AIR_TELEMETRY
+        if (report->stats.samples % 60 == 0) {
+            air_report_dump(report);
+            air_supervisor_dump(&supervisor);
+            air_i2c_dump();
+        }
+#endif
+        
+#ifdef AIR_LOG
+        air_log_append(&sample);
+#endif
+        
+#ifdef AIR_PROFILE
+        // Dump profile about once a minute
+        static int profile_samples = 0;
+        if (++profile_samples % AIR_PROFILE_DUMP_SAMPLES == 0) {
+            air_profile_dump();
+        }
+#endif
     }
+#endif
 }
+#endif